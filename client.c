@@ -2,9 +2,41 @@
  * client.c: A very, very primitive HTTP client.
  * 
  * Example usage:
- *      ./client www.example.com 80 /
+ *      ./client www.example.com 80 / GET
+ *      ./client --threads 4 --connections 8 --duration 10 localhost 8000
  *
  * This client sends a single HTTP request to a server and prints the response.
+ * With any of the benchmark options below it load tests the server instead
+ * (see loadgen.h) and reports throughput and latency percentiles:
+ *  -t, --threads N       load generator threads (default 1)
+ *  -c, --connections N   requests in flight per thread (default 1, or 256
+ *                        with --rate or a timed --replay)
+ *  -d, --duration SEC    run for SEC seconds (default 10 unless -n is given;
+ *                        a replay runs to the end of its trace)
+ *  -n, --requests N      stop after N requests in total
+ *  -u, --uri SPEC        add "[METHOD] URI [WEIGHT [BODY]]" to the request
+ *                        mix; repeatable (default: GET /home.html)
+ *  -m, --mix FILE        add one SPEC per line of FILE (# starts a comment)
+ *      --timeout SEC     give up on a request after SEC seconds (default 30)
+ *  -k, --keep-alive      reuse connections the server keeps open
+ *      --pipeline K      send K requests back to back per connection
+ *                        (closed loop only; at most LOADGEN_MAX_PIPELINE)
+ *      --slow BYTES:MS   send requests BYTES at a time, MS milliseconds apart
+ *      --ramp SEC        open the connections gradually over SEC seconds
+ *  -r, --rate R          open loop: send R requests per second in total,
+ *                        measuring latency from when each was due
+ *      --poisson         with --rate: Poisson arrivals instead of fixed gaps
+ *      --sweep END:STEP  with --rate: repeat at rate + STEP, ... up to END
+ *                        and report the knee of the latency curve
+ *      --slo MS          with --sweep: p99 a sustained rate must stay under
+ *      --replay FILE     send the JSONL trace in FILE (one record such as
+ *                        {"timestamp": 12.5, "method": "GET", "uri": "/"}
+ *                        per line) in order instead of a random mix
+ *      --speed X         replay at X times the original pace; 0 = as fast
+ *                        as possible (default 1)
+ *      --results FILE    log each replayed request's status and latency to
+ *                        FILE, one JSON line per record (default replay.jsonl)
+ *  -j, --json FILE       also write the results to FILE as JSON
  *
  * HW3: For testing your server, you will likely want to modify this client:
  *  - Add multi-threading support to test concurrency.
@@ -15,6 +47,8 @@
  */
 
 #include "segel.h"
+#include <getopt.h>
+#include "loadgen.h"
 
 // Sends an HTTP request to the server using the given socket
 void clientSend(int fd, char *filename, char* method)
@@ -66,18 +100,181 @@ void clientPrint(int fd)
     }
 }
 
+// Adds a request mix entry; exits if spec is malformed
+void clientAddMix(struct Loadgen_config *config, char *spec)
+{
+    config->mix = (struct Loadgen_request *)realloc(config->mix, (config->mix_len + 1) * sizeof(struct Loadgen_request));
+    if (!config->mix) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    if (loadgen_parse_request(strdup(spec), &config->mix[config->mix_len]) < 0) {
+        fprintf(stderr, "Bad request spec: %s\n", spec);
+        exit(1);
+    }
+    config->mix_len++;
+}
+
+// Adds every line of a mix file, skipping blank lines and comments
+void clientReadMix(struct Loadgen_config *config, char *path)
+{
+    char line[MAXLINE];
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char *spec = line + strspn(line, " \t");
+        if (*spec == '#' || *spec == '\n' || *spec == '\r' || *spec == '\0') continue;
+        clientAddMix(config, spec);
+    }
+    fclose(file);
+}
+
+// Reads a JSONL trace into the mix, skipping blank lines
+void clientReadTrace(struct Loadgen_config *config, char *path)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    while (getline(&line, &cap, file) > 0) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0') continue;
+        config->mix = (struct Loadgen_request *)realloc(config->mix, (config->mix_len + 1) * sizeof(struct Loadgen_request));
+        char *record = strdup(line);
+        if (!config->mix || !record) {
+            perror("Malloc failed");
+            exit(1);
+        }
+        if (loadgen_parse_record(record, &config->mix[config->mix_len]) < 0) {
+            fprintf(stderr, "%s:%d: bad trace record\n", path, lineno);
+            exit(1);
+        }
+        config->mix_len++;
+    }
+    free(line);
+    fclose(file);
+    if (!config->mix_len) {
+        fprintf(stderr, "%s: empty trace\n", path);
+        exit(1);
+    }
+    config->replay = path;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s <host> <port> <filename> <method>\n"
+                    "       %s [--threads N] [--connections N] [--duration SEC] [--requests N]\n"
+                    "          [--uri SPEC]... [--mix FILE] [--timeout SEC] [--keep-alive] [--pipeline K]\n"
+                    "          [--slow BYTES:MS] [--ramp SEC] [--rate R [--poisson]\n"
+                    "          [--sweep END:STEP] [--slo MS]] [--json FILE] <host> <port>\n"
+                    "       %s [--replay FILE [--speed X] [--results FILE]] [--threads N] ... <host> <port>\n",
+            prog, prog, prog);
+    exit(1);
+}
+
+// Parses the benchmark options; returns 1 if any was given
+int getargs(struct Loadgen_config *config, int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"threads",     required_argument, NULL, 't'},
+        {"connections", required_argument, NULL, 'c'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"requests",    required_argument, NULL, 'n'},
+        {"uri",         required_argument, NULL, 'u'},
+        {"mix",         required_argument, NULL, 'm'},
+        {"timeout",     required_argument, NULL, 'o'},
+        {"keep-alive",  no_argument,       NULL, 'k'},
+        {"pipeline",    required_argument, NULL, 'P'},
+        {"slow",        required_argument, NULL, 'S'},
+        {"ramp",        required_argument, NULL, 'R'},
+        {"rate",        required_argument, NULL, 'r'},
+        {"poisson",     no_argument,       NULL, 'p'},
+        {"sweep",       required_argument, NULL, 's'},
+        {"slo",         required_argument, NULL, 'l'},
+        {"json",        required_argument, NULL, 'j'},
+        {"replay",      required_argument, NULL, 'T'},
+        {"speed",       required_argument, NULL, 'x'},
+        {"results",     required_argument, NULL, 'L'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt, bench = 0, connections = 0, mixed = 0;
+
+    memset(config, 0, sizeof(*config));
+    config->threads = 1;
+    config->timeout = 30;
+    config->pipeline = 1;
+    config->speed = 1;
+    while ((opt = getopt_long(argc, argv, "t:c:d:n:u:m:kr:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't': config->threads = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 'd': config->duration = atof(optarg); break;
+            case 'n': config->requests = atol(optarg); break;
+            case 'u': clientAddMix(config, optarg); mixed = 1; break;
+            case 'm': clientReadMix(config, optarg); mixed = 1; break;
+            case 'o': config->timeout = atof(optarg); break;
+            case 'k': config->keep_alive = 1; break;
+            case 'P': config->pipeline = atoi(optarg); break;
+            case 'S':
+                if (sscanf(optarg, "%d:%lf", &config->slow_bytes, &config->slow_delay) != 2) usage(argv[0]);
+                break;
+            case 'R': config->ramp = atof(optarg); break;
+            case 'r': config->rate = atof(optarg); break;
+            case 'p': config->poisson = 1; break;
+            case 's':
+                if (sscanf(optarg, "%lf:%lf", &config->sweep_to, &config->sweep_step) != 2) usage(argv[0]);
+                break;
+            case 'l': config->slo = atof(optarg); break;
+            case 'j': config->json_path = optarg; break;
+            case 'T':
+                if (config->replay) usage(argv[0]);
+                clientReadTrace(config, optarg);
+                break;
+            case 'x': config->speed = atof(optarg); break;
+            case 'L': config->results_path = optarg; break;
+            default: usage(argv[0]);
+        }
+        bench = 1;
+    }
+    int open_loop = config->replay ? config->speed > 0 : config->rate > 0;
+    config->connections = connections ? connections : open_loop ? 256 : 1;
+    if (config->threads <= 0 || config->connections <= 0 || config->timeout <= 0 || config->rate < 0) usage(argv[0]);
+    if (config->sweep_step > 0 && (config->rate <= 0 || config->sweep_to <= config->rate)) usage(argv[0]);
+    if (config->pipeline < 1 || config->pipeline > LOADGEN_MAX_PIPELINE ||
+        (config->pipeline > 1 && open_loop) || config->slow_bytes < 0) usage(argv[0]);
+    // A replay sends its trace, at its own pace
+    if (config->replay && (mixed || config->rate > 0 || config->poisson || config->speed < 0)) usage(argv[0]);
+    if (config->replay && !config->results_path) config->results_path = "replay.jsonl";
+    return bench;
+}
+
 int main(int argc, char *argv[])
 {
     char *host, *filename, *method;
     int port;
     int clientfd;
+    struct Loadgen_config config;
+
+    if (getargs(&config, argc, argv)) {
+        if (argc - optind != 2) usage(argv[0]);
+        config.host = argv[optind];
+        config.port = atoi(argv[optind + 1]);
+        if (!config.mix_len) clientAddMix(&config, "GET /home.html");
+        if (!config.replay && config.duration <= 0 && config.requests <= 0) config.duration = 10;
+        return loadgen_run(&config) < 0;
+    }
 
     // Validate input arguments
     if (argc != 5) {
-        fprintf(stderr, "Usage: %s <host> <port> <filename> <method>\n", argv[0]);
-        exit(1);
+        usage(argv[0]);
     }
-
     // Parse command-line arguments
     host = argv[1];
     port = atoi(argv[2]);
@@ -0,0 +1,32 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+#include <time.h>
+
+// CLOCK_MONOTONIC readings shared by the server's modules and its load and
+// benchmark tools. Request timestamps (arrival, dispatch, first byte),
+// latencies and the limiter's windows are all in microseconds on this
+// clock, so they can be subtracted from one another.
+
+// Now, in microseconds
+static inline long monotonic_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Now, in nanoseconds
+static inline long monotonic_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Now, in whole seconds, from the coarse clock: a few ns to read, but only
+// as fine as a scheduler tick. Enough for age-based log retention.
+static inline long monotonic_coarse_sec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+#endif // CLOCK_H
@@ -0,0 +1,23 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+#include <stdatomic.h>
+
+// Adds delta to an atomic counter that only one thread ever writes (a
+// worker's stats and histograms, a log shard's totals). The owner updates
+// it with a plain load and store rather than a locked read-modify-write;
+// other threads may read it at any time and never see a torn value.
+#define counter_add(counter, delta) _Generic((counter), \
+    _Atomic long*: counter_add_long,                       \
+    _Atomic unsigned long*: counter_add_ulong)(counter, delta)
+
+static inline void counter_add_long(_Atomic long* counter, long delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+static inline void counter_add_ulong(_Atomic unsigned long* counter, unsigned long delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+#endif // COUNTER_H
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "epoch.h"
+
+// Per-thread reader state, registered on the thread's first epoch_enter
+struct Epoch_record {
+    _Atomic unsigned long epoch; // Global epoch observed on entry
+    _Atomic int active;          // Inside a read-side critical section
+    pthread_t owner;
+    struct Epoch_record* next;
+};
+
+// An object waiting for every reader to move past `epoch`
+struct Epoch_retired {
+    void* ptr;
+    void (*free_fn)(void*);
+    unsigned long epoch;
+    struct Epoch_retired* next;
+};
+
+struct Epoch_domain {
+    unsigned long id;                      // Distinguishes domains in the per-thread cache
+    _Atomic unsigned long global;
+    struct Epoch_record* _Atomic records;  // Push-only list of readers
+    _Atomic int pending;                   // Retired objects are waiting to be freed
+    pthread_mutex_t mutex;                 // Guards registration and the retired list
+    struct Epoch_retired* retired;
+};
+
+// Each thread caches its record for the last domain it used
+static _Atomic unsigned long next_domain_id = 1;
+static __thread unsigned long local_domain_id;
+static __thread struct Epoch_record* local_record;
+
+epoch_domain create_epoch_domain() {
+    epoch_domain domain = (epoch_domain)malloc(sizeof(struct Epoch_domain));
+    if (!domain) return NULL;
+    domain->id = atomic_fetch_add(&next_domain_id, 1);
+    atomic_init(&domain->global, 0);
+    atomic_init(&domain->records, NULL);
+    atomic_init(&domain->pending, 0);
+    pthread_mutex_init(&domain->mutex, NULL);
+    domain->retired = NULL;
+    return domain;
+}
+
+void destroy_epoch_domain(epoch_domain domain) {
+    if (!domain) return;
+    struct Epoch_retired* item = domain->retired;
+    while (item) {
+        struct Epoch_retired* next = item->next;
+        item->free_fn(item->ptr);
+        free(item);
+        item = next;
+    }
+    struct Epoch_record* record = atomic_load(&domain->records);
+    while (record) {
+        struct Epoch_record* next = record->next;
+        free(record);
+        record = next;
+    }
+    pthread_mutex_destroy(&domain->mutex);
+    free(domain);
+}
+
+// Returns the calling thread's record, registering one on first use. A
+// reader without a record would not be protected at all, so failing to
+// allocate one is fatal.
+static struct Epoch_record* get_local_record(epoch_domain domain) {
+    if (local_domain_id == domain->id) {
+        return local_record;
+    }
+    pthread_t self = pthread_self();
+    struct Epoch_record* record;
+    for (record = atomic_load(&domain->records); record; record = record->next) {
+        if (pthread_equal(record->owner, self)) break;
+    }
+    if (!record) {
+        record = (struct Epoch_record*)malloc(sizeof(struct Epoch_record));
+        // Without a record the caller cannot be protected, and epoch_enter
+        // has no way to fail
+        if (!record) {
+            perror("epoch: malloc failed");
+            exit(1);
+        }
+        atomic_init(&record->epoch, 0);
+        atomic_init(&record->active, 0);
+        record->owner = self;
+        pthread_mutex_lock(&domain->mutex);
+        record->next = atomic_load_explicit(&domain->records, memory_order_relaxed);
+        atomic_store_explicit(&domain->records, record, memory_order_release);
+        pthread_mutex_unlock(&domain->mutex);
+    }
+    local_domain_id = domain->id;
+    local_record = record;
+    return record;
+}
+
+// Advances the global epoch if every active reader has observed it, then
+// frees whatever was retired two epochs ago. Caller holds the mutex.
+static void try_reclaim(epoch_domain domain) {
+    unsigned long global = atomic_load(&domain->global);
+    for (struct Epoch_record* record = atomic_load(&domain->records); record; record = record->next) {
+        if (atomic_load(&record->active) && atomic_load(&record->epoch) != global) {
+            return;
+        }
+    }
+    global++;
+    atomic_store(&domain->global, global);
+
+    struct Epoch_retired** link = &domain->retired;
+    while (*link) {
+        struct Epoch_retired* item = *link;
+        if (item->epoch + 2 <= global) {
+            *link = item->next;
+            item->free_fn(item->ptr);
+            free(item);
+        } else {
+            link = &item->next;
+        }
+    }
+    atomic_store(&domain->pending, domain->retired != NULL);
+}
+
+void epoch_enter(epoch_domain domain) {
+    struct Epoch_record* record = get_local_record(domain);
+    atomic_store_explicit(&record->active, 1, memory_order_relaxed);
+    atomic_store_explicit(&record->epoch, atomic_load(&domain->global), memory_order_relaxed);
+    // Publish the epoch before any shared pointer is loaded
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(epoch_domain domain) {
+    struct Epoch_record* record = get_local_record(domain);
+    atomic_store_explicit(&record->active, 0, memory_order_release);
+
+    // Help reclamation along, but never wait for it
+    if (atomic_load_explicit(&domain->pending, memory_order_relaxed) &&
+        pthread_mutex_trylock(&domain->mutex) == 0) {
+        try_reclaim(domain);
+        pthread_mutex_unlock(&domain->mutex);
+    }
+}
+
+// Waits until every reader that was inside an epoch when it was called has
+// left it: the global epoch moves on twice, as it must before try_reclaim
+// frees anything retired now
+static void epoch_synchronize(epoch_domain domain) {
+    pthread_mutex_lock(&domain->mutex);
+    unsigned long target = atomic_load(&domain->global) + 2;
+    while (atomic_load(&domain->global) < target) {
+        unsigned long global = atomic_load(&domain->global);
+        try_reclaim(domain);
+        if (atomic_load(&domain->global) == global) {
+            // A reader is still in an older epoch; let it finish
+            pthread_mutex_unlock(&domain->mutex);
+            sched_yield();
+            pthread_mutex_lock(&domain->mutex);
+        }
+    }
+    pthread_mutex_unlock(&domain->mutex);
+}
+
+void epoch_retire(epoch_domain domain, void* ptr, void (*free_fn)(void*)) {
+    struct Epoch_retired* item = (struct Epoch_retired*)malloc(sizeof(struct Epoch_retired));
+    if (!item) {
+        // No room to defer it: wait out the readers and free it now
+        epoch_synchronize(domain);
+        free_fn(ptr);
+        return;
+    }
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    pthread_mutex_lock(&domain->mutex);
+    item->epoch = atomic_load(&domain->global);
+    item->next = domain->retired;
+    domain->retired = item;
+    atomic_store(&domain->pending, 1);
+    try_reclaim(domain);
+    pthread_mutex_unlock(&domain->mutex);
+}
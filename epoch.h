@@ -0,0 +1,33 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+#include "segel.h"
+
+// Epoch-based reclamation for lock-free readers.
+// - Readers bracket every access to shared pointers with epoch_enter/epoch_exit.
+//   Neither call blocks.
+// - Writers unlink an object, then hand it to epoch_retire. The object is freed
+//   once every reader that could still hold a reference has left its epoch.
+
+typedef struct Epoch_domain* epoch_domain;
+
+// Creates a new reclamation domain
+epoch_domain create_epoch_domain();
+
+// Frees every retired object and the domain itself (no readers may be active)
+void destroy_epoch_domain(epoch_domain domain);
+
+// Marks the calling thread as reading shared state of this domain. A
+// thread's first call registers it with the domain; if that allocation
+// fails the process exits (see unix_error), as an unprotected read could
+// use freed memory.
+void epoch_enter(epoch_domain domain);
+
+// Ends the calling thread's read-side critical section
+void epoch_exit(epoch_domain domain);
+
+// Frees `ptr` with `free_fn` once no reader can still reference it. If it
+// cannot be queued for later (out of memory), waits for the readers and
+// frees it before returning, so it must not be called inside an epoch.
+void epoch_retire(epoch_domain domain, void* ptr, void (*free_fn)(void*));
+
+#endif // EPOCH_H
@@ -0,0 +1,54 @@
+#include "histogram.h"
+#include "counter.h"
+
+int histogram_bucket(long value) {
+    if (value < HIST_SUB_COUNT) return value < 0 ? 0 : (int)value;
+    int msb = 63 - __builtin_clzl((unsigned long)value);
+    if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    // (value >> shift) is in [HIST_SUB_COUNT, 2 * HIST_SUB_COUNT)
+    return (shift + 1) * HIST_SUB_COUNT + (int)(value >> shift) - HIST_SUB_COUNT;
+}
+
+long histogram_bucket_max(int bucket) {
+    if (bucket < HIST_SUB_COUNT) return bucket;
+    int shift = bucket / HIST_SUB_COUNT - 1;
+    long top = HIST_SUB_COUNT + bucket % HIST_SUB_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+void histogram_record(struct Histogram* hist, long value) {
+    if (value < 0) value = 0;
+    counter_add(&hist->counts[histogram_bucket(value)], 1);
+    counter_add(&hist->count, 1);
+    counter_add(&hist->sum, (unsigned long)value);
+}
+
+void histogram_merge(struct Histogram* dst, const struct Histogram* src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        unsigned long n = atomic_load_explicit(&src->counts[i], memory_order_relaxed);
+        if (n) counter_add(&dst->counts[i], n);
+    }
+    counter_add(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+    counter_add(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed));
+}
+
+long histogram_percentile(const struct Histogram* hist, double q) {
+    unsigned long total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    }
+    if (!total) return 0;
+    // The rank of the value wanted, counting from 1 (rounded up)
+    double exact = q * total;
+    unsigned long rank = (unsigned long)exact;
+    if (rank < exact) rank++;
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank) return histogram_bucket_max(i);
+    }
+    return histogram_bucket_max(HIST_BUCKETS - 1);
+}
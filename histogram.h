@@ -0,0 +1,40 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <stdatomic.h>
+
+// HDR-style log-linear histogram of non-negative integer values (e.g.
+// microseconds). Values below 2^HIST_SUB_BITS get a bucket each; above that
+// every power of two is split into 2^HIST_SUB_BITS equal buckets, so a
+// bucket is never wider than 1/8 of its values. Recording is a few relaxed
+// loads and stores: a histogram has a single writer, and any thread may read
+// it (or merge it into another) at the same time.
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+// Values of 2^HIST_MAX_BITS and more land in the last bucket
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct Histogram {
+    _Atomic unsigned long counts[HIST_BUCKETS];
+    _Atomic unsigned long count;
+    _Atomic unsigned long sum;
+};
+
+// Returns the bucket a value falls in
+int histogram_bucket(long value);
+
+// Returns the largest value that falls in a bucket
+long histogram_bucket_max(int bucket);
+
+// Adds one value (single writer only)
+void histogram_record(struct Histogram* hist, long value);
+
+// Adds src's counts into dst (dst must have no other writer)
+void histogram_merge(struct Histogram* dst, const struct Histogram* src);
+
+// Returns the value below which a fraction q (0..1) of the recorded values
+// fall, rounded up to its bucket's largest value; 0 if the histogram is empty
+long histogram_percentile(const struct Histogram* hist, double q);
+
+#endif // HISTOGRAM_H
@@ -8,14 +8,15 @@ import pytest
 
 
 class Server:
-    def __init__(self, path, port, threads, queue_size):
+    def __init__(self, path, port, threads, queue_size, *options):
         self.path = str(path)
         self.port = str(port)
         self.threads = str(threads)
         self.queue_size = str(queue_size)
+        self.options = [str(option) for option in options]
 
     def __enter__(self):
-        self.process = Popen([self.path, self.port, self.threads, self.queue_size], stdout=PIPE, stderr=PIPE, cwd="..", bufsize=0, encoding=sys.getdefaultencoding())
+        self.process = Popen([self.path, self.port, self.threads, self.queue_size] + self.options, stdout=PIPE, stderr=PIPE, cwd="..", bufsize=0, encoding=sys.getdefaultencoding())
         return self.process
 
     def __exit__(self, exc_type, exc_value, exc_traceback):
@@ -0,0 +1,100 @@
+import json
+import re
+from time import sleep, time
+import requests
+
+from server import Server, server_port
+
+SAMPLE = re.compile(r'^(\w+)(?:\{(.*)\})? (\S+)$')
+LABEL = re.compile(r'(\w+)="([^"]*)"')
+FOLDED = re.compile(r'^[^ ;]+(;[^ ;]+)* \d+$')
+
+
+def get(server_port, path):
+    return requests.get(f"http://localhost:{server_port}{path}")
+
+
+def parse_prometheus(text):
+    """Returns {metric name: type} and a list of (name, labels, value)"""
+    types, samples = {}, []
+    for line in text.splitlines():
+        if line.startswith("# TYPE "):
+            _, _, name, kind = line.split(" ")
+            types[name] = kind
+        elif line.startswith("# HELP ") or not line:
+            continue
+        else:
+            match = SAMPLE.match(line)
+            assert match, f"not a Prometheus sample: {line!r}"
+            name, labels, value = match.groups()
+            samples.append((name, dict(LABEL.findall(labels or "")), float(value)))
+    return types, samples
+
+
+def test_metrics(server_port):
+    with Server("./server", server_port, 2, 8):
+        sleep(0.1)
+        for _ in range(3):
+            assert get(server_port, "/home.html").status_code == 200
+        for _ in range(2):
+            assert get(server_port, "/output.cgi?0.01").status_code == 200
+        assert get(server_port, "/missing.html").status_code == 404
+        response = get(server_port, "/metrics")
+    assert response.status_code == 200
+    assert response.headers["Content-Type"].startswith("text/plain")
+    types, samples = parse_prometheus(response.text)
+    made = {"static": 3, "dynamic": 2, "post": 0, "error": 1}
+
+    histograms = [name for name, kind in types.items() if kind == "histogram"]
+    assert histograms
+    for histogram in histograms:
+        for req_class, amount in made.items():
+            buckets = [(labels["le"], value) for name, labels, value in samples
+                       if name == f"{histogram}_bucket" and labels["class"] == req_class]
+            counts = [value for _, value in buckets]
+            assert buckets[-1][0] == "+Inf"
+            bounds = [float(le) for le, _ in buckets[:-1]]
+            assert bounds == sorted(bounds)
+            assert counts == sorted(counts)
+            count = [value for name, labels, value in samples
+                     if name == f"{histogram}_count" and labels["class"] == req_class]
+            assert count == [amount] == [counts[-1]]
+
+    # The per-worker counters add up to the requests made (admin ones excluded)
+    assert types["server_requests_total"] == "counter"
+    served = {}
+    for name, labels, value in samples:
+        if name == "server_requests_total":
+            served[labels["class"]] = served.get(labels["class"], 0) + value
+    assert served == {"static": 3, "dynamic": 2, "post": 0, "other": 1}
+
+
+def test_trace(server_port):
+    with Server("./server", server_port, 2, 8, "--trace", 1000):
+        sleep(0.1)
+        for _ in range(3):
+            assert get(server_port, "/home.html").status_code == 200
+        response = get(server_port, "/trace")
+    assert response.status_code == 200
+    assert response.headers["Content-Type"] == "application/json"
+    events = json.loads(response.text)["traceEvents"]
+    assert sum(event["name"] == "request" for event in events) >= 3
+    for event in events:
+        assert event["ph"] == "X" and event["dur"] >= 0
+        assert {"ts", "pid", "tid"} <= event.keys()
+
+
+def test_profile(server_port):
+    with Server("./server", server_port, 2, 8, "--profile", 999):
+        sleep(0.1)
+        # Keep the workers busy long enough to be sampled
+        start = time()
+        while time() - start < 1:
+            assert get(server_port, "/home.html").status_code == 200
+        response = get(server_port, "/profile")
+    assert response.status_code == 200
+    lines = response.text.splitlines()
+    assert lines
+    for line in lines:
+        assert FOLDED.match(line), f"not a folded stack: {line!r}"
+    assert any("worker_thread" in line for line in lines)
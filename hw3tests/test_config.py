@@ -0,0 +1,88 @@
+import math
+import os
+import re
+import subprocess
+from subprocess import Popen, PIPE
+from time import sleep
+import pytest
+import requests
+
+from server import Server, server_port
+
+
+def workers(server_port):
+    """Returns the number of workers, from the per-worker counters in /metrics"""
+    text = requests.get(f"http://localhost:{server_port}/metrics").text
+    return len(set(re.findall(r'server_requests_total\{worker="(\d+)"', text)))
+
+
+def run_server(*args):
+    return Popen(["./server", *[str(arg) for arg in args]], stdout=PIPE, stderr=PIPE, cwd="..")
+
+
+def rejected(*args):
+    """Runs the server with bad arguments; returns what it printed on exit"""
+    result = subprocess.run(["./server", *[str(arg) for arg in args]], capture_output=True, cwd="..",
+                            timeout=5, text=True)
+    assert result.returncode != 0
+    return result.stderr
+
+
+def test_config_file(server_port, tmp_path):
+    config = tmp_path / "server.conf"
+    config.write_text(f"# Everything from the file\nport {server_port}\nthreads = 3\nqueue-size 6\n"
+                      "sched fair\n")
+    server = run_server("--config", config)
+    try:
+        sleep(0.2)
+        assert workers(server_port) == 3
+    finally:
+        server.terminate()
+        server.wait()
+
+
+def test_command_line_overrides_config(server_port, tmp_path):
+    config = tmp_path / "server.conf"
+    config.write_text("threads 3\n")
+    # Options after --config and the positional sizes win over the file
+    with Server("./server", server_port, 2, 8, "--config", config):
+        sleep(0.1)
+        assert workers(server_port) == 2
+    server = run_server("--config", config, "--threads", 5, server_port)
+    try:
+        sleep(0.2)
+        assert workers(server_port) == 5
+    finally:
+        server.terminate()
+        server.wait()
+
+
+def test_auto_threads_cover_cgi_wait(server_port):
+    # Half of each worker's time waiting on CGI takes twice the CPUs
+    server = run_server("--threads", "auto", "--cgi-ratio", 0.5, server_port)
+    try:
+        sleep(0.2)
+        assert workers(server_port) == min(256, math.ceil(os.sysconf("SC_NPROCESSORS_ONLN") / 0.5))
+    finally:
+        server.terminate()
+        server.wait()
+
+
+@pytest.mark.parametrize("args", [["--threads", 0], ["--queue-size", -1], ["--cgi-ratio", 1],
+                                  ["--sched", "random"], ["--overload", "panic"], ["--acceptors", 2, "--threads", 1]])
+def test_rejects_bad_values(server_port, args):
+    assert rejected(*args, server_port)
+
+
+@pytest.mark.parametrize("line", ["threads many", "no-such-option 1", "log-sync-commit maybe"])
+def test_rejects_bad_config(server_port, tmp_path, line):
+    config = tmp_path / "server.conf"
+    config.write_text(f"port {server_port}\n{line}\n")
+    assert f"{config}:2: bad option" in rejected("--config", config)
+
+
+def test_rejects_nested_config(tmp_path):
+    # A file that includes itself would otherwise recurse until the stack ran out
+    config = tmp_path / "server.conf"
+    config.write_text(f"config {config}\n")
+    assert f"{config}:1: bad option 'config'" in rejected("--config", config)
@@ -0,0 +1,91 @@
+from concurrent.futures import ThreadPoolExecutor
+from http.client import HTTPConnection
+from time import sleep
+import pytest
+
+from server import Server, server_port
+
+# Fair queuing keys flows on the client's address, so the second client
+# connects from another loopback address
+CLIENT_A = "127.0.0.1"
+CLIENT_B = "127.0.0.2"
+
+
+def get(port, path, source):
+    """GET path from source; returns (status, time it went to a worker) or
+    None if the server closed the connection without answering"""
+    connection = HTTPConnection("127.0.0.1", port, timeout=10, source_address=(source, 0))
+    try:
+        connection.request("GET", path)
+        response = connection.getresponse()
+        response.read()
+        arrival = float(response.getheader("Stat-Req-Arrival").lstrip(": "))
+        waited = float(response.getheader("Stat-Req-Dispatch").lstrip(": "))
+        return response.status, arrival + waited
+    except ConnectionError:
+        return None
+    finally:
+        connection.close()
+
+
+def send_in_order(pool, port, requests):
+    """Sends (path, source) requests one after the other, each once the
+    previous one has had time to be queued"""
+    futures = []
+    for path, source in requests:
+        futures.append(pool.submit(get, port, path, source))
+        sleep(0.05)
+    return futures
+
+
+def test_unmeasured_flows_alternate(server_port):
+    # Sources the queue has not timed yet cost a whole quantum, so the two
+    # flows take one request each per turn instead of A's going first
+    with Server("./server", server_port, 1, 16, "--sched", "fair"):
+        sleep(0.1)
+        with ThreadPoolExecutor(max_workers=8) as pool:
+            blocker = send_in_order(pool, server_port, [("/output.cgi?1", CLIENT_A)])
+            a = send_in_order(pool, server_port, [("/output.cgi?0.1", CLIENT_A)] * 3)
+            b = send_in_order(pool, server_port, [("/output.cgi?0.1", CLIENT_B)] * 3)
+            assert blocker[0].result()[0] == 200
+            a = [future.result() for future in a]
+            b = [future.result() for future in b]
+    assert all(result[0] == 200 for result in a + b)
+    order = sorted([(result[1], "A") for result in a] + [(result[1], "B") for result in b])
+    assert [flow for _, flow in order] == ["A", "B", "A", "B", "A", "B"]
+
+
+def test_deficit_follows_cost(server_port):
+    # B's requests are measured cheap, so one quantum covers all of them: B
+    # is served in full on its first turn, between A's first and second
+    with Server("./server", server_port, 1, 16, "--sched", "fair"):
+        sleep(0.1)
+        for _ in range(40):
+            assert get(server_port, "/home.html", CLIENT_B)[0] == 200
+        with ThreadPoolExecutor(max_workers=16) as pool:
+            blocker = send_in_order(pool, server_port, [("/output.cgi?1", CLIENT_A)])
+            a = send_in_order(pool, server_port, [("/output.cgi?0.1", CLIENT_A)] * 3)
+            b = send_in_order(pool, server_port, [("/home.html", CLIENT_B)] * 10)
+            assert blocker[0].result()[0] == 200
+            a = [future.result() for future in a]
+            b = [future.result() for future in b]
+    assert all(result[0] == 200 for result in a + b)
+    assert max(result[1] for result in b) < a[1][1]
+    assert min(result[1] for result in b) > a[0][1]
+
+
+def test_drop_head_evicts_from_fattest_flow(server_port):
+    # B's request is the oldest waiting, but A holds more of the queue, so
+    # the overflow evicts A's oldest instead
+    with Server("./server", server_port, 1, 4, "--sched", "fair", "--overload", "drop-head"):
+        sleep(0.1)
+        with ThreadPoolExecutor(max_workers=8) as pool:
+            blocker = send_in_order(pool, server_port, [("/output.cgi?1", CLIENT_A)])
+            b = send_in_order(pool, server_port, [("/home.html", CLIENT_B)])
+            a = send_in_order(pool, server_port, [("/output.cgi?0.1", CLIENT_A)] * 4)
+            assert blocker[0].result()[0] == 200
+            a = [future.result() for future in a]
+            b = b[0].result()
+    assert b is not None and b[0] == 200
+    assert a[0] is None
+    assert all(result is not None and result[0] == 200 for result in a[1:])
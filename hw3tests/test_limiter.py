@@ -0,0 +1,56 @@
+from concurrent.futures import ThreadPoolExecutor
+import re
+from time import sleep, time
+import pytest
+import requests
+
+from server import Server, server_port
+
+LIMIT_MAX = 8
+
+
+def get(server_port, path):
+    """Returns the response, or None if the server cut the connection"""
+    try:
+        return requests.get(f"http://localhost:{server_port}{path}")
+    except ConnectionError:
+        return None
+
+
+def load(server_port, path, clients, seconds):
+    """Keeps `clients` requests for path in flight for a while; returns the responses"""
+    responses = []
+    with ThreadPoolExecutor(max_workers=clients) as pool:
+        start = time()
+        while time() - start < seconds:
+            responses += pool.map(lambda _: get(server_port, path), range(clients))
+    return responses
+
+
+def limit(server_port):
+    text = requests.get(f"http://localhost:{server_port}/metrics").text
+    return int(re.search(r"^server_concurrency_limit (\d+)$", text, re.M).group(1))
+
+
+@pytest.mark.parametrize("algorithm", ["aimd", "gradient"])
+def test_sheds_overload_and_recovers(server_port, algorithm):
+    with Server("./server", server_port, 2, 8, "--limit", algorithm, "--limit-max", LIMIT_MAX,
+                "--limit-target-ms", 50):
+        sleep(0.1)
+        load(server_port, "/home.html", LIMIT_MAX, 0.5)
+        # Twice as many slow CGI requests as the limit can ever admit: the
+        # rest are turned away at once with a 503, not queued
+        responses = load(server_port, "/output.cgi?0.2", 2 * LIMIT_MAX, 2)
+        assert any(response and response.status_code == 200 for response in responses)
+        rejected = [response for response in responses if response and response.status_code == 503]
+        assert rejected
+        assert all(response.headers["Retry-After"] == "1" for response in rejected)
+        assert limit(server_port) < LIMIT_MAX
+
+        # Fast requests once the overload is over raise the limit back
+        start = time()
+        while limit(server_port) < LIMIT_MAX and time() - start < 5:
+            load(server_port, "/home.html", LIMIT_MAX, 0.2)
+        assert limit(server_port) == LIMIT_MAX
+        responses = load(server_port, "/home.html", LIMIT_MAX // 2, 0.2)
+        assert all(response and response.status_code == 200 for response in responses)
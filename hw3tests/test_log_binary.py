@@ -0,0 +1,41 @@
+from time import sleep
+import pytest
+import requests
+
+from server import Server, server_port
+from utils import LOG_STAT, parse_records
+
+# Record kinds (log_segment.h) and request classes (log.h)
+KIND_STAT = 1
+CLASS_STATIC, CLASS_DYNAMIC = 0, 1
+
+
+def render(payload):
+    """Renders a binary stat the way log_format_stat does"""
+    arrival, dispatch, thread_id, total, static, dynamic, post, _ = LOG_STAT.unpack(payload)
+    return (f"Stat-Req-Arrival:: {arrival // 1000000}.{arrival % 1000000:06d}\r\n"
+            f"Stat-Req-Dispatch:: {dispatch // 1000000}.{dispatch % 1000000:06d}\r\n"
+            f"Stat-Thread-Id:: {thread_id}\r\n"
+            f"Stat-Thread-Count:: {total}\r\n"
+            f"Stat-Thread-Static:: {static}\r\n"
+            f"Stat-Thread-Dynamic:: {dynamic}\r\n"
+            f"Stat-Thread-Post:: {post}\r\n\r\n")
+
+
+@pytest.mark.parametrize("query, seqs", [("?cursor=0", range(10)), ("?cursor=3", range(3, 10)),
+                                         ("?cursor=2&limit=4", range(2, 6))])
+def test_binary_matches_text(server_port, query, seqs):
+    with Server("./server", server_port, 2, 8):
+        sleep(0.1)
+        for i in range(5):
+            assert requests.get(f"http://localhost:{server_port}/home.html").status_code == 200
+            assert requests.get(f"http://localhost:{server_port}/output.cgi?0.0{i}").status_code == 200
+        text = requests.post(f"http://localhost:{server_port}/{query}")
+        binary = requests.post(f"http://localhost:{server_port}/{query}&format=binary")
+    assert binary.headers["Content-Type"] == "application/octet-stream"
+    assert binary.headers["Log-Next-Cursor"] == text.headers["Log-Next-Cursor"]
+    records = parse_records(binary.content)
+    assert [seq for seq, _, _ in records] == list(seqs)
+    assert all(kind == KIND_STAT for _, kind, _ in records)
+    assert {LOG_STAT.unpack(payload)[-1] for _, _, payload in records} <= {CLASS_STATIC, CLASS_DYNAMIC}
+    assert "".join(render(payload) for _, _, payload in records) == text.text
@@ -0,0 +1,79 @@
+from concurrent.futures import ThreadPoolExecutor
+from threading import Event, Thread
+from time import sleep
+import pytest
+import requests
+
+from server import Server, server_port
+from utils import get_static, post_log
+
+LEGACY_HEADERS = {"Server", "Content-Length", "Content-Type", "Stat-Req-Arrival", "Stat-Req-Dispatch",
+                  "Stat-Thread-Id", "Stat-Thread-Count", "Stat-Thread-Static", "Stat-Thread-Dynamic",
+                  "Stat-Thread-Post"}
+
+
+def statics(entries):
+    return [entry["Stat-Thread-Static"] for entry in entries]
+
+
+@pytest.mark.parametrize("options", [[], ["--log-max-entries", 1000]])
+def test_plain_post_keeps_legacy_headers(server_port, options):
+    with Server("./server", server_port, 1, 8, *options):
+        sleep(0.1)
+        get_static(server_port, 3)
+        response, entries = post_log(server_port)
+        assert set(response.headers.keys()) == LEGACY_HEADERS
+        assert statics(entries) == [1, 2, 3]
+
+
+def test_limit_pages_with_next_cursor(server_port):
+    with Server("./server", server_port, 1, 8):
+        sleep(0.1)
+        get_static(server_port, 5)
+        pages = []
+        query = "?limit=2"
+        while True:
+            response, entries = post_log(server_port, query)
+            cursor = response.headers["Log-Next-Cursor"]
+            pages.append((statics(entries), cursor))
+            if not entries:
+                break
+            query = f"?cursor={cursor}&limit=2"
+        assert pages == [([1, 2], "2"), ([3, 4], "4"), ([5], "5"), ([], "5")]
+        # A cursor alone reads everything after it
+        response, entries = post_log(server_port, "?cursor=3")
+        assert statics(entries) == [4, 5]
+        assert response.headers["Log-Next-Cursor"] == "5"
+
+
+def test_cursor_continuity_under_load(server_port):
+    # Polling by cursor while four workers append must see every entry
+    # exactly once: a read stops short of entries still being appended
+    # (the watermark), and the cursor it returns picks them up next time
+    amount = 400
+    with Server("./server", server_port, 4, 32):
+        sleep(0.1)
+        seen = []
+        done = Event()
+
+        def poll():
+            cursor = 0
+            while True:
+                finished = done.is_set()
+                response, entries = post_log(server_port, f"?cursor={cursor}")
+                seen.extend((entry["Stat-Thread-Id"], entry["Stat-Thread-Count"]) for entry in entries)
+                cursor = int(response.headers["Log-Next-Cursor"])
+                if finished:
+                    return
+
+        poller = Thread(target=poll)
+        poller.start()
+        with ThreadPoolExecutor(max_workers=8) as pool:
+            results = pool.map(lambda _: requests.get(f"http://localhost:{server_port}/home.html").status_code,
+                               range(amount))
+            assert all(status == 200 for status in results)
+        done.set()
+        poller.join()
+        everything = post_log(server_port)[1]
+    assert len(seen) == len(set(seen)) == amount
+    assert set(seen) == {(entry["Stat-Thread-Id"], entry["Stat-Thread-Count"]) for entry in everything}
@@ -0,0 +1,76 @@
+import re
+from concurrent.futures import ThreadPoolExecutor
+from time import sleep
+import pytest
+import requests
+
+from server import Server, server_port
+from utils import get_static, post_log
+
+
+def counts(entries):
+    return [entry["Stat-Thread-Count"] for entry in entries]
+
+
+@pytest.mark.parametrize("classes, expected",
+                         [
+                             ("static", [1, 2, 3, 6]),
+                             ("dynamic", [4, 5]),
+                             ("static,dynamic", [1, 2, 3, 4, 5, 6]),
+                             ("error", []),
+                         ])
+def test_class(server_port, classes, expected):
+    with Server("./server", server_port, 1, 8):
+        sleep(0.1)
+        get_static(server_port, 3)
+        for _ in range(2):
+            assert requests.get(f"http://localhost:{server_port}/output.cgi?0").status_code == 200
+        get_static(server_port, 1)
+        assert counts(post_log(server_port, f"?class={classes}")[1]) == expected
+
+
+def test_class_with_limit(server_port):
+    with Server("./server", server_port, 1, 8):
+        sleep(0.1)
+        get_static(server_port, 2)
+        for _ in range(3):
+            assert requests.get(f"http://localhost:{server_port}/output.cgi?0").status_code == 200
+        response, entries = post_log(server_port, "?class=dynamic&limit=2")
+        assert counts(entries) == [3, 4]
+        cursor = response.headers["Log-Next-Cursor"]
+        assert counts(post_log(server_port, f"?class=dynamic&cursor={cursor}")[1]) == [5]
+
+
+def test_thread(server_port):
+    with Server("./server", server_port, 2, 16):
+        sleep(0.1)
+        with ThreadPoolExecutor(max_workers=4) as pool:
+            # Slow enough that both workers get some
+            statuses = pool.map(lambda _: requests.get(f"http://localhost:{server_port}/output.cgi?0.05").status_code,
+                                range(16))
+            assert all(status == 200 for status in statuses)
+        everything = post_log(server_port)[1]
+        by_thread = {}
+        for thread in (1, 2):
+            entries = post_log(server_port, f"?thread={thread}")[1]
+            assert entries
+            assert all(entry["Stat-Thread-Id"] == thread for entry in entries)
+            by_thread[thread] = entries
+        assert post_log(server_port, "?thread=3")[1] == []
+    assert len(by_thread[1]) + len(by_thread[2]) == len(everything) == 16
+
+
+def test_time_range(server_port):
+    with Server("./server", server_port, 1, 8):
+        sleep(0.1)
+        for _ in range(10):
+            get_static(server_port, 1)
+            sleep(0.02)
+        # The times exactly as the log prints them
+        arrivals = re.findall(r"Stat-Req-Arrival:: (\S+)", post_log(server_port)[0].text)
+        assert len(arrivals) == 10
+        assert counts(post_log(server_port, f"?from={arrivals[3]}&to={arrivals[6]}")[1]) == [4, 5, 6, 7]
+        assert counts(post_log(server_port, f"?from={arrivals[7]}")[1]) == [8, 9, 10]
+        assert counts(post_log(server_port, f"?to={arrivals[1]}")[1]) == [1, 2]
+        # Within a single microsecond
+        assert counts(post_log(server_port, f"?from={arrivals[5]}&to={arrivals[5]}")[1]) == [6]
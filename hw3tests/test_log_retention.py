@@ -0,0 +1,62 @@
+from time import sleep
+import pytest
+
+from server import Server, server_port
+from utils import get_static, post_log
+
+REQUESTS = 200
+
+
+def assert_newest_kept(entries, dropped):
+    # One worker numbers its static requests 1, 2, ...: what is left must be the
+    # newest ones, and everything before them dropped
+    counts = [entry["Stat-Thread-Static"] for entry in entries]
+    assert counts == list(range(REQUESTS - len(entries) + 1, REQUESTS + 1))
+    assert dropped == REQUESTS - len(entries)
+
+
+def test_max_entries(server_port):
+    with Server("./server", server_port, 1, 8, "--log-max-entries", 40):
+        sleep(0.1)
+        get_static(server_port, REQUESTS)
+        response, entries = post_log(server_port, "?limit=1000")
+        # Evicted a chunk at a time, each about 1/8 of the budget
+        assert 35 <= len(entries) <= 40
+        assert_newest_kept(entries, int(response.headers["Log-Dropped-Entries"]))
+
+
+def test_max_bytes(server_port):
+    with Server("./server", server_port, 1, 8, "--log-max-bytes", 8192):
+        sleep(0.1)
+        get_static(server_port, REQUESTS)
+        response, entries = post_log(server_port, "?limit=1000")
+        # 8 chunks of 1 KiB; a stat record takes 56 bytes
+        assert 0 < len(entries) <= 8192 // 56
+        assert_newest_kept(entries, int(response.headers["Log-Dropped-Entries"]))
+
+
+def test_max_age_idle(server_port):
+    with Server("./server", server_port, 1, 8, "--log-max-age", 1):
+        sleep(0.1)
+        get_static(server_port, 10)
+        assert len(post_log(server_port)[1]) == 10
+        sleep(2.5)
+        assert post_log(server_port)[1] == []
+        # A new entry must not bring the expired ones back
+        get_static(server_port, 1)
+        entries = post_log(server_port)[1]
+        assert [entry["Stat-Thread-Static"] for entry in entries] == [11]
+
+
+def test_max_age_trickle(server_port):
+    # A steady trickle keeps appending to the same chunk; its oldest entries
+    # must still go, within about twice the age limit
+    with Server("./server", server_port, 1, 8, "--log-max-age", 1):
+        sleep(0.1)
+        for _ in range(16):
+            get_static(server_port, 1)
+            sleep(0.25)
+        entries = post_log(server_port)[1]
+        counts = [entry["Stat-Thread-Static"] for entry in entries]
+        assert 0 < len(counts) <= 13
+        assert counts == list(range(17 - len(counts), 17))
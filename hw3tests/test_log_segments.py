@@ -0,0 +1,122 @@
+from concurrent.futures import ThreadPoolExecutor
+import struct
+from time import sleep
+import pytest
+import requests
+
+from server import Server, server_port
+from utils import get_static, parse_records, post_log
+
+# Segment layout (log_segment.c): a 64-byte header, then 8-byte aligned
+# records, each a 16-byte header (seq, crc, len, kind) and its payload. A
+# request's stats take 40 bytes of payload.
+SEGMENT_HEADER = 64
+RECORD = 56
+
+
+def run(server_port, log_dir, amount):
+    """Runs the server on log_dir, adds amount entries, stops it; returns
+    the log it served"""
+    with Server("./server", server_port, 1, 8, "--log-dir", log_dir) as server:
+        sleep(0.1)
+        get_static(server_port, amount)
+        text = post_log(server_port)[0].text
+        server.terminate()
+        server.wait()
+    return text
+
+
+def recovered(server_port, log_dir):
+    with Server("./server", server_port, 1, 8, "--log-dir", log_dir) as server:
+        sleep(0.1)
+        response, entries = post_log(server_port, "?cursor=0")
+        server.terminate()
+        server.wait()
+    return response, entries
+
+
+def segment(log_dir):
+    # One worker appends to a single shard; 20 records fit its first segment
+    segments = sorted(log_dir.glob("shard-*.seg"))
+    assert len(segments) == 1
+    return segments[0]
+
+
+def test_recovers_after_restart(server_port, tmp_path):
+    text = run(server_port, tmp_path, 20)
+    response, entries = recovered(server_port, tmp_path)
+    assert response.text == text
+    assert len(entries) == 20
+    assert response.headers["Log-Next-Cursor"] == "20"
+
+
+def test_recovers_truncated_tail(server_port, tmp_path):
+    run(server_port, tmp_path, 20)
+    # Cut the file in the middle of the last record
+    path = segment(tmp_path)
+    with open(path, "r+b") as file:
+        file.truncate(SEGMENT_HEADER + 19 * RECORD + RECORD // 2)
+    response, entries = recovered(server_port, tmp_path)
+    assert [entry["Stat-Thread-Static"] for entry in entries] == list(range(1, 20))
+    assert response.headers["Log-Next-Cursor"] == "19"
+
+
+@pytest.mark.parametrize("record", [19, 9])
+def test_recovers_up_to_corrupt_record(server_port, tmp_path, record):
+    run(server_port, tmp_path, 20)
+    # Flip a payload byte: the record's CRC no longer matches, and recovery
+    # keeps only the records before it
+    path = segment(tmp_path)
+    with open(path, "r+b") as file:
+        offset = SEGMENT_HEADER + record * RECORD + 20
+        file.seek(offset)
+        byte = file.read(1)
+        file.seek(offset)
+        file.write(bytes([byte[0] ^ 0xff]))
+    response, entries = recovered(server_port, tmp_path)
+    assert [entry["Stat-Thread-Static"] for entry in entries] == list(range(1, record + 1))
+
+
+def test_skips_segment_longer_than_created(server_port, tmp_path):
+    # A file that grew past the size in its header is not a segment this
+    # log wrote, so recovery leaves it alone instead of mapping it
+    run(server_port, tmp_path, 5)
+    with open(segment(tmp_path), "ab") as file:
+        file.write(b"\0" * 4096)
+    response, entries = recovered(server_port, tmp_path)
+    assert entries == []
+    assert response.headers["Log-Next-Cursor"] == "0"
+
+
+def test_appends_after_recovery(server_port, tmp_path):
+    run(server_port, tmp_path, 5)
+    with open(segment(tmp_path), "rb") as file:
+        file.seek(SEGMENT_HEADER + 4 * RECORD)
+        assert struct.unpack("<Q", file.read(8))[0] == 4
+    # New entries follow the recovered ones, numbered on from them
+    text = run(server_port, tmp_path, 3)
+    response, entries = recovered(server_port, tmp_path)
+    assert response.text == text
+    assert len(entries) == 8
+    assert response.headers["Log-Next-Cursor"] == "8"
+
+
+def test_group_commit_keeps_every_record(server_port, tmp_path):
+    # Four workers append at once, each waiting for its entry to be flushed;
+    # after a kill every entry is recovered once, numbered without gaps
+    amount = 200
+    with Server("./server", server_port, 4, 64, "--log-dir", tmp_path, "--log-sync-commit") as server:
+        sleep(0.1)
+        with ThreadPoolExecutor(max_workers=8) as pool:
+            statuses = list(pool.map(lambda _: requests.get(f"http://localhost:{server_port}/home.html").status_code,
+                                     range(amount)))
+        assert statuses == [200] * amount
+        server.kill()
+        server.wait()
+    with Server("./server", server_port, 1, 8, "--log-dir", tmp_path) as server:
+        sleep(0.1)
+        response = requests.post(f"http://localhost:{server_port}/?cursor=0&format=binary")
+        server.terminate()
+        server.wait()
+    assert [seq for seq, _, _ in parse_records(response.content)] == list(range(amount))
+    assert response.headers["Log-Next-Cursor"] == str(amount)
@@ -0,0 +1,75 @@
+from concurrent.futures import ThreadPoolExecutor
+from threading import Event, Thread
+from time import sleep
+import requests
+
+from server import Server, server_port
+from utils import LOG_STAT, parse_records
+
+THREADS = 4
+REQUESTS = 1000
+
+
+def read_raw(server_port, cursor):
+    """POSTs for the binary log from cursor; returns its records, the next
+    cursor and the number of entries dropped so far"""
+    response = requests.post(f"http://localhost:{server_port}/?cursor={cursor}&format=binary")
+    assert response.status_code == 200
+    return (parse_records(response.content), int(response.headers["Log-Next-Cursor"]),
+            int(response.headers["Log-Dropped-Entries"]))
+
+
+def check_records(records, cursor, next_cursor):
+    # Merged from the workers' shards in seq order, each a whole static stat
+    seqs = [seq for seq, _, _ in records]
+    assert seqs == sorted(set(seqs))
+    assert all(cursor <= seq < next_cursor for seq in seqs)
+    for _, kind, payload in records:
+        assert kind == 1 and len(payload) == LOG_STAT.size
+        arrival, dispatch, thread_id, total, static, dynamic, post, req_class = LOG_STAT.unpack(payload)
+        assert 1 <= thread_id <= THREADS
+        assert 1 <= static <= total and dynamic == 0 and req_class == 0
+        assert arrival > 0 and dispatch >= 0
+
+
+def test_merge_under_recycling(server_port):
+    # A small budget makes the workers' shards evict and reuse chunks while
+    # two readers merge them: no read may see a torn or repeated record, and
+    # every seq a read skips must have been dropped
+    with Server("./server", server_port, THREADS, 64, "--log-max-entries", 64):
+        sleep(0.1)
+        done = Event()
+        failures = []
+
+        def poll():
+            try:
+                cursor = 0
+                while not done.is_set():
+                    records, next_cursor, _ = read_raw(server_port, cursor)
+                    check_records(records, cursor, next_cursor)
+                    # Every seq in [0, next_cursor) was read or dropped
+                    whole, whole_next, dropped_after = read_raw(server_port, 0)
+                    check_records(whole, 0, whole_next)
+                    below = [seq for seq, _, _ in whole if seq < next_cursor]
+                    assert next_cursor - len(below) <= dropped_after
+                    cursor = next_cursor
+            except AssertionError as error:
+                failures.append(error)
+
+        readers = [Thread(target=poll) for _ in range(2)]
+        for reader in readers:
+            reader.start()
+        with ThreadPoolExecutor(max_workers=8) as pool:
+            results = pool.map(lambda _: requests.get(f"http://localhost:{server_port}/home.html").status_code,
+                               range(REQUESTS))
+            assert all(status == 200 for status in results)
+        done.set()
+        for reader in readers:
+            reader.join()
+        assert not failures, failures[0]
+
+        records, next_cursor, dropped = read_raw(server_port, 0)
+    check_records(records, 0, next_cursor)
+    assert next_cursor == REQUESTS
+    assert dropped > 0
+    assert len(records) + dropped == REQUESTS
@@ -0,0 +1,95 @@
+import socket
+from time import sleep
+import pytest
+
+from server import Server, server_port
+from utils import get_static, parse_log
+
+
+class Follower:
+    """A POST ?follow=1 subscriber reading the chunked response by hand"""
+
+    def __init__(self, server_port, half_close):
+        self.sock = socket.create_connection(("localhost", server_port), timeout=10)
+        self.sock.sendall(b"POST /?follow=1 HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        if half_close:
+            # As nc -q and curl do once the request is sent
+            self.sock.shutdown(socket.SHUT_WR)
+        self.buffer = b""
+        head = self.read_until(b"\r\n\r\n")
+        assert head.startswith(b"HTTP/1.1 200 OK\r\n")
+        assert b"Transfer-Encoding: chunked\r\n" in head
+
+    def read_until(self, delimiter):
+        while delimiter not in self.buffer:
+            data = self.sock.recv(4096)
+            assert data, "connection closed mid-response"
+            self.buffer += data
+        head, self.buffer = self.buffer.split(delimiter, 1)
+        return head + delimiter
+
+    def read_exactly(self, length):
+        while len(self.buffer) < length:
+            data = self.sock.recv(4096)
+            assert data, "connection closed mid-chunk"
+            self.buffer += data
+        data, self.buffer = self.buffer[:length], self.buffer[length:]
+        return data
+
+    def chunk(self):
+        """Returns the next chunk's data (b"" for the last one)"""
+        size = int(self.read_until(b"\r\n")[:-2], 16)
+        data = self.read_exactly(size)
+        assert self.read_exactly(2) == b"\r\n"
+        return data
+
+    def entries(self, amount):
+        entries = []
+        while len(entries) < amount:
+            data = self.chunk()
+            assert data
+            entries += parse_log(data.decode())
+        return entries
+
+    def close(self):
+        self.sock.close()
+
+
+@pytest.mark.parametrize("half_close", [False, True])
+def test_follow_streams_new_entries(server_port, half_close):
+    with Server("./server", server_port, 1, 8) as server:
+        sleep(0.1)
+        get_static(server_port, 2)
+        # Without cursor= the stream starts at the end of the log
+        follower = Follower(server_port, half_close)
+        try:
+            get_static(server_port, 5)
+            entries = follower.entries(5)
+            get_static(server_port, 3)
+            entries += follower.entries(3)
+            assert [entry["Stat-Thread-Static"] for entry in entries] == list(range(3, 11))
+            # Shutting down ends the response with the zero-length chunk
+            server.terminate()
+            server.wait()
+            assert follower.chunk() == b""
+            assert follower.buffer == b"" and follower.sock.recv(1) == b""
+        finally:
+            follower.close()
+
+
+def test_follow_gets_rest_of_log_at_shutdown(server_port):
+    # Entries the stream has not pushed yet still reach the subscriber
+    # before the last chunk
+    with Server("./server", server_port, 1, 8) as server:
+        sleep(0.1)
+        follower = Follower(server_port, False)
+        try:
+            get_static(server_port, 4)
+            server.terminate()
+            server.wait()
+            entries = []
+            while (data := follower.chunk()):
+                entries += parse_log(data.decode())
+            assert [entry["Stat-Thread-Static"] for entry in entries] == [1, 2, 3, 4]
+        finally:
+            follower.close()
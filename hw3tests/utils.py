@@ -1,5 +1,6 @@
 from copy import copy
 import re
+import struct
 from time import sleep
 import requests
 from requests_futures.sessions import FuturesSession
@@ -147,3 +148,49 @@ def spawn_clients(amount, server_port):
 
 def random_drop_formula(queue_size, in_queue):
     return math.ceil(in_queue * 0.5)
+
+
+def parse_log(text):
+    """Splits a POST's log body into entries, each a dict of its Stat-* fields"""
+    entries = []
+    for block in text.split("\r\n\r\n"):
+        if not block:
+            continue
+        entry = {}
+        for line in block.split("\r\n"):
+            key, value = line.split(":: ")
+            entry[key] = float(value) if "." in value else int(value)
+        entries.append(entry)
+    return entries
+
+
+def post_log(server_port, query=""):
+    """POSTs for the log (query such as "?cursor=3"); returns the response
+    and its entries"""
+    response = requests.post(f"http://localhost:{server_port}/{query}")
+    assert response.status_code == 200
+    return response, parse_log(response.text)
+
+
+def get_static(server_port, amount):
+    for _ in range(amount):
+        assert requests.get(f"http://localhost:{server_port}/home.html").status_code == 200
+
+
+# A ?format=binary record: seq, crc, len, kind (log_segment.h), then the
+# payload padded to 8 bytes
+RECORD_HEADER = struct.Struct("<QIHH")
+# struct Log_stat (log.h)
+LOG_STAT = struct.Struct("<qqiiiiii")
+
+
+def parse_records(content):
+    """Splits a ?format=binary body into (seq, kind, payload) tuples"""
+    records = []
+    offset = 0
+    while offset < len(content):
+        seq, crc, length, kind = RECORD_HEADER.unpack_from(content, offset)
+        offset += RECORD_HEADER.size
+        records.append((seq, kind, content[offset:offset + length]))
+        offset += (length + 7) & ~7
+    return records
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "limiter.h"
+#include "clock.h"
+
+// AIMD: cut to this share of the limit after a bad window
+#define AIMD_BACKOFF 0.9
+// Gradient: latency growth tolerated before the limit shrinks, the most one
+// window may shrink it by, the windows the no-load latency averages over,
+// and the weight of each new limit
+#define GRADIENT_TOLERANCE 1.5
+#define GRADIENT_MIN       0.5
+#define GRADIENT_LONG      60
+#define GRADIENT_SMOOTHING 0.2
+
+struct Limiter {
+    int algorithm;
+    int min, max;
+    long target;                // AIMD latency target (microseconds)
+    _Atomic int limit;          // What acquire admits up to
+    _Atomic int inflight;
+
+    pthread_mutex_t mutex;      // Guards the rest
+    double estimate;            // The limit before rounding
+    double long_rtt;            // Gradient: no-load latency (microseconds)
+    // The window being measured
+    long window_start;
+    long count;                 // Requests answered...
+    double sum;                 // ...and their total latency
+    long dropped;               // Requests dropped unanswered
+    int peak;                   // Most in flight
+};
+
+limiter create_limiter(int algorithm, int initial, int min, int max, long target_usec) {
+    if (min < 1 || max < min) return NULL;
+    limiter result = (limiter)calloc(1, sizeof(struct Limiter));
+    if (!result) return NULL;
+    if (initial < min) initial = min;
+    if (initial > max) initial = max;
+    result->algorithm = algorithm;
+    result->min = min;
+    result->max = max;
+    result->target = target_usec;
+    atomic_init(&result->limit, initial);
+    atomic_init(&result->inflight, 0);
+    pthread_mutex_init(&result->mutex, NULL);
+    result->estimate = initial;
+    return result;
+}
+
+void destroy_limiter(limiter limiter) {
+    if (!limiter) return;
+    pthread_mutex_destroy(&limiter->mutex);
+    free(limiter);
+}
+
+int limiter_acquire(limiter limiter) {
+    int inflight = atomic_load_explicit(&limiter->inflight, memory_order_relaxed);
+    do {
+        if (limiter->algorithm != LIMITER_OFF &&
+            inflight >= atomic_load_explicit(&limiter->limit, memory_order_relaxed)) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&limiter->inflight, &inflight, inflight + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return 0;
+}
+
+// Revises the estimate from the window just ended (mutex held)
+static void revise(limiter limiter) {
+    double estimate = limiter->estimate;
+    double mean = limiter->count ? limiter->sum / limiter->count : 0;
+    // Fewer than half the limit in flight says nothing about a higher one
+    int busy = limiter->peak * 2 >= estimate;
+
+    if (limiter->algorithm == LIMITER_AIMD) {
+        if (limiter->dropped || mean > limiter->target) {
+            estimate *= AIMD_BACKOFF;
+        } else if (busy) {
+            estimate += limiter->count / estimate;
+        }
+    } else if (limiter->algorithm == LIMITER_GRADIENT) {
+        double gradient = GRADIENT_MIN;
+        if (limiter->count) {
+            // Latencies are whole microseconds and may all be 0; the ratio
+            // below needs a positive mean
+            if (mean < 1) mean = 1;
+            if (limiter->long_rtt == 0) limiter->long_rtt = mean;
+            limiter->long_rtt += (mean - limiter->long_rtt) / GRADIENT_LONG;
+            // Latency back to normal after a long overload: let the no-load
+            // value fall faster than its average would
+            if (limiter->long_rtt > 2 * mean) limiter->long_rtt *= 0.95;
+            gradient = GRADIENT_TOLERANCE * limiter->long_rtt / mean;
+            if (gradient > 1) gradient = 1;
+            if (gradient < GRADIENT_MIN) gradient = GRADIENT_MIN;
+        }
+        if (busy || gradient < 1) {
+            double target = estimate * gradient + sqrt(estimate);
+            estimate = estimate * (1 - GRADIENT_SMOOTHING) + target * GRADIENT_SMOOTHING;
+        }
+    }
+
+    // Never let a bad sample poison the limit for good
+    if (!isfinite(estimate)) estimate = limiter->estimate;
+    if (estimate < limiter->min) estimate = limiter->min;
+    if (estimate > limiter->max) estimate = limiter->max;
+    limiter->estimate = estimate;
+    atomic_store_explicit(&limiter->limit, (int)estimate, memory_order_relaxed);
+}
+
+void limiter_release(limiter limiter, long latency_usec) {
+    int inflight = atomic_fetch_sub_explicit(&limiter->inflight, 1, memory_order_relaxed);
+    if (limiter->algorithm == LIMITER_OFF) return;
+
+    long now = monotonic_usec();
+    pthread_mutex_lock(&limiter->mutex);
+    if (!limiter->window_start) limiter->window_start = now;
+    if (latency_usec >= 0) {
+        limiter->count++;
+        limiter->sum += latency_usec;
+    } else {
+        limiter->dropped++;
+    }
+    if (inflight > limiter->peak) limiter->peak = inflight;
+    if (limiter->count + limiter->dropped >= LIMITER_WINDOW_SAMPLES &&
+        now - limiter->window_start >= LIMITER_WINDOW_USEC) {
+        revise(limiter);
+        limiter->window_start = now;
+        limiter->count = 0;
+        limiter->sum = 0;
+        limiter->dropped = 0;
+        limiter->peak = 0;
+    }
+    pthread_mutex_unlock(&limiter->mutex);
+}
+
+int limiter_limit(limiter limiter) {
+    return atomic_load_explicit(&limiter->limit, memory_order_relaxed);
+}
+
+int limiter_inflight(limiter limiter) {
+    return atomic_load_explicit(&limiter->inflight, memory_order_relaxed);
+}
@@ -0,0 +1,48 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+// Adaptive concurrency limit on the requests in flight (queued or being
+// served). The acceptors admit a connection only while fewer than `limit`
+// are in flight, and turn the rest away at once with a 503 rather than let
+// them wait in the queue. Workers report each request's latency, from
+// arrival to the end of its response, and the limit follows it:
+//  - AIMD: a window whose mean latency exceeds the target, or in which
+//    requests were dropped, cuts the limit by a tenth; otherwise a busy
+//    window (half the limit or more in flight) raises it by one per limit's
+//    worth of requests, as TCP does per round trip.
+//  - Gradient: as Netflix's gradient2. A slow average of the latency
+//    stands for its no-load value; the limit is scaled by how far the
+//    window's mean strays above it (tolerating 1.5x, halving at most),
+//    plus a headroom of sqrt(limit) to keep probing, and smoothed.
+// The limit is revised once a window has both LIMITER_WINDOW_SAMPLES
+// requests and LIMITER_WINDOW_USEC of time, and kept within [min, max].
+
+#define LIMITER_OFF      0
+#define LIMITER_AIMD     1
+#define LIMITER_GRADIENT 2
+
+#define LIMITER_WINDOW_SAMPLES 10
+#define LIMITER_WINDOW_USEC    100000
+
+typedef struct Limiter* limiter;
+
+// Creates a limiter starting at `initial` in flight. target_usec is the
+// AIMD latency target (unused by gradient).
+limiter create_limiter(int algorithm, int initial, int min, int max, long target_usec);
+
+void destroy_limiter(limiter limiter);
+
+// Admits one more request in flight; returns 0 if it may be queued, -1 if
+// it is over the limit. Safe from any thread.
+int limiter_acquire(limiter limiter);
+
+// Ends an admitted request that took latency_usec from arrival to the end
+// of its response, or that was dropped unanswered if latency_usec < 0.
+// Safe from any thread.
+void limiter_release(limiter limiter, long latency_usec);
+
+// The current limit, and the requests now in flight
+int limiter_limit(limiter limiter);
+int limiter_inflight(limiter limiter);
+
+#endif // LIMITER_H
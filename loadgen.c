@@ -0,0 +1,1255 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include "histogram.h"
+#include "loadgen.h"
+#include "clock.h"
+
+// How often a thread looks for requests past their timeout (microseconds)
+#define LOADGEN_SWEEP 100000
+#define LOADGEN_EVENTS 256
+// Response headers kept for parsing; the rest are skipped
+#define LOADGEN_HEADER_MAX 512
+// A sweep step is sustained if at most this share of its requests fail or
+// are never sent...
+#define LOADGEN_MAX_ERRORS 0.01
+// ...and, without an slo, its p99 stays within this multiple of the median
+// latency at the first (lightest) step
+#define LOADGEN_KNEE_FACTOR 5
+
+enum { CONN_IDLE, CONN_CONNECTING, CONN_SENDING, CONN_TRICKLING, CONN_READING };
+
+// Request text sent for a mix entry, built once for all threads
+struct Loadgen_prepared {
+    char* text;
+    int len;
+    int cumulative_weight;
+    long offset;        // Replay: when it is due, in microseconds into the run
+};
+
+// How a replayed request went, for the results log
+struct Loadgen_outcome {
+    int status;             // HTTP status code; 0 = no response
+    const char* error;      // Why not (NULL = never sent)
+    long latency, service;  // Microseconds, as in Loadgen_result
+};
+
+// A connection and the batch of requests it is sending (one, unless
+// pipelining). An idle connection may still be open for reuse.
+struct Loadgen_conn {
+    int fd;
+    int state;
+    unsigned events;            // What epoll watches for
+    unsigned gen;               // Counts batches, to spot stale trickle entries
+    int reused;                 // Was open before this batch
+    const struct Loadgen_prepared* batch[LOADGEN_MAX_PIPELINE];
+    int batch_len;
+    int send_index, send_offset;    // Next byte of the batch to send
+    int answered;               // Responses read so far
+    long intended;              // When the batch was due (monotonic microseconds)
+    long start;                 // When it was actually sent
+    // The response being read
+    long received;
+    char header[LOADGEN_HEADER_MAX];
+    int header_len;
+    int header_match;           // How much of "\r\n\r\n" was just seen
+    int header_done;
+    long body_left;             // -1 = until the server closes
+    int server_keep_alive;
+};
+
+// Slow senders' connections, in the order their next chunk is due. Every
+// chunk waits the same delay, so appending keeps the queue sorted.
+struct Loadgen_trickle {
+    struct Loadgen_conn* conn;
+    unsigned gen;
+    long due;
+};
+
+// One thread's counts; merged into the run's
+struct Loadgen_result {
+    struct Histogram latency;   // From the intended send time (microseconds)
+    struct Histogram service;   // From the actual send time
+    long max_latency;
+    long completed;
+    long bytes;
+    long status[6];             // [k] counts kxx responses; [0] unparsable ones
+    long connect_errors, io_errors, timeouts;
+    long unanswered;            // Pipelined requests the server never answered
+    long unsent;                // Due before the run ended, but never sent
+    long connects;              // Connections opened
+    long reuses;                // Batches sent on a kept-alive connection
+    long retries;               // Batches resent after a kept-alive connection closed
+};
+
+struct Loadgen_worker {
+    pthread_t thread;
+    const struct Loadgen_config* config;
+    int open_loop;              // Sends come due on a schedule
+    double interval;            // Mean time between this thread's sends (us)
+    int replay_next;            // Next trace record this thread sends
+    unsigned long rng;
+    int epfd;
+    struct Loadgen_trickle* trickle;    // Ring of trickle_cap entries
+    int trickle_head, trickle_len, trickle_cap;
+    struct Loadgen_result result;
+};
+
+// What one run measured
+struct Loadgen_summary {
+    double rate;                // Offered (0 for a closed loop)
+    double elapsed;             // Seconds
+    double throughput;
+    long errors;
+    struct Loadgen_result total;
+};
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static struct Loadgen_prepared* prepared;
+static int prepared_len;
+static int total_weight;
+static long run_start;           // Monotonic microseconds
+static long deadline;            // Monotonic microseconds; 0 = none
+static _Atomic long budget;      // Requests still to send, if config->requests
+static int replay_len;           // Trace records to send
+static struct Loadgen_outcome* outcomes;   // One per trace record
+
+int loadgen_parse_request(char* spec, struct Loadgen_request* req) {
+    char* save;
+    char* token = strtok_r(spec, " \t\r\n", &save);
+    if (!token) return -1;
+    req->method = "GET";
+    if (isupper((unsigned char)token[0])) {
+        req->method = token;
+        token = strtok_r(NULL, " \t\r\n", &save);
+        if (!token) return -1;
+    }
+    req->uri = token;
+    req->weight = 1;
+    req->body = NULL;
+    req->timestamp = 0;
+    token = strtok_r(NULL, " \t\r\n", &save);
+    if (token) {
+        req->weight = atoi(token);
+        if (req->weight <= 0) return -1;
+        // The body is the rest of the line
+        char* body = save + strspn(save, " \t");
+        body[strcspn(body, "\r\n")] = '\0';
+        if (*body) req->body = body;
+    }
+    return 0;
+}
+
+static char* json_skip_space(char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+// Appends code point c to out as UTF-8
+static char* utf8_put(char* out, unsigned long c) {
+    if (c < 0x80) {
+        *out++ = (char)c;
+    } else if (c < 0x800) {
+        *out++ = (char)(0xc0 | c >> 6);
+        *out++ = (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        *out++ = (char)(0xe0 | c >> 12);
+        *out++ = (char)(0x80 | (c >> 6 & 0x3f));
+        *out++ = (char)(0x80 | (c & 0x3f));
+    } else {
+        *out++ = (char)(0xf0 | c >> 18);
+        *out++ = (char)(0x80 | (c >> 12 & 0x3f));
+        *out++ = (char)(0x80 | (c >> 6 & 0x3f));
+        *out++ = (char)(0x80 | (c & 0x3f));
+    }
+    return out;
+}
+
+// Reads the 4 hex digits of a \u escape; returns -1 if they are not
+static long json_hex4(const char* p) {
+    long c = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)p[i])) return -1;
+        c = c * 16 + (isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+    }
+    return c;
+}
+
+// Decodes the JSON string whose text starts at p (past the opening quote)
+// in place; decoding only ever shrinks it. Returns the character after the
+// closing quote, or NULL if it is malformed.
+static char* json_decode_string(char* p, char** value) {
+    char* out = p;
+    *value = p;
+    while (*p != '"') {
+        if (!*p || (unsigned char)*p < 0x20) return NULL;
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p++) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                long c = json_hex4(p);
+                if (c <= 0) return NULL;    // \u0000 would cut the string short
+                p += 4;
+                // A surrogate pair encodes one character past U+FFFF
+                if (c >= 0xd800 && c < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+                    long low = json_hex4(p + 2);
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    }
+                }
+                out = utf8_put(out, (unsigned long)c);
+                break;
+            }
+            default: return NULL;
+        }
+    }
+    *out = '\0';
+    return p + 1;
+}
+
+// Finds the end of the JSON value at p without decoding it, or returns NULL
+// if it is cut short
+static char* json_skip_value(char* p) {
+    int depth = 0;
+    do {
+        if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (!*p || (*p == '\\' && !*++p)) return NULL;
+            }
+            p++;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+            p++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth < 0) return NULL;
+            p++;
+        } else if (!*p) {
+            return NULL;
+        } else if (depth) {
+            p++;
+        } else {
+            // A number or a literal
+            char* start = p;
+            p += strcspn(p, ",}] \t\r\n");
+            if (p == start) return NULL;
+        }
+    } while (depth);
+    return p;
+}
+
+// Reads an ISO 8601 time such as 2024-06-10T09:30:00.250Z as seconds since
+// the epoch. Times without a zone are taken as UTC.
+static int parse_iso_time(const char* text, double* seconds) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* rest = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (!rest) rest = strptime(text, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!rest) return -1;
+    double fraction = 0;
+    if (*rest == '.' || *rest == ',') {
+        char* end;
+        fraction = strtod(rest + 1, &end) / pow(10, end - rest - 1);
+        rest = end;
+    }
+    long zone = 0;
+    int hours, minutes;
+    if ((*rest == '+' || *rest == '-') && sscanf(rest + 1, "%2d:%2d", &hours, &minutes) == 2) {
+        zone = (*rest == '+' ? 1 : -1) * (hours * 3600L + minutes * 60);
+        rest += 6;
+    } else if (*rest == 'Z') {
+        rest++;
+    }
+    if (*rest) return -1;
+    *seconds = timegm(&tm) - zone + fraction;
+    return 0;
+}
+
+int loadgen_parse_record(char* line, struct Loadgen_request* req) {
+    req->method = "GET";
+    req->uri = NULL;
+    req->body = NULL;
+    req->weight = 1;
+    int timed = 0;
+    char* p = json_skip_space(line);
+    if (*p++ != '{') return -1;
+    p = json_skip_space(p);
+    while (*p != '}') {
+        char* key;
+        if (*p != '"' || !(p = json_decode_string(p + 1, &key))) return -1;
+        p = json_skip_space(p);
+        if (*p != ':') return -1;
+        p = json_skip_space(p + 1);
+        char* value = p;
+        int is_string = *p == '"';
+        char* end = is_string ? json_decode_string(p + 1, &value) : json_skip_value(p);
+        if (!end) return -1;
+
+        if (!strcmp(key, "timestamp")) {
+            if (is_string) {
+                if (parse_iso_time(value, &req->timestamp) < 0) return -1;
+            } else {
+                char* number_end;
+                req->timestamp = strtod(value, &number_end);
+                if (number_end != end) return -1;
+            }
+            timed = 1;
+        } else if (!strcmp(key, "method")) {
+            if (!is_string || !*value) return -1;
+            req->method = value;
+        } else if (!strcmp(key, "uri")) {
+            if (!is_string || !*value) return -1;
+            req->uri = value;
+        } else if (!strcmp(key, "body")) {
+            if (is_string) {
+                req->body = *value ? value : NULL;
+            } else if (end - value != 4 || strncmp(value, "null", 4)) {
+                // JSON sent as is; the line is still needed past its end
+                req->body = strndup(value, end - value);
+                if (!req->body) return -1;
+            }
+        }
+
+        p = json_skip_space(end);
+        if (*p == ',') {
+            p = json_skip_space(p + 1);
+            if (*p == '}') return -1;
+        } else if (*p != '}') {
+            return -1;
+        }
+    }
+    if (*json_skip_space(p + 1)) return -1;
+    return req->uri && timed ? 0 : -1;
+}
+
+// Builds the request text of every mix entry
+static int prepare_mix(const struct Loadgen_config* config) {
+    // From an earlier run in this process
+    for (int i = 0; prepared && i < prepared_len; i++) free(prepared[i].text);
+    free(prepared);
+    prepared_len = config->mix_len;
+    prepared = (struct Loadgen_prepared*)calloc(config->mix_len, sizeof(struct Loadgen_prepared));
+    if (!prepared) return -1;
+    total_weight = 0;
+    for (int i = 0; i < config->mix_len; i++) {
+        const struct Loadgen_request* req = &config->mix[i];
+        int body_len = req->body ? strlen(req->body) : 0;
+        int cap = strlen(req->method) + strlen(req->uri) + strlen(config->host) + body_len + 128;
+        prepared[i].text = (char*)malloc(cap);
+        if (!prepared[i].text) return -1;
+        int len = snprintf(prepared[i].text, cap, "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n",
+                           req->method, req->uri, config->host, config->keep_alive ? "keep-alive" : "close");
+        if (req->body) len += snprintf(prepared[i].text + len, cap - len, "Content-Length: %d\r\n", body_len);
+        len += snprintf(prepared[i].text + len, cap - len, "\r\n");
+        if (req->body) memcpy(prepared[i].text + len, req->body, body_len);
+        prepared[i].len = len + body_len;
+        total_weight += req->weight;
+        prepared[i].cumulative_weight = total_weight;
+    }
+    return 0;
+}
+
+// Schedules the trace records relative to the earliest, at the configured
+// speed. Returns the average rate that makes (0 = flat out).
+static double prepare_replay(const struct Loadgen_config* config) {
+    double first = config->mix[0].timestamp, last = first;
+    for (int i = 1; i < replay_len; i++) {
+        if (config->mix[i].timestamp < first) first = config->mix[i].timestamp;
+        if (config->mix[i].timestamp > last) last = config->mix[i].timestamp;
+    }
+    for (int i = 0; i < replay_len; i++) {
+        prepared[i].offset = config->speed > 0 ? (long)((config->mix[i].timestamp - first) / config->speed * 1e6) : 0;
+    }
+    return config->speed > 0 && last > first ? replay_len * config->speed / (last - first) : 0;
+}
+
+// xorshift64*
+static unsigned long next_random(unsigned long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717UL;
+}
+
+// The next request: a random one from the mix, or the thread's next trace
+// record in a replay
+static const struct Loadgen_prepared* pick_request(struct Loadgen_worker* worker) {
+    if (worker->config->replay) {
+        const struct Loadgen_prepared* req = &prepared[worker->replay_next];
+        worker->replay_next += worker->config->threads;
+        return req;
+    }
+    int target = (int)(next_random(&worker->rng) % total_weight);
+    int i = 0;
+    while (prepared[i].cumulative_weight <= target) i++;
+    return &prepared[i];
+}
+
+// Time until the thread's next send: fixed, or exponentially distributed
+// for Poisson arrivals
+static double next_interval(struct Loadgen_worker* worker) {
+    if (!worker->config->poisson) return worker->interval;
+    // Uniform in (0, 1]
+    double u = ((next_random(&worker->rng) >> 11) + 1) / 9007199254740992.0;
+    return -log(u) * worker->interval;
+}
+
+// Trace records the thread has yet to send
+static int replay_left(const struct Loadgen_worker* worker) {
+    int threads = worker->config->threads;
+    return worker->replay_next < replay_len ? (replay_len - worker->replay_next + threads - 1) / threads : 0;
+}
+
+// When the thread's next trace record is due (0 once there is none)
+static double replay_due(const struct Loadgen_worker* worker) {
+    return worker->replay_next < replay_len ? run_start + prepared[worker->replay_next].offset : 0;
+}
+
+// Takes one request from the run's budget; returns 0 once it is spent
+static int claim_request(const struct Loadgen_config* config) {
+    if (!config->requests) return 1;
+    return atomic_fetch_sub_explicit(&budget, 1, memory_order_relaxed) > 0;
+}
+
+// Logs why the batch's unanswered trace records got no response, unless an
+// earlier failure already did
+static void outcome_failed(const struct Loadgen_conn* conn, const char* error) {
+    if (!outcomes) return;
+    for (int i = conn->answered; i < conn->batch_len; i++) {
+        struct Loadgen_outcome* outcome = &outcomes[conn->batch[i] - prepared];
+        if (!outcome->error) outcome->error = error;
+    }
+}
+
+static void conn_watch(struct Loadgen_worker* worker, struct Loadgen_conn* conn, unsigned events) {
+    if (conn->events == events) return;
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(worker->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+}
+
+static void conn_close(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_IDLE;
+}
+
+static int conn_connect(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    conn->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->fd < 0) return -1;
+    struct epoll_event event;
+    event.events = conn->events = EPOLLOUT;
+    event.data.ptr = conn;
+    if ((connect(conn->fd, (struct sockaddr*)&server_addr, server_addr_len) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    worker->result.connects++;
+    conn->state = CONN_CONNECTING;
+    return 0;
+}
+
+static void response_reset(struct Loadgen_conn* conn) {
+    conn->received = 0;
+    conn->header_len = 0;
+    conn->header_match = 0;
+    conn->header_done = 0;
+    conn->body_left = -1;
+    conn->server_keep_alive = 0;
+}
+
+static void record_latency(struct Loadgen_result* result, long latency) {
+    histogram_record(&result->latency, latency);
+    if (latency > result->max_latency) result->max_latency = latency;
+}
+
+// Case-insensitive search for a header's value in a header block
+static char* header_value(char* header, const char* name) {
+    int len = strlen(name);
+    for (char* line = strchr(header, '\n'); line; line = strchr(line + 1, '\n')) {
+        if (!strncasecmp(line + 1, name, len) && line[1 + len] == ':') return line + 2 + len;
+    }
+    return NULL;
+}
+
+// Reads the status line and framing headers once the header block is in
+static void response_headers(struct Loadgen_conn* conn) {
+    conn->header[conn->header_len] = '\0';
+    char* value = header_value(conn->header, "Content-Length");
+    if (value) conn->body_left = atol(value);
+    value = header_value(conn->header, "Connection");
+    if (value) {
+        value += strspn(value, " ");
+        conn->server_keep_alive = !strncasecmp(value, "keep-alive", 10);
+    } else {
+        conn->server_keep_alive = !strncmp(conn->header, "HTTP/1.1", 8);
+    }
+}
+
+static void response_finish(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    struct Loadgen_result* result = &worker->result;
+    int code = 0;
+    if (conn->header_len >= 12 && !strncmp(conn->header, "HTTP/", 5)) {
+        char* space = strchr(conn->header, ' ');
+        if (space) code = atoi(space + 1);
+        if (code < 100 || code > 599) code = 0;
+    }
+    long now = monotonic_usec();
+    record_latency(result, now - conn->intended);
+    histogram_record(&result->service, now - conn->start);
+    result->status[code / 100]++;
+    if (outcomes) {
+        struct Loadgen_outcome* outcome = &outcomes[conn->batch[conn->answered] - prepared];
+        outcome->status = code;
+        outcome->error = code ? NULL : "bad response";
+        outcome->latency = now - conn->intended;
+        outcome->service = now - conn->start;
+    }
+    result->completed++;
+    conn->answered++;
+}
+
+// Feeds received bytes to the response parser. Returns 1 once every
+// response of the batch is in.
+static int response_parse(struct Loadgen_worker* worker, struct Loadgen_conn* conn, const char* buf, long n) {
+    static const char blank_line[] = "\r\n\r\n";
+    long pos = 0;
+    while (pos < n) {
+        if (!conn->header_done) {
+            char c = buf[pos++];
+            if (conn->header_len < LOADGEN_HEADER_MAX - 1) conn->header[conn->header_len++] = c;
+            conn->header_match = c == blank_line[conn->header_match] ? conn->header_match + 1 : c == '\r';
+            if (conn->header_match < 4) continue;
+            conn->header_done = 1;
+            response_headers(conn);
+        } else if (conn->body_left > 0) {
+            long take = n - pos < conn->body_left ? n - pos : conn->body_left;
+            pos += take;
+            conn->body_left -= take;
+        } else if (conn->body_left < 0) {
+            return 0;   // Ends when the server closes
+        }
+        if (conn->header_done && conn->body_left == 0) {
+            response_finish(worker, conn);
+            if (conn->answered == conn->batch_len) return 1;
+            response_reset(conn);
+        }
+    }
+    return 0;
+}
+
+// Ends the batch. The connection stays open if both sides keep it alive
+// and the server answered everything.
+static void conn_done(struct Loadgen_worker* worker, struct Loadgen_conn* conn, int open) {
+    // A batch with no answer at all was counted once, as an error
+    int lost = conn->batch_len - conn->answered - !conn->answered;
+    worker->result.unanswered += lost;
+    outcome_failed(conn, "unanswered");
+    if (open && worker->config->keep_alive && conn->server_keep_alive && conn->answered == conn->batch_len) {
+        conn->state = CONN_IDLE;
+        // Watch for the server closing it while idle
+        conn_watch(worker, conn, EPOLLIN | EPOLLRDHUP);
+    } else {
+        conn_close(worker, conn);
+    }
+}
+
+// A kept-alive connection the server closed before answering anything: the
+// batch was never served, so it goes again on a new connection. Returns 1
+// if the connection is free.
+static int conn_retry(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    conn_close(worker, conn);
+    conn->reused = 0;
+    conn->send_index = conn->send_offset = 0;
+    response_reset(conn);
+    worker->result.retries++;
+    if (conn_connect(worker, conn) < 0) {
+        worker->result.connect_errors++;
+        outcome_failed(conn, "connect");
+        return 1;
+    }
+    return 0;
+}
+
+static int conn_failed(struct Loadgen_worker* worker, struct Loadgen_conn* conn, long* counter, const char* error) {
+    if (conn->reused && !conn->answered && !conn->received) return conn_retry(worker, conn);
+    (*counter)++;
+    outcome_failed(conn, error);
+    conn_done(worker, conn, 0);
+    return 1;
+}
+
+// Queues a slow sender's connection for its next chunk
+static void trickle_push(struct Loadgen_worker* worker, struct Loadgen_conn* conn, long due) {
+    if (worker->trickle_len == worker->trickle_cap) {
+        int cap = worker->trickle_cap ? 2 * worker->trickle_cap : 64;
+        struct Loadgen_trickle* ring = (struct Loadgen_trickle*)malloc(cap * sizeof(struct Loadgen_trickle));
+        if (!ring) {
+            perror("Malloc failed");
+            exit(1);
+        }
+        for (int i = 0; i < worker->trickle_len; i++) {
+            ring[i] = worker->trickle[(worker->trickle_head + i) % worker->trickle_cap];
+        }
+        free(worker->trickle);
+        worker->trickle = ring;
+        worker->trickle_head = 0;
+        worker->trickle_cap = cap;
+    }
+    struct Loadgen_trickle* entry = &worker->trickle[(worker->trickle_head + worker->trickle_len++) % worker->trickle_cap];
+    entry->conn = conn;
+    entry->gen = conn->gen;
+    entry->due = due;
+}
+
+// Sends as much of the batch as the socket takes, or one chunk for a slow
+// sender. Returns 1 if the connection failed and is free.
+static int conn_send(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    const struct Loadgen_config* config = worker->config;
+    int budget = config->slow_bytes > 0 ? config->slow_bytes : -1;
+    while (conn->send_index < conn->batch_len && budget != 0) {
+        const struct Loadgen_prepared* req = conn->batch[conn->send_index];
+        int len = req->len - conn->send_offset;
+        if (budget > 0 && len > budget) len = budget;
+        ssize_t n = send(conn->fd, req->text + conn->send_offset, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                conn_watch(worker, conn, EPOLLIN | EPOLLOUT);
+                return 0;
+            }
+            return conn_failed(worker, conn, &worker->result.io_errors, "i/o");
+        }
+        if (budget > 0) budget -= n;
+        conn->send_offset += n;
+        if (conn->send_offset == req->len) {
+            conn->send_index++;
+            conn->send_offset = 0;
+        }
+    }
+    if (conn->send_index < conn->batch_len) {
+        conn->state = CONN_TRICKLING;
+        conn_watch(worker, conn, EPOLLIN);
+        trickle_push(worker, conn, monotonic_usec() + (long)(config->slow_delay * 1000));
+    } else {
+        conn->state = CONN_READING;
+        conn_watch(worker, conn, EPOLLIN);
+    }
+    return 0;
+}
+
+// Reads what the server sent. Returns 1 once the batch is over.
+static int conn_read(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    char buf[16384];
+    while (1) {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            worker->result.bytes += n;
+            conn->received += n;
+            if (response_parse(worker, conn, buf, n)) {
+                conn_done(worker, conn, 1);
+                return 1;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) return 0;
+        // A response without a Content-Length ends when the server closes the
+        // connection. The server may reset it instead if it left part of the
+        // request unread.
+        if (conn->header_done && conn->body_left < 0 && (n == 0 || errno == ECONNRESET)) {
+            response_finish(worker, conn);
+            conn_done(worker, conn, 0);
+            return 1;
+        }
+        if (conn->answered) {
+            conn_done(worker, conn, 0);
+            return 1;
+        }
+        return conn_failed(worker, conn, &worker->result.io_errors, "i/o");
+    }
+}
+
+// Starts a batch of requests due at `intended`, on the connection if it is
+// still open. Returns -1 (and counts the error) if it failed at once.
+static int conn_start(struct Loadgen_worker* worker, struct Loadgen_conn* conn, int batch_len, long intended) {
+    for (int i = 0; i < batch_len; i++) conn->batch[i] = pick_request(worker);
+    conn->batch_len = batch_len;
+    conn->send_index = conn->send_offset = 0;
+    conn->answered = 0;
+    conn->gen++;
+    conn->intended = intended;
+    conn->start = monotonic_usec();
+    response_reset(conn);
+    conn->reused = conn->fd >= 0;
+    if (conn->reused) {
+        worker->result.reuses++;
+        conn->state = CONN_SENDING;
+        return conn_send(worker, conn) ? -1 : 0;
+    }
+    if (conn_connect(worker, conn) < 0) {
+        worker->result.connect_errors++;
+        outcome_failed(conn, "connect");
+        return -1;
+    }
+    return 0;
+}
+
+// Moves a connection along after an epoll event. Returns 1 once its batch is
+// over (done or failed), 0 while it is in flight.
+static int conn_progress(struct Loadgen_worker* worker, struct Loadgen_conn* conn) {
+    if (conn->state == CONN_IDLE) {
+        // The server closed a kept-alive connection
+        conn_close(worker, conn);
+        return 0;
+    }
+    if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            worker->result.connect_errors++;
+            outcome_failed(conn, "connect");
+            conn_close(worker, conn);
+            return 1;
+        }
+        conn->state = CONN_SENDING;
+    }
+    if (conn->state == CONN_SENDING && conn_send(worker, conn)) return 1;
+    if (conn->state == CONN_CONNECTING) return 0;   // Retrying on a new connection
+    // Reads even while still sending: the server may answer (or close) early
+    return conn_read(worker, conn);
+}
+
+static void* loadgen_thread(void* arg) {
+    struct Loadgen_worker* worker = (struct Loadgen_worker*)arg;
+    const struct Loadgen_config* config = worker->config;
+    long timeout = (long)(config->timeout * 1e6);
+    worker->epfd = epoll_create1(0);
+    // Wakes the thread when its next request or trickled chunk is due;
+    // epoll_wait alone only has millisecond timeouts
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event timer_event;
+    timer_event.events = EPOLLIN;
+    timer_event.data.ptr = NULL;
+    if (timerfd >= 0 && epoll_ctl(worker->epfd, EPOLL_CTL_ADD, timerfd, &timer_event) < 0) {
+        close(timerfd);
+        timerfd = -1;
+    }
+    struct Loadgen_conn* conns = (struct Loadgen_conn*)calloc(config->connections, sizeof(struct Loadgen_conn));
+    // Stack of the idle connections
+    struct Loadgen_conn** idle = (struct Loadgen_conn**)malloc(config->connections * sizeof(struct Loadgen_conn*));
+    if (worker->epfd < 0 || !conns || !idle) {
+        perror("load generator thread");
+        free(conns);
+        free(idle);
+        return NULL;
+    }
+    int idle_count = 0;
+    for (int i = config->connections - 1; i >= 0; i--) {
+        conns[i].fd = -1;
+        idle[idle_count++] = &conns[i];
+    }
+
+    struct epoll_event events[LOADGEN_EVENTS];
+    int stopping = 0;
+    long now = monotonic_usec();
+    long begin = now;
+    long next_sweep = now + LOADGEN_SWEEP;
+    // Open loop: when the next request is due, whether or not earlier ones
+    // have been answered. Threads start at random offsets within one gap.
+    double next_send = now + worker->interval * (next_random(&worker->rng) % 1000) / 1000;
+    if (config->replay) next_send = replay_due(worker);
+    while (1) {
+        now = monotonic_usec();
+        if (deadline && now >= deadline) stopping = 1;
+        // A closed loop opens its connections gradually over the ramp
+        int allowed = config->connections;
+        if (config->ramp > 0 && now - begin < config->ramp * 1e6) {
+            allowed = 1 + (int)(config->connections * ((now - begin) / (config->ramp * 1e6)));
+        }
+        while (!stopping && idle_count > 0 && (worker->open_loop ? next_send <= now :
+                                               config->connections - idle_count < allowed)) {
+            int batch_len = worker->open_loop ? 1 : config->pipeline;
+            if (config->replay) {
+                int left = replay_left(worker);
+                if (!left) {
+                    stopping = 1;
+                    break;
+                }
+                if (batch_len > left) batch_len = left;
+            } else if (!claim_request(config)) {
+                stopping = 1;
+                break;
+            }
+            struct Loadgen_conn* conn = idle[--idle_count];
+            // A closed loop sends right away; an open loop sends late only if
+            // all its connections were busy, and the delay counts as latency
+            long intended = worker->open_loop ? (long)next_send : now;
+            if (conn_start(worker, conn, batch_len, intended) < 0) {
+                idle[idle_count++] = conn;
+            }
+            if (worker->open_loop) next_send = config->replay ? replay_due(worker) : next_send + next_interval(worker);
+        }
+        if (stopping && idle_count == config->connections) break;
+
+        while (worker->trickle_len && worker->trickle[worker->trickle_head].due <= now) {
+            struct Loadgen_trickle entry = worker->trickle[worker->trickle_head];
+            worker->trickle_head = (worker->trickle_head + 1) % worker->trickle_cap;
+            worker->trickle_len--;
+            // Skip connections that finished (or failed) since being queued
+            if (entry.conn->gen != entry.gen || entry.conn->state != CONN_TRICKLING) continue;
+            entry.conn->state = CONN_SENDING;
+            if (conn_send(worker, entry.conn)) idle[idle_count++] = entry.conn;
+        }
+
+        if (now >= next_sweep) {
+            for (int i = 0; i < config->connections; i++) {
+                if (conns[i].state != CONN_IDLE && now - conns[i].start > timeout) {
+                    worker->result.timeouts++;
+                    outcome_failed(&conns[i], "timeout");
+                    conn_close(worker, &conns[i]);
+                    idle[idle_count++] = &conns[i];
+                }
+            }
+            next_sweep = now + LOADGEN_SWEEP;
+        }
+
+        long wait = next_sweep - now;
+        if (deadline && !stopping && deadline - now < wait) wait = deadline - now;
+        if (allowed < config->connections && wait > 10000) wait = 10000;
+        long due = 0;
+        if (worker->open_loop && !stopping && idle_count > 0) due = (long)next_send;
+        if (worker->trickle_len && (!due || worker->trickle[worker->trickle_head].due < due)) {
+            due = worker->trickle[worker->trickle_head].due;
+        }
+        if (due) {
+            struct itimerspec timer;
+            memset(&timer, 0, sizeof(timer));
+            timer.it_value.tv_sec = due / 1000000;
+            timer.it_value.tv_nsec = due % 1000000 * 1000 + 1;
+            if (timerfd < 0 || timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+                if (due - now < wait) wait = due - now;
+            }
+        }
+        int n = epoll_wait(worker->epfd, events, LOADGEN_EVENTS, wait > 0 ? (int)((wait + 999) / 1000) : 0);
+        for (int i = 0; i < n; i++) {
+            struct Loadgen_conn* conn = (struct Loadgen_conn*)events[i].data.ptr;
+            if (!conn) {
+                unsigned long expirations;
+                if (read(timerfd, &expirations, sizeof(expirations)) < 0) {
+                    // Already read; nothing to do
+                }
+                continue;
+            }
+            if (conn_progress(worker, conn)) idle[idle_count++] = conn;
+        }
+    }
+
+    // Requests that came due but found every connection busy until the end
+    // would have waited at least until now: leaving them out would hide the
+    // stall that delayed them
+    if (worker->open_loop && deadline) {
+        now = monotonic_usec();
+        if (config->replay) {
+            for (; replay_left(worker) && replay_due(worker) < deadline; worker->replay_next += config->threads) {
+                record_latency(&worker->result, now - (long)replay_due(worker));
+                worker->result.unsent++;
+            }
+        } else {
+            for (; next_send < deadline; next_send += next_interval(worker)) {
+                record_latency(&worker->result, now - (long)next_send);
+                worker->result.unsent++;
+            }
+        }
+    }
+    for (int i = 0; i < config->connections; i++) {
+        if (conns[i].fd >= 0) close(conns[i].fd);
+    }
+    free(worker->trickle);
+    free(idle);
+    free(conns);
+    if (timerfd >= 0) close(timerfd);
+    close(worker->epfd);
+    return NULL;
+}
+
+// A bucket's largest value may exceed the largest latency seen
+static double percentile_ms(const struct Loadgen_result* result, const struct Histogram* hist, double q) {
+    long value = histogram_percentile(hist, q);
+    return (value < result->max_latency ? value : result->max_latency) / 1e3;
+}
+
+static double mean_ms(const struct Histogram* hist) {
+    long count = atomic_load(&hist->count);
+    return count ? atomic_load(&hist->sum) / 1e3 / count : 0.0;
+}
+
+// Runs the load at `rate` requests per second (0 = closed loop), or replays
+// the trace (whose average rate that is)
+static void run_once(const struct Loadgen_config* config, double rate, struct Loadgen_summary* summary) {
+    struct Loadgen_worker* workers = (struct Loadgen_worker*)calloc(config->threads, sizeof(struct Loadgen_worker));
+    if (!workers) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    atomic_store(&budget, config->requests);
+    long start = monotonic_usec();
+    run_start = start;
+    deadline = config->duration > 0 ? start + (long)(config->duration * 1e6) : 0;
+    for (int i = 0; i < config->threads; i++) {
+        workers[i].config = config;
+        workers[i].open_loop = config->replay ? config->speed > 0 : rate > 0;
+        workers[i].interval = rate > 0 && !config->replay ? 1e6 * config->threads / rate : 0;
+        workers[i].replay_next = i;
+        workers[i].rng = (unsigned long)start * 6364136223846793005UL + i + 1;
+        if (pthread_create(&workers[i].thread, NULL, loadgen_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    memset(summary, 0, sizeof(*summary));
+    struct Loadgen_result* total = &summary->total;
+    for (int i = 0; i < config->threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        struct Loadgen_result* result = &workers[i].result;
+        histogram_merge(&total->latency, &result->latency);
+        histogram_merge(&total->service, &result->service);
+        if (result->max_latency > total->max_latency) total->max_latency = result->max_latency;
+        total->completed += result->completed;
+        total->bytes += result->bytes;
+        for (int s = 0; s < 6; s++) total->status[s] += result->status[s];
+        total->connect_errors += result->connect_errors;
+        total->io_errors += result->io_errors;
+        total->timeouts += result->timeouts;
+        total->unanswered += result->unanswered;
+        total->unsent += result->unsent;
+        total->connects += result->connects;
+        total->reuses += result->reuses;
+        total->retries += result->retries;
+    }
+    free(workers);
+    summary->rate = rate;
+    summary->elapsed = (monotonic_usec() - start) / 1e6;
+    summary->throughput = total->completed / summary->elapsed;
+    summary->errors = total->connect_errors + total->io_errors + total->timeouts + total->unanswered;
+}
+
+static void print_summary(const struct Loadgen_summary* summary) {
+    const struct Loadgen_result* total = &summary->total;
+    printf("  requests     %ld completed, %ld errors (%ld connect, %ld i/o, %ld timeout, %ld unanswered) in %.2fs\n",
+           total->completed, summary->errors, total->connect_errors, total->io_errors, total->timeouts,
+           total->unanswered, summary->elapsed);
+    printf("  connections  %ld opened, %ld reused, %ld retried after the server closed them\n",
+           total->connects, total->reuses, total->retries);
+    if (summary->rate > 0) {
+        printf("  offered      %.1f req/s, %ld requests never sent\n", summary->rate, total->unsent);
+    }
+    printf("  throughput   %.1f req/s, %.2f MB/s\n", summary->throughput, total->bytes / summary->elapsed / 1e6);
+    printf("  status       2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, other %ld\n",
+           total->status[2], total->status[3], total->status[4], total->status[5],
+           total->status[0] + total->status[1]);
+    printf("  latency (ms) mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+           mean_ms(&total->latency), percentile_ms(total, &total->latency, 0.5),
+           percentile_ms(total, &total->latency, 0.9), percentile_ms(total, &total->latency, 0.99),
+           percentile_ms(total, &total->latency, 0.999), total->max_latency / 1e3);
+    if (summary->rate > 0) {
+        // What a closed-loop client would have reported
+        printf("  service (ms) mean %.3f, p50 %.3f, p99 %.3f (from the actual send)\n",
+               mean_ms(&total->service), percentile_ms(total, &total->service, 0.5),
+               percentile_ms(total, &total->service, 0.99));
+    }
+}
+
+// Writes a run's results as the members of a JSON object
+static void json_summary(FILE* out, const struct Loadgen_summary* summary, const char* indent) {
+    const struct Loadgen_result* total = &summary->total;
+    fprintf(out, "%s\"offered_rps\": %.3f,\n%s\"elapsed_s\": %.6f,\n", indent, summary->rate, indent, summary->elapsed);
+    fprintf(out, "%s\"completed\": %ld,\n%s\"errors\": %ld,\n%s\"unsent\": %ld,\n",
+            indent, total->completed, indent, summary->errors, indent, total->unsent);
+    fprintf(out, "%s\"connect_errors\": %ld,\n%s\"io_errors\": %ld,\n%s\"timeouts\": %ld,\n%s\"unanswered\": %ld,\n",
+            indent, total->connect_errors, indent, total->io_errors, indent, total->timeouts, indent, total->unanswered);
+    fprintf(out, "%s\"connections_opened\": %ld,\n%s\"connections_reused\": %ld,\n%s\"retries\": %ld,\n",
+            indent, total->connects, indent, total->reuses, indent, total->retries);
+    fprintf(out, "%s\"throughput_rps\": %.3f,\n%s\"bytes\": %ld,\n", indent, summary->throughput, indent, total->bytes);
+    fprintf(out, "%s\"status\": {\"1xx\": %ld, \"2xx\": %ld, \"3xx\": %ld, \"4xx\": %ld, \"5xx\": %ld, \"other\": %ld},\n",
+            indent, total->status[1], total->status[2], total->status[3], total->status[4], total->status[5],
+            total->status[0]);
+    fprintf(out, "%s\"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f},\n",
+            indent, mean_ms(&total->latency), percentile_ms(total, &total->latency, 0.5),
+            percentile_ms(total, &total->latency, 0.9), percentile_ms(total, &total->latency, 0.99),
+            percentile_ms(total, &total->latency, 0.999), total->max_latency / 1e3);
+    fprintf(out, "%s\"service_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f}\n",
+            indent, mean_ms(&total->service), percentile_ms(total, &total->service, 0.5),
+            percentile_ms(total, &total->service, 0.99));
+}
+
+// Writes s as a JSON string
+static void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void json_config(FILE* out, const struct Loadgen_config* config) {
+    fprintf(out, "  \"config\": {\"host\": \"%s\", \"port\": %d, \"threads\": %d, \"connections\": %d, "
+                 "\"duration\": %.3f, \"requests\": %ld, \"rate\": %.3f, \"arrivals\": \"%s\", "
+                 "\"keep_alive\": %s, \"pipeline\": %d, \"slow_bytes\": %d, \"slow_delay_ms\": %.3f, ",
+            config->host, config->port, config->threads, config->connections,
+            config->duration, config->requests, config->rate, config->poisson ? "poisson" : "fixed",
+            config->keep_alive ? "true" : "false", config->pipeline, config->slow_bytes, config->slow_delay);
+    if (config->replay) {
+        fprintf(out, "\"replay\": ");
+        json_string(out, config->replay);
+        fprintf(out, ", \"speed\": %.3f, \"records\": %d},\n", config->speed, replay_len);
+        return;
+    }
+    fprintf(out, "\"mix\": [");
+    for (int i = 0; i < config->mix_len; i++) {
+        fprintf(out, "%s{\"method\": ", i ? ", " : "");
+        json_string(out, config->mix[i].method);
+        fprintf(out, ", \"uri\": ");
+        json_string(out, config->mix[i].uri);
+        fprintf(out, ", \"weight\": %d}", config->mix[i].weight);
+    }
+    fprintf(out, "]},\n");
+}
+
+// Writes one JSON line per trace record, in trace order
+static void write_outcomes(const struct Loadgen_config* config) {
+    FILE* out = fopen(config->results_path, "w");
+    if (!out) {
+        perror(config->results_path);
+        return;
+    }
+    for (int i = 0; i < replay_len; i++) {
+        const struct Loadgen_request* req = &config->mix[i];
+        const struct Loadgen_outcome* outcome = &outcomes[i];
+        fprintf(out, "{\"index\": %d, \"timestamp\": %.6f, \"method\": ", i, req->timestamp);
+        json_string(out, req->method);
+        fprintf(out, ", \"uri\": ");
+        json_string(out, req->uri);
+        if (outcome->status) {
+            fprintf(out, ", \"status\": %d, \"latency_ms\": %.3f, \"service_ms\": %.3f}\n",
+                    outcome->status, outcome->latency / 1e3, outcome->service / 1e3);
+        } else {
+            fprintf(out, ", \"status\": null, \"error\": \"%s\"}\n", outcome->error ? outcome->error : "unsent");
+        }
+    }
+    fclose(out);
+}
+
+// Whether the server kept up with a sweep step, given the p99 (ms) allowed.
+// Past the knee the backlog grows for the whole step, so p99 takes off.
+static int sustained(const struct Loadgen_summary* summary, double p99_limit) {
+    long due = summary->total.completed + summary->errors + summary->total.unsent;
+    return summary->errors + summary->total.unsent <= LOADGEN_MAX_ERRORS * due &&
+           percentile_ms(&summary->total, &summary->total.latency, 0.99) <= p99_limit;
+}
+
+// Runs every rate of the sweep and reports the knee: the highest rate the
+// server sustained before the first one it did not
+static int run_sweep(const struct Loadgen_config* config) {
+    int steps = (int)((config->sweep_to - config->rate) / config->sweep_step + 1e-9) + 1;
+    struct Loadgen_summary* summaries = (struct Loadgen_summary*)malloc(steps * sizeof(struct Loadgen_summary));
+    if (!summaries) {
+        perror("Malloc failed");
+        return -1;
+    }
+    double knee = 0, p99_limit = config->slo;
+    int saturated = 0;
+    for (int i = 0; i < steps; i++) {
+        double rate = config->rate + i * config->sweep_step;
+        printf("Step %d/%d: %.1f req/s offered\n", i + 1, steps, rate);
+        run_once(config, rate, &summaries[i]);
+        print_summary(&summaries[i]);
+        if (i == 0 && p99_limit <= 0) {
+            p99_limit = LOADGEN_KNEE_FACTOR * percentile_ms(&summaries[0].total, &summaries[0].total.latency, 0.5);
+        }
+        if (!saturated && sustained(&summaries[i], p99_limit)) {
+            knee = rate;
+        } else {
+            saturated = 1;
+        }
+    }
+
+    printf("\n%12s %12s %10s %10s %10s %8s\n", "offered", "throughput", "p50 ms", "p99 ms", "p99.9 ms", "errors");
+    for (int i = 0; i < steps; i++) {
+        const struct Loadgen_result* total = &summaries[i].total;
+        printf("%12.1f %12.1f %10.3f %10.3f %10.3f %8ld\n", summaries[i].rate, summaries[i].throughput,
+               percentile_ms(total, &total->latency, 0.5), percentile_ms(total, &total->latency, 0.99),
+               percentile_ms(total, &total->latency, 0.999), summaries[i].errors + total->unsent);
+    }
+    if (knee > 0) {
+        printf("Knee: %.1f req/s (p99 within %.3f ms)\n", knee, p99_limit);
+    } else {
+        printf("Knee: below %.1f req/s (p99 within %.3f ms)\n", config->rate, p99_limit);
+    }
+
+    if (config->json_path) {
+        FILE* out = fopen(config->json_path, "w");
+        if (!out) {
+            perror(config->json_path);
+        } else {
+            fprintf(out, "{\n");
+            json_config(out, config);
+            fprintf(out, "  \"steps\": [\n");
+            for (int i = 0; i < steps; i++) {
+                fprintf(out, "    {\n");
+                json_summary(out, &summaries[i], "      ");
+                fprintf(out, "    }%s\n", i + 1 < steps ? "," : "");
+            }
+            fprintf(out, "  ],\n  \"p99_limit_ms\": %.3f,\n  \"knee_rps\": %.3f\n}\n", p99_limit, knee);
+            fclose(out);
+        }
+    }
+    free(summaries);
+    return 0;
+}
+
+// Resolves the server and builds the requests. rate receives the offered
+// rate (a replay's average one).
+static int loadgen_setup(const struct Loadgen_config* config, double* rate) {
+    char port[16];
+    struct addrinfo hints, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", config->port);
+    int err = getaddrinfo(config->host, port, &hints, &addr);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", config->host, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&server_addr, addr->ai_addr, addr->ai_addrlen);
+    server_addr_len = addr->ai_addrlen;
+    freeaddrinfo(addr);
+    if (prepare_mix(config) < 0) {
+        perror("Malloc failed");
+        return -1;
+    }
+    *rate = config->rate;
+    replay_len = config->mix_len;
+    free(outcomes);
+    outcomes = NULL;
+    if (config->replay) {
+        if (config->requests > 0 && config->requests < replay_len) replay_len = (int)config->requests;
+        outcomes = (struct Loadgen_outcome*)calloc(replay_len, sizeof(struct Loadgen_outcome));
+        if (!outcomes) {
+            perror("Malloc failed");
+            return -1;
+        }
+        *rate = prepare_replay(config);
+    }
+    // Every connection is a descriptor; raise the soft limit as far as allowed
+    struct rlimit files;
+    rlim_t needed = (rlim_t)config->threads * (config->connections + 3) + 16;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < needed) {
+        files.rlim_cur = needed < files.rlim_max ? needed : files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        if (files.rlim_cur < needed) {
+            fprintf(stderr, "Warning: only %lu descriptors allowed for %lu connections\n",
+                    (unsigned long)files.rlim_cur, (unsigned long)config->threads * config->connections);
+        }
+    }
+    return 0;
+}
+
+int loadgen_measure(const struct Loadgen_config* config, struct Loadgen_report* report) {
+    double rate;
+    if (loadgen_setup(config, &rate) < 0) return -1;
+    struct Loadgen_summary summary;
+    run_once(config, rate, &summary);
+    const struct Loadgen_result* total = &summary.total;
+    memset(report, 0, sizeof(*report));
+    report->elapsed = summary.elapsed;
+    report->throughput = summary.throughput;
+    report->completed = total->completed;
+    report->errors = summary.errors + total->unsent;
+    memcpy(report->status, total->status, sizeof(report->status));
+    report->mean_ms = mean_ms(&total->latency);
+    report->p50_ms = percentile_ms(total, &total->latency, 0.5);
+    report->p90_ms = percentile_ms(total, &total->latency, 0.9);
+    report->p99_ms = percentile_ms(total, &total->latency, 0.99);
+    report->p999_ms = percentile_ms(total, &total->latency, 0.999);
+    report->max_ms = total->max_latency / 1e3;
+    return 0;
+}
+
+int loadgen_run(const struct Loadgen_config* config) {
+    double rate;
+    if (loadgen_setup(config, &rate) < 0) return -1;
+    if (config->replay) {
+        printf("Replaying %d requests from %s ", replay_len, config->replay);
+        if (config->speed > 0) {
+            printf("at %gx speed", config->speed);
+        } else {
+            printf("as fast as possible");
+        }
+        printf(" @ %s:%d, %d threads x %d connections\n", config->host, config->port, config->threads,
+               config->connections);
+    } else {
+        printf("Running %s benchmark @ %s:%d, %d threads x %d connections\n",
+               config->rate > 0 ? (config->poisson ? "open-loop (Poisson)" : "open-loop") : "closed-loop",
+               config->host, config->port, config->threads, config->connections);
+    }
+    if (config->rate > 0 && config->sweep_to > config->rate && config->sweep_step > 0) {
+        return run_sweep(config);
+    }
+    struct Loadgen_summary summary;
+    run_once(config, rate, &summary);
+    print_summary(&summary);
+    if (config->replay && config->results_path) {
+        write_outcomes(config);
+        printf("  results      one line per request in %s\n", config->results_path);
+    }
+    if (config->json_path) {
+        FILE* out = fopen(config->json_path, "w");
+        if (!out) {
+            perror(config->json_path);
+            return 0;
+        }
+        fprintf(out, "{\n");
+        json_config(out, config);
+        json_summary(out, &summary, "  ");
+        fprintf(out, "}\n");
+        fclose(out);
+    }
+    return 0;
+}
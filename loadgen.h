@@ -0,0 +1,99 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+// Load generator behind the client's benchmark mode.
+// Each thread drives up to `connections` requests at a time over non-blocking
+// sockets and an epoll loop of its own; requests are drawn at random from a
+// weighted mix. Latencies go into per-thread histograms, which are merged into
+// one report when the run ends.
+// In a closed loop (rate 0) a connection sends its next request as soon as a
+// response ends, so a stalled server also stalls the load. In an open loop
+// requests are due at a fixed or Poisson rate whatever the server does, and
+// latency runs from when a request was due, not from when it could be sent:
+// the time it waited for a free connection counts (coordinated-omission
+// correction, as in HdrHistogram and wrk2).
+// A thread can hold tens of thousands of connections. By default every
+// request opens a connection of its own, and its latency runs from connect
+// to the end of the response. Optionally a request is trickled out a few
+// bytes at a time (slow senders), connections are kept alive for reuse, and
+// a closed loop pipelines several requests per connection. Responses are
+// framed by Content-Length when they have one, and otherwise by the server
+// closing the connection.
+// A replay sends the requests of a recorded trace in order instead of at
+// random: at their original pace, scaled by a speed factor, or flat out as a
+// closed loop. Thread k of n sends records k, k + n, ..., each due when its
+// timestamp says (an open loop), and the outcome of every record is logged.
+
+// Most requests pipelined on one connection
+#define LOADGEN_MAX_PIPELINE 64
+
+struct Loadgen_request {
+    char* method;
+    char* uri;
+    char* body;     // Sent with a Content-Length, or NULL for none
+    int weight;     // Relative frequency in the mix
+    double timestamp;   // Replay: when it was sent originally (seconds)
+};
+
+struct Loadgen_config {
+    const char* host;
+    int port;
+    int threads;
+    int connections;        // Requests in flight per thread
+    double duration;        // Seconds; 0 = run until `requests` are sent
+    long requests;          // Total over all threads; 0 = until `duration` ends
+    double timeout;         // Seconds before a request is given up
+    double rate;            // Requests per second in total; 0 = closed loop
+    int poisson;            // Exponential gaps between requests, not fixed ones
+    double sweep_to;        // Run again at rate + k * sweep_step up to this rate
+    double sweep_step;
+    double slo;             // p99 (ms) a sweep step must stay under; 0 = any
+    int keep_alive;         // Reuse connections the server keeps open
+    int pipeline;           // Requests sent back to back per connection (closed loop)
+    int slow_bytes;         // Send requests this many bytes at a time...
+    double slow_delay;      // ...this many milliseconds apart (0 = all at once)
+    double ramp;            // Seconds over which a closed loop opens its connections
+    struct Loadgen_request* mix;
+    int mix_len;
+    const char* replay;     // Trace the mix was read from, sent in order (NULL = none)
+    double speed;           // Replay pace as a multiple of the original; 0 = flat out
+    const char* json_path;  // Also write the results here as JSON (NULL = don't)
+    const char* results_path;   // Replay: log each request's outcome here as JSONL
+};
+
+// Parses a mix entry "[METHOD] URI [WEIGHT [BODY]]" (METHOD defaults to GET,
+// WEIGHT to 1) into req. spec is modified, and req points into it.
+// Returns -1 if it is malformed.
+int loadgen_parse_request(char* spec, struct Loadgen_request* req);
+
+// Parses a trace record, a JSON object such as
+// {"timestamp": 1718000000.25, "method": "POST", "uri": "/log", "body": "x"}
+// into req. timestamp is in seconds, or an ISO 8601 time; method defaults to
+// GET; body may be a string, null, or any other JSON value (sent as its
+// text); other keys are ignored. line is modified, and req points into it.
+// Returns -1 if it is malformed.
+int loadgen_parse_record(char* line, struct Loadgen_request* req);
+
+// Headline results of one run
+struct Loadgen_report {
+    double elapsed;         // Seconds
+    double throughput;      // Completed requests per second
+    long completed;
+    long errors;            // Failed requests, and due ones never sent
+    long status[6];         // [k] counts kxx responses; [0] unparsable ones
+    double mean_ms, p50_ms, p90_ms, p99_ms, p999_ms, max_ms;
+};
+
+// Runs the benchmark once (no sweep) without printing anything, and fills
+// report. May be called again for another run. Returns -1 if it could not
+// start.
+int loadgen_measure(const struct Loadgen_config* config, struct Loadgen_report* report);
+
+// Runs the benchmark, or every step of a rate sweep, and prints its report.
+// A sweep also reports the knee: the highest rate before the first one that
+// failed (or never sent) over 1% of its requests, or whose p99 exceeded the
+// slo (default: 5 times the median latency at the lightest rate). Returns -1
+// if it could not start.
+int loadgen_run(const struct Loadgen_config* config);
+
+#endif // LOADGEN_H
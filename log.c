@@ -1,146 +1,1314 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/eventfd.h>
 #include "log.h"
+#include "log_segment.h"
+#include "epoch.h"
+#include "counter.h"
+#include "clock.h"
+#include "out_buf.h"
 
-// log_entry struct definition
-struct Log_entry {
+// Chunk sizes grow geometrically from LOG_CHUNK_MIN up to LOG_CHUNK_MAX,
+// so a log of n bytes costs O(log n) mallocs instead of two per entry.
+#define LOG_CHUNK_MIN 4096
+#define LOG_CHUNK_MAX (1 << 20)
+
+// With a byte limit, each shard is a fixed ring of this many equal chunks
+#define LOG_RING_CHUNKS 8
+
+// Initial number of chunk slots in a shard's table when it may grow
+#define LOG_TABLE_MIN 8
+
+// Each chunk's sparse index marks the first record starting in every
+// LOG_MARK_STRIDE bytes of data
+#define LOG_MARK_STRIDE 1024
+
+// Default and largest segment file size for persistent logs
+#define LOG_SEGMENT_SIZE (4 << 20)
+#define LOG_SEGMENT_MAX (1 << 30)
+
+// One contiguous block of records. Records never span chunks.
+// Only the owning shard's thread writes to a chunk; `committed` is the
+// publication point for readers (release on store, acquire on load).
+// When retention recycles a chunk its `index` changes before any byte is
+// overwritten, so readers validate the index after copying (seqlock style).
+// A persistent log maps each chunk's data from a segment file.
+//
+// marks is a sparse sequence-to-offset index: marks[0] is the chunk's first
+// record, so a reader finds a sequence number with a binary search over the
+// shard's chunks, another over the chunk's marks and a short scan.
+// The chunk and each mark's stride also summarize the stats they hold, so
+// filtered reads skip whole chunks and strides that cannot match. Summaries
+// only ever widen while a chunk is in use, so a reader that sees a newer
+// summary than its snapshot never skips too much.
+struct Log_summary {
+    _Atomic long min_arrival;
+    _Atomic long max_arrival;
+    _Atomic unsigned long threads;  // Bit (thread_id % 64) per thread
+    _Atomic int classes;            // Bit (1 << req_class) per class
+};
+
+struct Log_mark {
+    unsigned long seq;
+    long offset;
+    struct Log_summary sum;         // Stats starting in this stride
+};
+
+struct Log_chunk {
+    _Atomic unsigned long index;  // Position of the chunk in its shard
+    _Atomic int committed;        // Bytes of complete records in data
+    _Atomic long newest;          // Monotonic second of the newest entry
+    long opened;                  // Monotonic second of the first entry (owner only)
+    int capacity;                 // Bytes available in data
+    int count;                    // Entries in the chunk (owner only)
+    long text;                    // Bytes of entry text in the chunk (owner only)
     char* data;
-    int data_len;
-    struct Log_entry* next;
+    struct Log_segment seg;       // Backing file (seg.map is NULL in memory)
+    _Atomic int nmarks;           // Published like committed
+    int max_marks;
+    struct Log_mark* marks;
+    struct Log_summary sum;       // Stats in the whole chunk
+};
+
+// Maps chunk index i of a shard to slots[i % nslots]. Replaced (and the old
+// copy retired through the epoch) when an unbounded shard outgrows it.
+struct Log_table {
+    int nslots;
+    struct Log_chunk* _Atomic slots[];
+};
+
+// Single-writer append buffer owned by one thread. Live chunks are the
+// indices first..last; the writer appends to chunk `last`.
+struct Log_shard {
+    int id;                          // Names the shard's segment files
+    int orphan;                      // Recovered from disk and not yet adopted
+    pthread_t owner;
+    struct Log_table* _Atomic table;
+    _Atomic unsigned long first;
+    _Atomic unsigned long last;
+    _Atomic long size;               // Bytes of live entry text (excluding headers)
+    _Atomic long count;              // Number of live entries
+    _Atomic long dropped;            // Entries evicted by retention
+    struct Log_chunk* spare;         // Evicted chunk kept for reuse (owner only)
+    // An append sets busy before taking its sequence number and clears it
+    // after publishing; see log_watermark
+    _Atomic int busy;
+    _Atomic unsigned long published; // Every later entry has a seq at least this
+    int unsynced;                    // Entries since the last flush request (owner only)
+    unsigned long sync_index;        // Flushed up to here (flusher thread only)
+    int sync_offset;
+};
+
+// Immutable list of shards. Registering a shard publishes a new copy and
+// retires the old one through the log's epoch domain.
+struct Log_dir {
+    int nshards;
+    struct Log_shard* shards[];
 };
 
 struct Server_log {
-    struct Log_entry* head; // Pointer to the first log entry
-    struct Log_entry* tail; // Pointer to the last log entry
-    int size;
-    pthread_mutex_t mutex; // Mutex for thread-safe access
-    pthread_cond_t read_allowed;
-    pthread_cond_t write_allowed;
-    int readers, writers, waiting_writers;
+    unsigned long id;          // Distinguishes logs in the per-thread shard cache
+    _Atomic unsigned long next_seq;
+    struct Log_dir* _Atomic dir;  // Loaded by readers inside an epoch
+    epoch_domain epoch;
+    struct Log_config config;
+    long shard_max_entries;    // Per-shard share of max_entries (0 = no limit)
+    int ring_chunk;            // Chunk size when shards are fixed rings (0 = they grow)
+    int next_shard_id;         // Guarded by register_mutex
+    // Persistent logs only: the flusher thread syncs segments every
+    // sync_interval_ms, or sooner once sync_batch entries are unsynced
+    pthread_t flusher;
+    pthread_mutex_t sync_mutex;
+    pthread_cond_t sync_cond;
+    int sync_requested, sync_stop;
+    // Group commit (see log_commit), guarded by sync_mutex
+    pthread_cond_t commit_cond;
+    int flushing;              // A flush is running
+    unsigned long durable;     // Every entry below this seq is on disk
+    // Wakes a subscriber once after log_arm_notify (see log_notify_fd)
+    int notify_fd;
+    _Atomic int notify_armed;
+    // Serializes threads registering new shards (once per thread) and the
+    // creation of notify_fd; appends and reads never take it
+    pthread_mutex_t register_mutex;
 };
 
-// Creates a new server log instance (stub)
-server_log create_log() {
+// Each thread caches the shard it appends to for the last log it used
+static _Atomic unsigned long next_log_id = 1;
+static __thread unsigned long local_log_id;
+static __thread struct Log_shard* local_shard;
+
+static struct Log_table* new_table(int nslots) {
+    struct Log_table* table = (struct Log_table*)malloc(sizeof(struct Log_table) +
+                                                        nslots * sizeof(struct Log_chunk*));
+    if (!table) return NULL;
+    table->nslots = nslots;
+    for (int i = 0; i < nslots; i++) atomic_init(&table->slots[i], NULL);
+    return table;
+}
+
+static struct Log_shard* new_shard(int id, struct Log_table* table, unsigned long first, unsigned long last) {
+    struct Log_shard* shard = (struct Log_shard*)malloc(sizeof(struct Log_shard));
+    if (!shard) return NULL;
+    shard->id = id;
+    shard->orphan = 0;
+    shard->owner = pthread_self();
+    atomic_init(&shard->table, table);
+    atomic_init(&shard->first, first);
+    atomic_init(&shard->last, last);
+    atomic_init(&shard->size, 0);
+    atomic_init(&shard->count, 0);
+    atomic_init(&shard->dropped, 0);
+    shard->spare = NULL;
+    atomic_init(&shard->busy, 0);
+    atomic_init(&shard->published, 0);
+    shard->unsynced = 0;
+    shard->sync_index = first;
+    shard->sync_offset = 0;
+    return shard;
+}
+
+static void summary_reset(struct Log_summary* sum) {
+    atomic_store_explicit(&sum->min_arrival, LONG_MAX, memory_order_relaxed);
+    atomic_store_explicit(&sum->max_arrival, LONG_MIN, memory_order_relaxed);
+    atomic_store_explicit(&sum->threads, 0, memory_order_relaxed);
+    atomic_store_explicit(&sum->classes, 0, memory_order_relaxed);
+}
+
+// Widens a summary to cover stat (owner only)
+static void summary_add(struct Log_summary* sum, const struct Log_stat* stat) {
+    if (stat->arrival < atomic_load_explicit(&sum->min_arrival, memory_order_relaxed)) {
+        atomic_store_explicit(&sum->min_arrival, stat->arrival, memory_order_relaxed);
+    }
+    if (stat->arrival > atomic_load_explicit(&sum->max_arrival, memory_order_relaxed)) {
+        atomic_store_explicit(&sum->max_arrival, stat->arrival, memory_order_relaxed);
+    }
+    atomic_fetch_or_explicit(&sum->threads, 1UL << (stat->thread_id & 63), memory_order_relaxed);
+    atomic_fetch_or_explicit(&sum->classes, 1 << (stat->req_class & 31), memory_order_relaxed);
+}
+
+// Allocates an empty chunk with its sparse index and, unless its data is
+// mapped from a segment, `capacity` bytes of data
+static struct Log_chunk* alloc_chunk(unsigned long index, int capacity, int mapped) {
+    int max_marks = capacity / LOG_MARK_STRIDE + 1;
+    size_t marks_len = max_marks * sizeof(struct Log_mark);
+    struct Log_chunk* chunk = (struct Log_chunk*)malloc(sizeof(struct Log_chunk) + marks_len +
+                                                        (mapped ? 0 : capacity));
+    if (!chunk) return NULL;
+    chunk->seg.map = NULL;
+    chunk->marks = (struct Log_mark*)(chunk + 1);
+    chunk->max_marks = max_marks;
+    chunk->data = mapped ? NULL : (char*)chunk->marks + marks_len;
+    atomic_init(&chunk->index, index);
+    atomic_init(&chunk->committed, 0);
+    atomic_init(&chunk->newest, 0);
+    chunk->opened = 0;
+    atomic_init(&chunk->nmarks, 0);
+    summary_reset(&chunk->sum);
+    chunk->capacity = capacity;
+    chunk->count = 0;
+    chunk->text = 0;
+    return chunk;
+}
+
+// Allocates chunk `index` of a shard, backed by a new segment file when
+// the log is persistent. If the file cannot be created (e.g. the disk is
+// full) the chunk is kept in memory only, so appends go on without it.
+static struct Log_chunk* new_chunk(server_log log, int shard_id, unsigned long index, int capacity) {
+    struct Log_chunk* chunk = alloc_chunk(index, capacity, log->config.dir != NULL);
+    if (!chunk) return NULL;
+    if (log->config.dir) {
+        chunk->data = segment_create(log->config.dir, shard_id, index, capacity, &chunk->seg);
+        if (!chunk->data) {
+            free(chunk);
+            fprintf(stderr, "log: keeping chunk %lu of shard %d in memory only\n", index, shard_id);
+            return alloc_chunk(index, capacity, 0);
+        }
+    }
+    return chunk;
+}
+
+// Adds the record at `offset` to the chunk's sparse index if it is the first
+// to start in a new stride, and to the summaries (owner only, before the
+// record is committed)
+static inline void chunk_mark(struct Log_chunk* chunk, const struct Log_record* rec, const char* data, int offset) {
+    int n = atomic_load_explicit(&chunk->nmarks, memory_order_relaxed);
+    if (n < chunk->max_marks && offset >= (long)n * LOG_MARK_STRIDE) {
+        chunk->marks[n].seq = rec->seq;
+        chunk->marks[n].offset = offset;
+        summary_reset(&chunk->marks[n].sum);
+        atomic_store_explicit(&chunk->nmarks, ++n, memory_order_release);
+    }
+    if (rec->kind == LOG_KIND_STAT && rec->len == sizeof(struct Log_stat)) {
+        struct Log_stat stat;
+        memcpy(&stat, data, sizeof(stat));
+        summary_add(&chunk->sum, &stat);
+        summary_add(&chunk->marks[n - 1].sum, &stat);
+    }
+}
+
+// Unmaps (without deleting) and frees a chunk; also used through epoch_retire
+static void free_chunk(void* ptr) {
+    struct Log_chunk* chunk = (struct Log_chunk*)ptr;
+    if (!chunk) return;
+    segment_close(&chunk->seg);
+    free(chunk);
+}
+
+// Drops an evicted chunk for good, deleting its segment file
+static void retire_chunk(server_log log, struct Log_chunk* chunk) {
+    if (chunk->seg.map) segment_evict(log->config.dir, &chunk->seg, 1);
+    epoch_retire(log->epoch, chunk, free_chunk);
+}
+
+static inline struct Log_chunk* table_slot(struct Log_table* table, unsigned long index) {
+    return atomic_load_explicit(&table->slots[index % table->nslots], memory_order_acquire);
+}
+
+// Adds a shard to the directory (caller holds register_mutex)
+static int publish_shard(server_log log, struct Log_shard* shard) {
+    struct Log_dir* old = atomic_load_explicit(&log->dir, memory_order_relaxed);
+    struct Log_dir* dir = (struct Log_dir*)malloc(sizeof(struct Log_dir) + (old->nshards + 1) * sizeof(struct Log_shard*));
+    if (!dir) return -1;
+    memcpy(dir->shards, old->shards, old->nshards * sizeof(struct Log_shard*));
+    dir->shards[old->nshards] = shard;
+    dir->nshards = old->nshards + 1;
+    atomic_store_explicit(&log->dir, dir, memory_order_release);
+    epoch_retire(log->epoch, old, free);
+    return 0;
+}
+
+// Returns the calling thread's shard on first use: the one it already owns,
+// else a shard recovered from disk that no thread owns yet, else a new one
+static struct Log_shard* get_local_shard(server_log log) {
+    if (local_log_id == log->id) {
+        return local_shard;
+    }
+    // The cache only remembers one log; the directory is only changed under
+    // register_mutex, so owners can be compared without entering the epoch
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&log->register_mutex);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_relaxed);
+    struct Log_shard* shard = NULL;
+    for (int i = 0; i < dir->nshards && !shard; i++) {
+        if (!dir->shards[i]->orphan && pthread_equal(dir->shards[i]->owner, self)) shard = dir->shards[i];
+    }
+    for (int i = 0; i < dir->nshards && !shard; i++) {
+        if (dir->shards[i]->orphan) {
+            shard = dir->shards[i];
+            shard->owner = self;
+            shard->orphan = 0;
+        }
+    }
+    if (!shard) {
+        int nslots = log->ring_chunk ? LOG_RING_CHUNKS : LOG_TABLE_MIN;
+        int capacity = log->ring_chunk ? log->ring_chunk :
+                       log->config.dir ? (int)log->config.segment_size : LOG_CHUNK_MIN;
+        int id = log->next_shard_id;
+        struct Log_table* table = new_table(nslots);
+        struct Log_chunk* chunk = new_chunk(log, id, 0, capacity);
+        shard = new_shard(id, table, 0, 0);
+        if (shard) atomic_init(&shard->published, atomic_load(&log->next_seq));
+        if (table && chunk) atomic_init(&table->slots[0], chunk);
+        if (!table || !chunk || !shard || publish_shard(log, shard) < 0) {
+            pthread_mutex_unlock(&log->register_mutex);
+            free(table);
+            free_chunk(chunk);
+            free(shard);
+            return NULL;
+        }
+        log->next_shard_id++;
+    }
+    pthread_mutex_unlock(&log->register_mutex);
+
+    local_log_id = log->id;
+    local_shard = shard;
+    return shard;
+}
+
+// Returns 1 if the shard's oldest chunk falls outside the retention limits
+static int oldest_expired(server_log log, struct Log_shard* shard, struct Log_chunk* oldest,
+                          unsigned long live_chunks, long now) {
+    if (log->ring_chunk && live_chunks >= LOG_RING_CHUNKS) return 1;
+    if (log->shard_max_entries &&
+        atomic_load_explicit(&shard->count, memory_order_relaxed) - oldest->count >= log->shard_max_entries) {
+        return 1;
+    }
+    if (log->config.max_age > 0 &&
+        atomic_load_explicit(&oldest->newest, memory_order_relaxed) < now - log->config.max_age) {
+        return 1;
+    }
+    return 0;
+}
+
+// Drops the oldest chunks that fall outside the retention limits, keeping
+// one for reuse. Never drops the chunk currently being appended to.
+static void evict_chunks(server_log log, struct Log_shard* shard, long now) {
+    struct Log_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    unsigned long first = atomic_load_explicit(&shard->first, memory_order_relaxed);
+    unsigned long last = atomic_load_explicit(&shard->last, memory_order_relaxed);
+    while (first < last) {
+        struct Log_chunk* oldest = table_slot(table, first);
+        if (!oldest) {
+            // A segment lost before recovery
+            atomic_store_explicit(&shard->first, ++first, memory_order_release);
+            continue;
+        }
+        if (!oldest_expired(log, shard, oldest, last - first + 1, now)) break;
+        // Counted as dropped before readers lose it, so log_dropped never
+        // falls short of what a read is missing
+        counter_add(&shard->dropped, oldest->count);
+        counter_add(&shard->count, -oldest->count);
+        counter_add(&shard->size, -oldest->text);
+        first++;
+        atomic_store_explicit(&shard->first, first, memory_order_release);
+        if (!shard->spare) {
+            if (oldest->seg.map) segment_evict(log->config.dir, &oldest->seg, 0);
+            shard->spare = oldest;
+        } else {
+            retire_chunk(log, oldest);
+        }
+    }
+}
+
+// Doubles the chunk table of a shard that is allowed to grow
+static struct Log_table* grow_table(server_log log, struct Log_shard* shard, struct Log_table* table) {
+    int nslots = table->nslots * 2;
+    struct Log_table* bigger = new_table(nslots);
+    if (!bigger) return NULL;
+    unsigned long last = atomic_load_explicit(&shard->last, memory_order_relaxed);
+    for (unsigned long i = atomic_load_explicit(&shard->first, memory_order_relaxed); i <= last; i++) {
+        atomic_init(&bigger->slots[i % nslots], table_slot(table, i));
+    }
+    atomic_store_explicit(&shard->table, bigger, memory_order_release);
+    epoch_retire(log->epoch, table, free);
+    return bigger;
+}
+
+// Starts a new chunk with room for at least `need` bytes. Once the shard
+// has reached its retention limits this reuses the evicted oldest chunk,
+// so a bounded log stops allocating.
+static struct Log_chunk* advance_chunk(server_log log, struct Log_shard* shard,
+                                       struct Log_chunk* tail, int need, long now) {
+    evict_chunks(log, shard, now);
+
+    int capacity = log->ring_chunk;
+    if (!capacity && log->config.dir) {
+        // Persistent shards roll over to a new segment at the size limit
+        capacity = (int)log->config.segment_size;
+    } else if (!capacity) {
+        capacity = tail->capacity * 2;
+        if (capacity > LOG_CHUNK_MAX) capacity = LOG_CHUNK_MAX;
+    }
+    if (!log->ring_chunk && log->shard_max_entries && tail->count > 0) {
+        // Size chunks to about 1/LOG_RING_CHUNKS of the entry budget so
+        // eviction stays fine-grained
+        long per_entry = atomic_load_explicit(&tail->committed, memory_order_relaxed) / tail->count;
+        long cap = per_entry * log->shard_max_entries / LOG_RING_CHUNKS;
+        if (cap < per_entry) cap = per_entry;
+        if (capacity > cap) capacity = (int)LOG_ALIGN(cap);
+    }
+    if (capacity < need) capacity = need;
+
+    struct Log_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    unsigned long first = atomic_load_explicit(&shard->first, memory_order_relaxed);
+    unsigned long index = atomic_load_explicit(&shard->last, memory_order_relaxed) + 1;
+    if (index - first >= (unsigned long)table->nslots) {
+        struct Log_table* bigger = grow_table(log, shard, table);
+        if (!bigger) return NULL;
+        table = bigger;
+    }
+
+    struct Log_chunk* chunk = shard->spare;
+    shard->spare = NULL;
+    if (chunk && chunk->capacity < need) {
+        retire_chunk(log, chunk);
+        chunk = NULL;
+    }
+    if (chunk) {
+        // Invalidate readers of the chunk's previous life before overwriting it
+        atomic_store_explicit(&chunk->index, index, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        if (chunk->seg.map) segment_reuse(log->config.dir, &chunk->seg, index);
+        atomic_store_explicit(&chunk->committed, 0, memory_order_relaxed);
+        atomic_store_explicit(&chunk->nmarks, 0, memory_order_relaxed);
+        summary_reset(&chunk->sum);
+        chunk->count = 0;
+        chunk->text = 0;
+    } else {
+        chunk = new_chunk(log, shard->id, index, capacity);
+        if (!chunk) return NULL;
+    }
+    atomic_store_explicit(&table->slots[index % table->nslots], chunk, memory_order_release);
+    atomic_store_explicit(&shard->last, index, memory_order_release);
+    return chunk;
+}
+
+// Flushes every shard's segments from where the last flush stopped up to
+// their current publication point (flusher thread only)
+static void sync_segments(server_log log) {
+    epoch_enter(log->epoch);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_acquire);
+    for (int i = 0; i < dir->nshards; i++) {
+        struct Log_shard* shard = dir->shards[i];
+        unsigned long first = atomic_load_explicit(&shard->first, memory_order_acquire);
+        unsigned long last = atomic_load_explicit(&shard->last, memory_order_acquire);
+        struct Log_table* table = atomic_load_explicit(&shard->table, memory_order_acquire);
+        if (shard->sync_index < first) {
+            shard->sync_index = first;
+            shard->sync_offset = 0;
+        }
+        for (unsigned long c = shard->sync_index; c <= last; c++) {
+            struct Log_chunk* chunk = table_slot(table, c);
+            if (!chunk || atomic_load_explicit(&chunk->index, memory_order_acquire) != c) continue;
+            int committed = atomic_load_explicit(&chunk->committed, memory_order_acquire);
+            int from = c == shard->sync_index ? shard->sync_offset : 0;
+            // The mapping stays valid while the epoch is pinned, even if the
+            // chunk is evicted meanwhile
+            segment_sync(&chunk->seg, from, committed);
+            shard->sync_index = c;
+            shard->sync_offset = committed;
+        }
+    }
+    epoch_exit(log->epoch);
+}
+
+// Wakes the flusher early once an appender has sync_batch unsynced entries
+static void request_sync(server_log log) {
+    pthread_mutex_lock(&log->sync_mutex);
+    log->sync_requested = 1;
+    pthread_cond_signal(&log->sync_cond);
+    pthread_mutex_unlock(&log->sync_mutex);
+}
+
+// Flushes everything published so far as the current leader. Called with
+// sync_mutex held and no flush running; drops the mutex while syncing.
+static void flush_as_leader(server_log log) {
+    log->flushing = 1;
+    pthread_mutex_unlock(&log->sync_mutex);
+    unsigned long target = log_next_cursor(log);
+    sync_segments(log);
+    pthread_mutex_lock(&log->sync_mutex);
+    if (target > log->durable) log->durable = target;
+    log->flushing = 0;
+    pthread_cond_broadcast(&log->commit_cond);
+}
+
+// Group commit: waits until every entry below seq is on disk. The first
+// waiter to find no flush running leads one and the others wait for it, so
+// concurrent appenders share a single pass over the segments.
+static void log_commit(server_log log, unsigned long seq) {
+    pthread_mutex_lock(&log->sync_mutex);
+    while (log->durable < seq) {
+        if (log->flushing) {
+            pthread_cond_wait(&log->commit_cond, &log->sync_mutex);
+        } else {
+            flush_as_leader(log);
+        }
+    }
+    pthread_mutex_unlock(&log->sync_mutex);
+}
+
+// Batches fsyncs: one pass every sync_interval_ms or on request
+static void* flusher_thread(void* arg) {
+    server_log log = (server_log)arg;
+    pthread_mutex_lock(&log->sync_mutex);
+    while (!log->sync_stop) {
+        if (!log->sync_requested) {
+            if (log->config.sync_interval_ms > 0) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += log->config.sync_interval_ms / 1000;
+                deadline.tv_nsec += (log->config.sync_interval_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&log->sync_cond, &log->sync_mutex, &deadline);
+            } else {
+                pthread_cond_wait(&log->sync_cond, &log->sync_mutex);
+            }
+        }
+        log->sync_requested = 0;
+        // A committer's flush already covers this pass
+        if (!log->flushing) flush_as_leader(log);
+    }
+    pthread_mutex_unlock(&log->sync_mutex);
+    return NULL;
+}
+
+// Adds a recovered segment to its shard, creating the shard on first sight.
+// Recovered shards are orphans until a thread adopts them in get_local_shard.
+static void recover_segment(void* ctx, struct Log_segment* seg, const struct Log_segment_info* info) {
+    server_log log = (server_log)ctx;
+    struct Log_chunk* chunk = alloc_chunk(seg->index, info->capacity, 1);
+    if (!chunk) {
+        segment_close(seg);
+        return;
+    }
+    chunk->seg = *seg;
+    chunk->data = info->data;
+    atomic_init(&chunk->committed, info->committed);
+    // Monotonic time does not survive a restart; age counts from recovery
+    atomic_init(&chunk->newest, monotonic_coarse_sec());
+    chunk->count = info->count;
+    chunk->text = info->text;
+    for (int offset = 0; offset < info->committed;) {
+        struct Log_record rec;
+        memcpy(&rec, chunk->data + offset, sizeof(rec));
+        chunk_mark(chunk, &rec, chunk->data + offset + sizeof(rec), offset);
+        offset += LOG_ALIGN(sizeof(struct Log_record) + rec.len);
+    }
+
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_relaxed);
+    struct Log_shard* shard = NULL;
+    for (int i = 0; i < dir->nshards; i++) {
+        if (dir->shards[i]->id == seg->shard) shard = dir->shards[i];
+    }
+    if (!shard) {
+        int nslots = log->ring_chunk ? LOG_RING_CHUNKS : LOG_TABLE_MIN;
+        struct Log_table* table = new_table(nslots);
+        shard = new_shard(seg->shard, table, seg->index, seg->index);
+        if (!table || !shard || publish_shard(log, shard) < 0) {
+            free(table);
+            free(shard);
+            free_chunk(chunk);
+            return;
+        }
+        shard->orphan = 1;
+        if (seg->shard >= log->next_shard_id) log->next_shard_id = seg->shard + 1;
+    }
+    // Widen [first, last] to include this chunk, growing the table to span it
+    unsigned long first = atomic_load_explicit(&shard->first, memory_order_relaxed);
+    unsigned long last = atomic_load_explicit(&shard->last, memory_order_relaxed);
+    if (seg->index < first) first = seg->index;
+    if (seg->index > last) last = seg->index;
+    struct Log_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    if (last - first >= (unsigned long)table->nslots) {
+        int nslots = table->nslots;
+        while (last - first >= (unsigned long)nslots) nslots *= 2;
+        struct Log_table* bigger = new_table(nslots);
+        if (!bigger) {
+            free_chunk(chunk);
+            return;
+        }
+        for (int i = 0; i < table->nslots; i++) {
+            struct Log_chunk* old = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+            if (old) atomic_init(&bigger->slots[atomic_load(&old->index) % nslots], old);
+        }
+        free(table);
+        table = bigger;
+        atomic_store_explicit(&shard->table, table, memory_order_relaxed);
+    }
+    atomic_init(&table->slots[seg->index % table->nslots], chunk);
+    atomic_store_explicit(&shard->first, first, memory_order_relaxed);
+    atomic_store_explicit(&shard->last, last, memory_order_relaxed);
+    shard->sync_index = last;
+    shard->sync_offset = 0;
+    counter_add(&shard->count, info->count);
+    counter_add(&shard->size, info->text);
+    if (info->count > 0 && info->max_seq + 1 > atomic_load_explicit(&shard->published, memory_order_relaxed)) {
+        atomic_store_explicit(&shard->published, info->max_seq + 1, memory_order_relaxed);
+    }
+    if (info->count > 0 && info->max_seq + 1 > atomic_load_explicit(&log->next_seq, memory_order_relaxed)) {
+        atomic_store_explicit(&log->next_seq, info->max_seq + 1, memory_order_relaxed);
+    }
+}
+
+// Creates a new server log instance with the given retention limits
+server_log create_log_with_config(const struct Log_config* config) {
     server_log result = (server_log)malloc(sizeof(struct Server_log));
-    result->head = NULL;
-    result->tail = NULL;
-    result->size = 0;
-    result->readers = 0;
-    result->writers = 0;
-    result->waiting_writers = 0;
-    pthread_mutex_init(&(result->mutex), NULL);
-    pthread_cond_init(&result->read_allowed, NULL);
-    pthread_cond_init(&result->write_allowed, NULL);
+    if (!result) return NULL;
+    result->id = atomic_fetch_add(&next_log_id, 1);
+    atomic_init(&result->next_seq, 0);
+    struct Log_dir* dir = (struct Log_dir*)malloc(sizeof(struct Log_dir));
+    result->epoch = create_epoch_domain();
+    if (!dir || !result->epoch) {
+        free(dir);
+        destroy_epoch_domain(result->epoch);
+        free(result);
+        return NULL;
+    }
+    dir->nshards = 0;
+    atomic_init(&result->dir, dir);
+
+    memset(&result->config, 0, sizeof(result->config));
+    if (config) result->config = *config;
+    int writers = result->config.writers > 0 ? result->config.writers : 1;
+    result->shard_max_entries = 0;
+    if (result->config.max_entries > 0) {
+        result->shard_max_entries = (result->config.max_entries + writers - 1) / writers;
+    }
+    result->ring_chunk = 0;
+    if (result->config.max_bytes > 0) {
+        long chunk = result->config.max_bytes / writers / LOG_RING_CHUNKS;
+        if (chunk < 512) chunk = 512;
+        if (chunk > LOG_CHUNK_MAX) chunk = LOG_CHUNK_MAX;
+        result->ring_chunk = (int)LOG_ALIGN(chunk);
+    }
+    if (result->config.dir && result->config.segment_size <= 0) {
+        result->config.segment_size = LOG_SEGMENT_SIZE;
+    }
+    if (result->config.segment_size > LOG_SEGMENT_MAX) {
+        result->config.segment_size = LOG_SEGMENT_MAX;
+    }
+    result->next_shard_id = 0;
+
+    pthread_mutex_init(&result->register_mutex, NULL);
+
+    result->sync_requested = 0;
+    result->sync_stop = 0;
+    result->flushing = 0;
+    result->durable = 0;
+    pthread_cond_init(&result->commit_cond, NULL);
+    result->notify_fd = -1;
+    atomic_init(&result->notify_armed, 0);
+    pthread_mutex_init(&result->sync_mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&result->sync_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (result->config.dir) {
+        // Reload what the previous run left on disk, then start flushing
+        if (segment_recover(result->config.dir, recover_segment, result) < 0 ||
+            pthread_create(&result->flusher, NULL, flusher_thread, result) != 0) {
+            result->config.dir = NULL;
+            destroy_log(result);
+            return NULL;
+        }
+    }
     return result;
 }
 
-// Destroys and frees the log (stub)
+// Creates a new server log instance that keeps every entry
+server_log create_log() {
+    return create_log_with_config(NULL);
+}
+
+// Frees a shard's memory; segment files stay on disk
+static void destroy_shard(struct Log_shard* shard) {
+    struct Log_table* table = atomic_load(&shard->table);
+    unsigned long last = atomic_load(&shard->last);
+    for (unsigned long i = atomic_load(&shard->first); i <= last; i++) {
+        free_chunk(atomic_load(&table->slots[i % table->nslots]));
+    }
+    free(table);
+    free_chunk(shard->spare);
+    free(shard);
+}
+
+// Destroys and frees the log, flushing a persistent log to disk first
 void destroy_log(server_log log) {
     if (!log) return;
-    struct Log_entry* current = log->head;
-    while(current) {
-        struct Log_entry* next = current->next;
-        free(current->data); // Free the data string
-        free(current); // Free the log entry
-        current = next;
-    }
-    pthread_mutex_destroy(&(log->mutex));
-    pthread_cond_destroy(&log->read_allowed);
-    pthread_cond_destroy(&log->write_allowed);
+    if (log->config.dir) {
+        pthread_mutex_lock(&log->sync_mutex);
+        log->sync_stop = 1;
+        pthread_cond_signal(&log->sync_cond);
+        pthread_mutex_unlock(&log->sync_mutex);
+        pthread_join(log->flusher, NULL);
+        sync_segments(log);
+    }
+    struct Log_dir* dir = atomic_load(&log->dir);
+    for (int i = 0; i < dir->nshards; i++) {
+        destroy_shard(dir->shards[i]);
+    }
+    free(dir);
+    destroy_epoch_domain(log->epoch);
+    pthread_mutex_destroy(&log->register_mutex);
+    pthread_mutex_destroy(&log->sync_mutex);
+    pthread_cond_destroy(&log->sync_cond);
+    pthread_cond_destroy(&log->commit_cond);
+    if (log->notify_fd >= 0) close(log->notify_fd);
     free(log);
 }
 
-void reader_lock(server_log log) {
-    pthread_mutex_lock(&(log->mutex));
-    while (log->waiting_writers > 0 || log->writers > 0) {
-        pthread_cond_wait(&(log->read_allowed), &(log->mutex));
+long log_size(server_log log) {
+    if (!log) return 0;
+    long size = 0;
+    epoch_enter(log->epoch);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_acquire);
+    for (int i = 0; i < dir->nshards; i++) {
+        size += atomic_load_explicit(&dir->shards[i]->size, memory_order_relaxed);
     }
-    log->readers++;
-    pthread_mutex_unlock(&(log->mutex));
+    epoch_exit(log->epoch);
+    return size;
 }
 
-void reader_unlock(server_log log) {
-    pthread_mutex_lock(&(log->mutex));
-    log->readers--;
-    if (log->readers == 0) {
-        pthread_cond_signal(&(log->write_allowed));
+long log_count(server_log log) {
+    if (!log) return 0;
+    long count = 0;
+    epoch_enter(log->epoch);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_acquire);
+    for (int i = 0; i < dir->nshards; i++) {
+        count += atomic_load_explicit(&dir->shards[i]->count, memory_order_relaxed);
+    }
+    epoch_exit(log->epoch);
+    if (log->config.max_entries > 0 && count > log->config.max_entries) {
+        count = log->config.max_entries;
     }
-    pthread_mutex_unlock(&(log->mutex));
+    return count;
 }
 
-void writer_lock(server_log log) {
-    pthread_mutex_lock(&(log->mutex));
-    log->waiting_writers++;
-    while(log->readers + log->writers > 0) {
-        pthread_cond_wait(&(log->write_allowed), &(log->mutex));
+long log_dropped(server_log log) {
+    if (!log) return 0;
+    long dropped = 0, count = 0;
+    epoch_enter(log->epoch);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_acquire);
+    for (int i = 0; i < dir->nshards; i++) {
+        dropped += atomic_load_explicit(&dir->shards[i]->dropped, memory_order_relaxed);
+        count += atomic_load_explicit(&dir->shards[i]->count, memory_order_relaxed);
     }
-    log->waiting_writers--;
-    log->writers++;
-    pthread_mutex_unlock(&(log->mutex));
+    epoch_exit(log->epoch);
+    // Live entries beyond max_entries are hidden from readers, so count them too
+    if (log->config.max_entries > 0 && count > log->config.max_entries) {
+        dropped += count - log->config.max_entries;
+    }
+    return dropped;
 }
 
-void writer_unlock(server_log log) {
-    pthread_mutex_lock(&(log->mutex));
-    log->writers--;
-    if (log->writers == 0) {
-        pthread_cond_signal(&(log->write_allowed));
-        pthread_cond_broadcast(&(log->read_allowed));
+int log_has_retention(server_log log) {
+    return log && (log->config.max_entries > 0 || log->config.max_bytes > 0 || log->config.max_age > 0);
+}
+
+// Read position inside one shard while merging
+struct Log_cursor {
+    struct Log_table* table;
+    unsigned long index;     // Chunk being read
+    unsigned long last;      // Tail chunk at snapshot time
+    int last_committed;      // Bytes of `last` visible in the snapshot
+    struct Log_chunk* chunk;
+    int offset;
+    int limit;               // Readable bytes of `chunk`
+    unsigned long end;       // Entries from this seq on are not in the snapshot
+    const struct Log_query* filter;  // Only return matching stats (NULL = all)
+    int mark;                // Next mark of `chunk` to check against the filter
+    struct Log_record rec;   // Header of the record at `offset`
+};
+
+// Returns 1 if the query filters by anything but cursor and limit
+static int query_filters(const struct Log_query* query) {
+    return query->thread_id || query->from || query->to || query->classes;
+}
+
+// Returns 0 if no stat covered by sum can match the filter
+static int summary_match(struct Log_summary* sum, const struct Log_query* filter) {
+    unsigned long threads = atomic_load_explicit(&sum->threads, memory_order_relaxed);
+    if (!threads) return 0;
+    if (filter->thread_id && !(threads & (1UL << (filter->thread_id & 63)))) return 0;
+    if (filter->classes && !(atomic_load_explicit(&sum->classes, memory_order_relaxed) & filter->classes)) return 0;
+    if (filter->from && atomic_load_explicit(&sum->max_arrival, memory_order_relaxed) < filter->from) return 0;
+    if (filter->to && atomic_load_explicit(&sum->min_arrival, memory_order_relaxed) > filter->to) return 0;
+    return 1;
+}
+
+static int stat_match(const struct Log_stat* stat, const struct Log_query* filter) {
+    if (filter->thread_id && stat->thread_id != filter->thread_id) return 0;
+    if (filter->classes && !((1 << (stat->req_class & 31)) & filter->classes)) return 0;
+    if (filter->from && stat->arrival < filter->from) return 0;
+    if (filter->to && stat->arrival > filter->to) return 0;
+    return 1;
+}
+
+// Returns 1 if the cursor's chunk still holds chunk `index`, i.e. it was
+// not recycled before the bytes just read were copied
+static inline int cursor_valid(struct Log_cursor* cur) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&cur->chunk->index, memory_order_relaxed) == cur->index;
+}
+
+// Positions the cursor at the start of chunk `index`. Returns 0 if that
+// chunk has been evicted or is past its age limit.
+static int cursor_enter(server_log log, struct Log_cursor* cur, unsigned long index, long now) {
+    cur->index = index;
+    cur->offset = 0;
+    cur->limit = 0;
+    cur->mark = 0;
+    cur->chunk = table_slot(cur->table, index);
+    if (!cur->chunk || atomic_load_explicit(&cur->chunk->index, memory_order_acquire) != index) return 0;
+    if (log->config.max_age > 0 &&
+        atomic_load_explicit(&cur->chunk->newest, memory_order_relaxed) < now - log->config.max_age) {
+        return 0;
+    }
+    cur->limit = index == cur->last
+                 ? cur->last_committed
+                 : atomic_load_explicit(&cur->chunk->committed, memory_order_acquire);
+    if (cur->limit > cur->chunk->capacity) cur->limit = cur->chunk->capacity;
+    if (cur->filter && (!summary_match(&cur->chunk->sum, cur->filter) || !cursor_valid(cur))) {
+        cur->limit = 0;
+        return 0;
     }
-    pthread_mutex_unlock(&(log->mutex));
+    return 1;
 }
 
-// Returns dummy log content as string (stub)
+// Moves the cursor past strides of its chunk whose summary rules out the
+// filter. Reads are validated with the next record header.
+static void cursor_skip_strides(struct Log_cursor* cur) {
+    if (!cur->chunk || cur->limit == 0) return;
+    struct Log_chunk* chunk = cur->chunk;
+    int n = atomic_load_explicit(&chunk->nmarks, memory_order_acquire);
+    if (n > chunk->max_marks) n = chunk->max_marks;
+    while (cur->mark < n && chunk->marks[cur->mark].offset <= cur->offset) {
+        struct Log_mark* mark = &chunk->marks[cur->mark++];
+        if (mark->offset == cur->offset && !summary_match(&mark->sum, cur->filter)) {
+            cur->offset = cur->mark < n ? (int)chunk->marks[cur->mark].offset : cur->limit;
+        }
+    }
+}
+
+// Returns 1 if the stat at the cursor matches its filter
+static int cursor_match(struct Log_cursor* cur) {
+    struct Log_stat stat;
+    if (cur->rec.kind != LOG_KIND_STAT || cur->rec.len != sizeof(stat)) return 0;
+    memcpy(&stat, cur->chunk->data + cur->offset + sizeof(struct Log_record), sizeof(stat));
+    return stat_match(&stat, cur->filter);
+}
+
+// Loads the header at the cursor, moving to the next chunk if needed and
+// past entries the filter rules out. Returns 0 once the shard's snapshot is
+// exhausted.
+static int cursor_peek(server_log log, struct Log_cursor* cur, long now) {
+    while (1) {
+        if (cur->filter) cursor_skip_strides(cur);
+        if (cur->offset + (int)sizeof(struct Log_record) <= cur->limit) {
+            memcpy(&cur->rec, cur->chunk->data + cur->offset, sizeof(struct Log_record));
+            int size = LOG_ALIGN(sizeof(struct Log_record) + cur->rec.len);
+            if (cur->rec.len > 0 && cur->offset + size <= cur->limit) {
+                int match = !cur->filter || cursor_match(cur);
+                if (cursor_valid(cur)) {
+                    // Seqs only grow within a shard
+                    if (cur->rec.seq >= cur->end) return 0;
+                    if (match) return 1;
+                    cur->offset += size;
+                    continue;
+                }
+            }
+            // Recycled under us: the rest of this chunk was evicted
+            cur->limit = 0;
+        }
+        do {
+            if (cur->index >= cur->last) return 0;
+        } while (!cursor_enter(log, cur, cur->index + 1, now));
+    }
+}
+
+// Returns the seq of the first entry in chunk `index` of the cursor's
+// shard: 0 if the chunk is gone (only older chunks are evicted before it)
+// and ULONG_MAX if it has no entries yet
+static unsigned long chunk_first_seq(struct Log_cursor* cur, unsigned long index) {
+    struct Log_chunk* chunk = table_slot(cur->table, index);
+    if (!chunk) return 0;
+    int nmarks = atomic_load_explicit(&chunk->nmarks, memory_order_acquire);
+    unsigned long seq = chunk->marks[0].seq;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&chunk->index, memory_order_relaxed) != index) return 0;
+    return nmarks > 0 ? seq : ULONG_MAX;
+}
+
+// Positions a fresh cursor at the shard's first entry with seq >= target,
+// using the chunks' sparse indexes (O(log n))
+static void cursor_seek(server_log log, struct Log_cursor* cur, unsigned long first,
+                        unsigned long target, long now) {
+    // Last chunk starting at or before target
+    unsigned long lo = first, hi = cur->last;
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo + 1) / 2;
+        if (chunk_first_seq(cur, mid) <= target) lo = mid;
+        else hi = mid - 1;
+    }
+    if (cursor_enter(log, cur, lo, now)) {
+        // Last mark in the snapshot at or before target
+        struct Log_chunk* chunk = cur->chunk;
+        int n = atomic_load_explicit(&chunk->nmarks, memory_order_acquire);
+        int mlo = 0, mhi = n - 1;
+        while (mlo < mhi) {
+            int mid = mlo + (mhi - mlo + 1) / 2;
+            if (chunk->marks[mid].seq <= target && chunk->marks[mid].offset < cur->limit) mlo = mid;
+            else mhi = mid - 1;
+        }
+        long offset = n > 0 ? chunk->marks[mlo].offset : 0;
+        if (cursor_valid(cur)) {
+            cur->offset = (int)offset;
+            cur->mark = mlo;
+        } else {
+            cur->limit = 0;
+        }
+    }
+    // At most a stride of records left to skip
+    while (cursor_peek(log, cur, now) && cur->rec.seq < target) {
+        cur->offset += LOG_ALIGN(sizeof(struct Log_record) + cur->rec.len);
+    }
+}
+
+// Returns a seq below which every entry is either published or evicted.
+// Entries are published out of seq order across shards, so the newest
+// entries of one shard can overtake an append still in progress on another;
+// such a shard holds the watermark at its last published entry.
+// `next` must be loaded from next_seq before dir, so that any shard missing
+// from dir only takes seqs from `next` on.
+static unsigned long log_watermark(struct Log_dir* dir, unsigned long next) {
+    unsigned long end = next;
+    for (int i = 0; i < dir->nshards; i++) {
+        if (atomic_load(&dir->shards[i]->busy)) {
+            unsigned long published = atomic_load_explicit(&dir->shards[i]->published, memory_order_acquire);
+            if (published < end) end = published;
+        }
+    }
+    return end;
+}
+
+// A reader's view of the log: every entry below a watermark, from a start
+// seq on. The epoch stays pinned until the snapshot is released, so nothing
+// it references is reclaimed while it is being copied; appends past the
+// snapshot point continue concurrently.
+struct Log_snapshot {
+    int nshards;
+    long bound;                   // Committed bytes it covers (headers included)
+    long now;
+    unsigned long end;            // Watermark: holds every entry below it
+    struct Log_cursor cursors[];
+};
+
+static struct Log_snapshot* snapshot_take(server_log log, unsigned long start) {
+    epoch_enter(log->epoch);
+    unsigned long next = atomic_load(&log->next_seq);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_acquire);
+    struct Log_snapshot* snap = (struct Log_snapshot*)malloc(sizeof(struct Log_snapshot) +
+                                                             dir->nshards * sizeof(struct Log_cursor));
+    if (!snap) {
+        epoch_exit(log->epoch);
+        return NULL;
+    }
+    snap->nshards = dir->nshards;
+    snap->bound = 0;
+    snap->now = monotonic_coarse_sec();
+    // Before the shards' publication points, so they cover every entry below it
+    snap->end = log_watermark(dir, next);
+    for (int i = 0; i < dir->nshards; i++) {
+        struct Log_shard* shard = dir->shards[i];
+        struct Log_cursor* cur = &snap->cursors[i];
+        // `last` before `table`: a table that maps `last` is published first
+        unsigned long first = atomic_load_explicit(&shard->first, memory_order_acquire);
+        cur->last = atomic_load_explicit(&shard->last, memory_order_acquire);
+        cur->table = atomic_load_explicit(&shard->table, memory_order_acquire);
+        cur->end = snap->end;
+        cur->filter = NULL;
+        struct Log_chunk* tail = table_slot(cur->table, cur->last);
+        cur->last_committed = atomic_load_explicit(&tail->committed, memory_order_acquire);
+        if (start > 0) {
+            cursor_seek(log, cur, first, start, snap->now);
+            continue;
+        }
+        for (unsigned long c = first; c < cur->last; c++) {
+            struct Log_chunk* chunk = table_slot(cur->table, c);
+            if (chunk) snap->bound += atomic_load_explicit(&chunk->committed, memory_order_acquire);
+        }
+        snap->bound += cur->last_committed;
+        cursor_enter(log, cur, first, snap->now);
+    }
+    return snap;
+}
+
+static void snapshot_release(server_log log, struct Log_snapshot* snap) {
+    free(snap);
+    epoch_exit(log->epoch);
+}
+
+// Counts the entries in the snapshot without consuming its cursors
+static long snapshot_count(server_log log, struct Log_snapshot* snap) {
+    long count = 0;
+    for (int i = 0; i < snap->nshards; i++) {
+        struct Log_cursor cur = snap->cursors[i];
+        while (cursor_peek(log, &cur, snap->now)) {
+            count++;
+            cur.offset += LOG_ALIGN(sizeof(struct Log_record) + cur.rec.len);
+        }
+    }
+    return count;
+}
+
+// Appends the entry at the cursor to out: the record itself if raw is set,
+// else its text. Returns 0 if it was evicted while being copied, -1 if out
+// cannot grow.
+static int copy_entry(struct Log_cursor* cur, struct Out_buf* out, int raw) {
+    const char* rec = cur->chunk->data + cur->offset;
+    long size = raw ? LOG_ALIGN(sizeof(struct Log_record) + cur->rec.len) : cur->rec.len;
+    if (!raw && cur->rec.kind == LOG_KIND_STAT) {
+        struct Log_stat stat;
+        if (cur->rec.len != sizeof(stat)) return 1;
+        memcpy(&stat, rec + sizeof(struct Log_record), sizeof(stat));
+        if (!cursor_valid(cur)) return 0;
+        if (out_reserve(out, LOG_STAT_TEXT_MAX) < 0) return -1;
+        out->len += log_format_stat(out->buf + out->len, &stat);
+        return 1;
+    }
+    if (out_reserve(out, size) < 0) return -1;
+    memcpy(out->buf + out->len, raw ? rec : rec + sizeof(struct Log_record), size);
+    if (!cursor_valid(cur)) return 0;
+    out->len += size;
+    return 1;
+}
+
+// Appends the snapshot's entries that the query selects to out in sequence
+// order (k-way merge, k being the number of writer threads), leaving out the
+// oldest `skip` entries and any evicted while copying. Returns the number
+// copied (the last one's seq in *last_seq), or -1 if out cannot grow.
+// Consumes the cursors.
+static long snapshot_copy(server_log log, struct Log_snapshot* snap, struct Out_buf* out, long skip,
+                          const struct Log_query* query, unsigned long* last_seq) {
+    struct Log_cursor* cursors = snap->cursors;
+    int active = 0, filtering = 0;
+    long copied_count = 0;
+    for (int i = 0; i < snap->nshards; i++) {
+        if (cursor_peek(log, &cursors[i], snap->now)) cursors[active++] = cursors[i];
+    }
+    while (active > 0) {
+        if (skip == 0 && !filtering && query_filters(query)) {
+            // The skipped entries were counted unfiltered; filter the rest
+            filtering = 1;
+            int kept = 0;
+            for (int i = 0; i < active; i++) {
+                cursors[i].filter = query;
+                if (cursor_peek(log, &cursors[i], snap->now)) cursors[kept++] = cursors[i];
+            }
+            active = kept;
+            continue;
+        }
+        int min = 0;
+        for (int i = 1; i < active; i++) {
+            if (cursors[i].rec.seq < cursors[min].rec.seq) min = i;
+        }
+        struct Log_cursor* cur = &cursors[min];
+        int copied = 1;
+        if (skip > 0) {
+            skip--;
+        } else {
+            if (query->limit > 0 && copied_count >= query->limit) break;
+            copied = copy_entry(cur, out, query->raw);
+            if (copied < 0) return -1;
+            if (copied) {
+                copied_count++;
+                *last_seq = cur->rec.seq;
+            }
+        }
+        if (copied) {
+            cur->offset += LOG_ALIGN(sizeof(struct Log_record) + cur->rec.len);
+        } else {
+            cur->limit = 0;
+        }
+        if (!cursor_peek(log, cur, snap->now)) cursors[min] = cursors[--active];
+    }
+    return copied_count;
+}
+
+// Returns the cursor that reads only entries added from now on
+unsigned long log_next_cursor(server_log log) {
+    if (!log) return 0;
+    epoch_enter(log->epoch);
+    unsigned long next = atomic_load(&log->next_seq);
+    struct Log_dir* dir = atomic_load_explicit(&log->dir, memory_order_acquire);
+    unsigned long end = log_watermark(dir, next);
+    epoch_exit(log->epoch);
+    return end;
+}
+
+int log_notify_fd(server_log log) {
+    pthread_mutex_lock(&log->register_mutex);
+    if (log->notify_fd < 0) {
+        log->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (log->notify_fd < 0) perror("eventfd");
+    }
+    pthread_mutex_unlock(&log->register_mutex);
+    return log->notify_fd;
+}
+
+void log_arm_notify(server_log log) {
+    if (log->notify_fd >= 0) atomic_store(&log->notify_armed, 1);
+}
+
+// Reads the entries a query selects
+int query_log(server_log log, const struct Log_query* query, char** dst, unsigned long* next) {
+    *dst = NULL;
+    if (next) *next = query->cursor;
+    if (!log) return 0;
+    struct Log_snapshot* snap = snapshot_take(log, query->cursor);
+    if (!snap) {
+        perror("Malloc failed");
+        return 0;
+    }
+    struct Out_buf out;
+    // Eviction works a chunk at a time; trim to the exact entry limit here
+    long skip = 0;
+    if (log->config.max_entries > 0) {
+        skip = snapshot_count(log, snap) - log->config.max_entries;
+    }
+    // A read of everything from the cursor on is sized up front from the
+    // bytes the snapshot covers; a limited or filtered one may return a few
+    // entries of a large log, so it grows as it goes
+    long reserve = query->limit > 0 || query_filters(query) ? 0 : snap->bound;
+    // Check malloc (out_buf reports it)
+    unsigned long last_seq = 0;
+    long copied = -1;
+    if (out_init(&out) < 0 || out_reserve(&out, reserve) < 0 ||
+        (copied = snapshot_copy(log, snap, &out, skip, query, &last_seq)) < 0) {
+        out.len = 0;
+    } else if (next && query->limit > 0 && copied >= query->limit) {
+        // Stopped early: continue right after the last entry returned
+        *next = last_seq + 1;
+    } else if (next && snap->end > query->cursor) {
+        *next = snap->end;
+    }
+    snapshot_release(log, snap);
+
+    if (out.len == 0) {
+        free(out.buf);
+        return 0;
+    }
+    out.buf[out.len] = '\0';
+    *dst = out.buf;
+    return (int)out.len;
+}
+
+// Returns the log contents as a string (null-terminated)
 int get_log(server_log log, char** dst) {
-    if (!log || log->size == 0) return 0;
-    int len = 0;
-    reader_lock(log);
-    struct Log_entry* current = log->head;
-    for(int i = 0; i < log->size; i++) {
-        len += current->data_len;
-        current = current->next;
-    }
-    char* buf = (char*)malloc(len);
-    // Check malloc
-    if(!buf) {
+    struct Log_query query = {0, 0};
+    return query_log(log, &query, dst, NULL);
+}
+
+// Returns the log's records unrendered
+int get_log_raw(server_log log, char** dst) {
+    struct Log_query query = {0, 1};
+    return query_log(log, &query, dst, NULL);
+}
+
+int log_format_stat(char* buf, const struct Log_stat* stat) {
+    return snprintf(buf, LOG_STAT_TEXT_MAX,
+                    "Stat-Req-Arrival:: %ld.%06ld\r\n"
+                    "Stat-Req-Dispatch:: %ld.%06ld\r\n"
+                    "Stat-Thread-Id:: %d\r\n"
+                    "Stat-Thread-Count:: %d\r\n"
+                    "Stat-Thread-Static:: %d\r\n"
+                    "Stat-Thread-Dynamic:: %d\r\n"
+                    "Stat-Thread-Post:: %d\r\n\r\n",
+                    stat->arrival / 1000000, stat->arrival % 1000000,
+                    stat->dispatch / 1000000, stat->dispatch % 1000000,
+                    stat->thread_id, stat->total_req, stat->stat_req,
+                    stat->dynm_req, stat->post_req);
+}
+
+// Appends one record of the given kind to the calling thread's shard and
+// returns the seq after it (0 if the shard could not be created). With
+// sync_commit the caller then waits for it with commit_appends.
+static unsigned long append_record(server_log log, int kind, const char* data, int data_len) {
+    struct Log_shard* shard = get_local_shard(log);
+    if (!shard) {
         perror("Malloc failed");
-        reader_unlock(log);
         return 0;
     }
-    current = log->head;
-    for (int i = 0; i < log->size; i++) {
-        strcat(buf, current->data);
-        current = current->next;
+
+    // Only this thread writes to the shard, so no lock is needed
+    long now = log->config.max_age > 0 ? monotonic_coarse_sec() : 0;
+    struct Log_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    struct Log_chunk* tail = table_slot(table, atomic_load_explicit(&shard->last, memory_order_relaxed));
+    int used = atomic_load_explicit(&tail->committed, memory_order_relaxed);
+
+    // Sequentially consistent, so a reader that sees this seq taken also sees busy
+    atomic_store(&shard->busy, 1);
+    unsigned long seq = atomic_fetch_add(&log->next_seq, 1);
+    int added = 0;
+    int need = LOG_ALIGN(sizeof(struct Log_record) + data_len);
+    // Chunks expire whole, by their newest entry: one that has taken entries
+    // for max_age is closed, or a steady trickle would keep its oldest ones
+    // alive until it filled up
+    int aged = log->config.max_age > 0 && used > 0 && tail->opened < now - log->config.max_age;
+    if (aged || tail->capacity - used < need) {
+        tail = advance_chunk(log, shard, tail, need, now);
+        used = 0;
+    }
+    // Check malloc; the seq is simply skipped if it was not written
+    if (tail) {
+        struct Log_record rec;
+        rec.seq = seq;
+        rec.len = (unsigned short)data_len;
+        rec.kind = (unsigned short)kind;
+        rec.crc = 0;
+        if (tail->seg.map) rec.crc = log_record_crc(&rec, data);
+        memcpy(tail->data + used, &rec, sizeof(rec));
+        memcpy(tail->data + used + sizeof(rec), data, data_len);
+        if (used == 0) tail->opened = now;
+        tail->count++;
+        tail->text += data_len;
+        chunk_mark(tail, &rec, data, used);
+        used += need;
+        added = 1;
+        atomic_store_explicit(&tail->newest, now, memory_order_relaxed);
+        atomic_store_explicit(&tail->committed, used, memory_order_release);
+    } else {
+        perror("Malloc failed");
+    }
+    // Counted before it is published, for the same reason as in evict_chunks
+    counter_add(&shard->size, added ? data_len : 0);
+    counter_add(&shard->count, added);
+    atomic_store_explicit(&shard->published, seq + 1, memory_order_release);
+    // Sequentially consistent so that it is ordered before the notify_armed
+    // check: a subscriber that arms and then finds this shard busy gets woken
+    atomic_store(&shard->busy, 0);
+    if (atomic_load(&log->notify_armed) && atomic_exchange(&log->notify_armed, 0)) {
+        uint64_t one = 1;
+        if (write(log->notify_fd, &one, sizeof(one)) < 0) perror("notify log subscriber");
+    }
+
+    if (log->config.sync_batch > 0 && (shard->unsynced += added) >= log->config.sync_batch) {
+        shard->unsynced = 0;
+        request_sync(log);
+    }
+    return seq + 1;
+}
+
+// With sync_commit, returns once every entry below end is on disk
+static void commit_appends(server_log log, unsigned long end) {
+    if (end && log->config.sync_commit && log->config.dir) {
+        log_commit(log, end);
     }
-    reader_unlock(log);
-    *dst = buf;
-    return len;
 }
 
-// Appends a new entry to the log (no-op stub)
+// Appends a new entry to the log
 void add_to_log(server_log log, const char* data, int data_len) {
-    if (!data || data_len <= 0 || !log) {
+    if (!data || data_len <= 0 || data_len > LOG_ENTRY_MAX || !log) {
         perror("invalid arguments");
         return;
     }
-    struct Log_entry* to_append = (struct Log_entry*)malloc(sizeof(struct Log_entry));
-    // Check malloc
-    if (!to_append) {
-        perror("Malloc failed");
+    commit_appends(log, append_record(log, LOG_KIND_TEXT, data, data_len));
+}
+
+// Appends n entries in order; with sync_commit they share one commit
+void add_to_log_batch(server_log log, const char* const* data, const int* data_len, int n) {
+    if (!data || !data_len || n <= 0 || !log) {
+        perror("invalid arguments");
         return;
     }
-    to_append->data = (char*)malloc(data_len);
-    memcpy(to_append->data, data, data_len);
-    to_append->data_len = data_len;
-    to_append->next = NULL;
+    for (int i = 0; i < n; i++) {
+        if (!data[i] || data_len[i] <= 0 || data_len[i] > LOG_ENTRY_MAX) {
+            perror("invalid arguments");
+            return;
+        }
+    }
+    unsigned long end = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned long added = append_record(log, LOG_KIND_TEXT, data[i], data_len[i]);
+        if (added > end) end = added;
+    }
+    commit_appends(log, end);
+}
 
-    writer_lock(log);
-    if(!log->tail) {
-        // Was empty
-        log->head = log->tail = to_append;
-    } else {
-        log->tail->next = to_append;
-        log->tail = to_append;
+void add_stat_to_log(server_log log, const struct Log_stat* stat) {
+    if (!stat || !log) {
+        perror("invalid arguments");
+        return;
     }
-    log->size++;
-    writer_unlock(log);
+    commit_appends(log, append_record(log, LOG_KIND_STAT, (const char*)stat, sizeof(*stat)));
 }
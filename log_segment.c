@@ -0,0 +1,238 @@
+#include <dirent.h>
+#include "log_segment.h"
+
+#define SEGMENT_MAGIC "OSHW3LOG"
+#define SEGMENT_VERSION 3
+
+// First bytes of every segment file; records start right after it
+struct Log_segment_header {
+    char magic[8];
+    unsigned int version;
+    int shard;
+    unsigned long index;
+    unsigned int capacity;  // Bytes of the record area the file was created with
+    char reserved[36];
+};
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static unsigned int crc_update(unsigned int crc, const char* buf, size_t len) {
+    const unsigned char* p = (const unsigned char*)buf;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+unsigned int log_record_crc(const struct Log_record* rec, const char* text) {
+    pthread_once(&crc_once, crc_init);
+    struct Log_record header = *rec;
+    header.crc = 0;
+    unsigned int crc = crc_update(0xffffffffu, (const char*)&header, sizeof(header));
+    return ~crc_update(crc, text, rec->len);
+}
+
+static void segment_path(char* path, size_t len, const char* dir, int shard, unsigned long index) {
+    snprintf(path, len, "%s/shard-%d-%lu.seg", dir, shard, index);
+}
+
+static void spare_path(char* path, size_t len, const char* dir, int shard) {
+    snprintf(path, len, "%s/shard-%d.spare", dir, shard);
+}
+
+// Rewrites the header for `index` and marks the record area empty
+static char* segment_reset(struct Log_segment* seg, unsigned long index) {
+    struct Log_segment_header* header = (struct Log_segment_header*)seg->map;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = SEGMENT_VERSION;
+    header->shard = seg->shard;
+    header->index = index;
+    header->capacity = (unsigned int)(seg->map_len - sizeof(*header));
+    seg->index = index;
+    seg->spare = 0;
+    char* data = seg->map + sizeof(struct Log_segment_header);
+    memset(data, 0, sizeof(struct Log_record));
+    return data;
+}
+
+char* segment_create(const char* dir, int shard, unsigned long index, int capacity, struct Log_segment* seg) {
+    char path[MAXLINE];
+    segment_path(path, sizeof(path), dir, shard, index);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open segment");
+        return NULL;
+    }
+    size_t len = sizeof(struct Log_segment_header) + capacity;
+    // Allocate every block now: a store into a hole of a sparse file raises
+    // SIGBUS once the disk is full
+    int err = posix_fallocate(fd, 0, len);
+    if (err) {
+        errno = err;
+        perror("fallocate segment");
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap segment");
+        unlink(path);
+        return NULL;
+    }
+    seg->map = (char*)map;
+    seg->map_len = len;
+    seg->shard = shard;
+    return segment_reset(seg, index);
+}
+
+char* segment_reuse(const char* dir, struct Log_segment* seg, unsigned long index) {
+    char from[MAXLINE], to[MAXLINE];
+    spare_path(from, sizeof(from), dir, seg->shard);
+    segment_path(to, sizeof(to), dir, seg->shard, index);
+    if (rename(from, to) < 0) {
+        // Still usable in memory; recovery will discard it
+        perror("rename segment");
+    }
+    return segment_reset(seg, index);
+}
+
+void segment_evict(const char* dir, struct Log_segment* seg, int remove) {
+    char path[MAXLINE], spare[MAXLINE];
+    segment_path(path, sizeof(path), dir, seg->shard, seg->index);
+    spare_path(spare, sizeof(spare), dir, seg->shard);
+    if (remove) {
+        unlink(seg->spare ? spare : path);
+        return;
+    }
+    if (rename(path, spare) < 0) {
+        perror("rename segment");
+        return;
+    }
+    seg->spare = 1;
+}
+
+void segment_sync(struct Log_segment* seg, int from, int to) {
+    if (!seg->map || to <= from) return;
+    // msync needs a page-aligned start
+    long page = sysconf(_SC_PAGESIZE);
+    size_t start = (sizeof(struct Log_segment_header) + from) & ~(page - 1);
+    size_t end = sizeof(struct Log_segment_header) + to;
+    if (msync(seg->map + start, end - start, MS_SYNC) < 0) {
+        perror("msync segment");
+    }
+}
+
+void segment_close(struct Log_segment* seg) {
+    if (!seg->map) return;
+    munmap(seg->map, seg->map_len);
+    seg->map = NULL;
+}
+
+// Maps one segment file and finds its last valid record
+static int segment_scan(const char* path, int shard, unsigned long index,
+                        struct Log_segment* seg, struct Log_segment_info* info) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return -1;
+    // Check the header before mapping: the file may be cut short by a crash
+    // but never longer than it was created
+    struct stat sbuf;
+    struct Log_segment_header header;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size <= (off_t)sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SEGMENT_VERSION || header.shard != shard || header.index != index ||
+        sbuf.st_size > (off_t)(sizeof(header) + header.capacity)) {
+        close(fd);
+        return -1;
+    }
+    // The recovered tail takes appends, so back any holes as segment_create does
+    int err = posix_fallocate(fd, 0, sbuf.st_size);
+    if (err) {
+        errno = err;
+        perror("fallocate segment");
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    seg->map = (char*)map;
+    seg->map_len = sbuf.st_size;
+    seg->shard = shard;
+    seg->index = index;
+    seg->spare = 0;
+
+    memset(info, 0, sizeof(*info));
+    info->data = seg->map + sizeof(struct Log_segment_header);
+    info->capacity = (int)(sbuf.st_size - sizeof(struct Log_segment_header));
+    // Records end at the first torn, corrupt or stale (non-increasing seq) one
+    unsigned long prev = 0;
+    while (info->committed + (int)sizeof(struct Log_record) <= info->capacity) {
+        struct Log_record rec;
+        memcpy(&rec, info->data + info->committed, sizeof(rec));
+        int size = LOG_ALIGN(sizeof(struct Log_record) + rec.len);
+        if (rec.len == 0 || info->committed + size > info->capacity) break;
+        if (info->count > 0 && rec.seq <= prev) break;
+        if (log_record_crc(&rec, info->data + info->committed + sizeof(rec)) != rec.crc) break;
+        prev = rec.seq;
+        info->max_seq = rec.seq;
+        info->committed += size;
+        info->count++;
+        info->text += rec.len;
+    }
+    return 0;
+}
+
+int segment_recover(const char* dir,
+                    void (*found)(void* ctx, struct Log_segment* seg, const struct Log_segment_info* info),
+                    void* ctx) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir log dir");
+        return -1;
+    }
+    DIR* d = opendir(dir);
+    if (!d) {
+        perror("opendir log dir");
+        return -1;
+    }
+    struct dirent* entry;
+    char path[MAXLINE];
+    while ((entry = readdir(d)) != NULL) {
+        int shard, end = 0;
+        unsigned long index;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (sscanf(entry->d_name, "shard-%d.spare%n", &shard, &end) == 1 && entry->d_name[end] == '\0') {
+            // Holds only evicted entries
+            unlink(path);
+            continue;
+        }
+        end = 0;
+        if (sscanf(entry->d_name, "shard-%d-%lu.seg%n", &shard, &index, &end) != 2 ||
+            entry->d_name[end] != '\0') {
+            continue;
+        }
+        struct Log_segment seg;
+        struct Log_segment_info info;
+        if (segment_scan(path, shard, index, &seg, &info) < 0) {
+            fprintf(stderr, "log: skipping unreadable segment %s\n", path);
+            continue;
+        }
+        found(ctx, &seg, &info);
+    }
+    closedir(d);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef LOG_SEGMENT_H
+#define LOG_SEGMENT_H
+#include "segel.h"
+
+// On-disk storage for a persistent server log.
+// Each chunk of a shard lives in its own memory-mapped segment file,
+// <dir>/shard-<shard>-<index>.seg: a fixed header followed by the same
+// length-prefixed records the in-memory log uses, each with a CRC32.
+
+// Records are 8-byte aligned inside a chunk
+#define LOG_ALIGN(n) (((n) + 7) & ~7)
+
+// Every entry is framed by this header, in memory and on disk. seq is taken
+// from a log-wide counter so readers can merge shards back into arrival order.
+struct Log_record {
+    unsigned long seq;
+    unsigned int crc;     // CRC32 of header (crc = 0) and payload; 0 when not persisted
+    unsigned short len;   // Bytes of payload following the header
+    unsigned short kind;  // LOG_KIND_*
+};
+
+// Record payloads
+#define LOG_KIND_TEXT 0   // Entry text as passed to add_to_log
+#define LOG_KIND_STAT 1   // A struct Log_stat, rendered to text on read
+
+// A mapped segment file. map is NULL for chunks that live only in memory.
+struct Log_segment {
+    char* map;          // Start of the mapping (the on-disk header)
+    size_t map_len;
+    int shard;
+    unsigned long index;
+    int spare;          // The file was moved aside by segment_evict
+};
+
+// What recovery found in a segment
+struct Log_segment_info {
+    char* data;          // First record
+    int capacity;        // Bytes available for records
+    int committed;       // Bytes of valid records
+    int count;           // Number of valid records
+    long text;           // Bytes of entry text in the valid records
+    unsigned long max_seq;
+};
+
+// Computes the CRC stored in rec->crc
+unsigned int log_record_crc(const struct Log_record* rec, const char* text);
+
+// Creates and maps a new segment with room for `capacity` bytes of records,
+// allocating its blocks up front. Returns the start of the record area, or
+// NULL on failure (e.g. no space left), leaving no file behind.
+char* segment_create(const char* dir, int shard, unsigned long index, int capacity, struct Log_segment* seg);
+
+// Turns the shard's spare segment (see segment_evict) into an empty segment
+// `index`, keeping its mapping. Returns the record area.
+char* segment_reuse(const char* dir, struct Log_segment* seg, unsigned long index);
+
+// Moves an evicted segment's file aside as the shard's spare (its mapping
+// stays valid) or, if remove is set, deletes the file
+void segment_evict(const char* dir, struct Log_segment* seg, int remove);
+
+// Flushes bytes [from, to) of the record area to disk
+void segment_sync(struct Log_segment* seg, int from, int to);
+
+// Unmaps a segment (the file is kept)
+void segment_close(struct Log_segment* seg);
+
+// Maps every segment in dir and scans it for the last valid record.
+// `found` is called once per segment, in no particular order.
+// Returns -1 if the directory cannot be created or read.
+int segment_recover(const char* dir,
+                    void (*found)(void* ctx, struct Log_segment* seg, const struct Log_segment_info* info),
+                    void* ctx);
+
+#endif // LOG_SEGMENT_H
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "log_stream.h"
+
+#define STREAM_MAX_EVENTS 64
+
+// One subscribed connection
+struct Log_subscriber {
+    int fd;
+    struct Log_query query;   // query.cursor advances as entries are sent
+    char* pending;            // Output the socket has not accepted yet
+    long pending_len, pending_off;
+    int read_closed;          // The peer shut down its side; it may still read
+    struct Log_subscriber* next;
+};
+
+struct Log_stream {
+    server_log log;
+    int epfd;
+    int notify_fd;                   // The log's notify eventfd
+    int control_fd;                  // Wakes the thread for new subscribers / stop
+    pthread_t thread;
+    pthread_mutex_t mutex;           // Guards incoming and stop
+    struct Log_subscriber* incoming; // Added by workers, not yet registered
+    int stop;
+    struct Log_subscriber* subscribers;  // Stream thread only
+};
+
+static void subscriber_free(struct Log_subscriber* sub) {
+    close(sub->fd);
+    free(sub->pending);
+    free(sub);
+}
+
+// Sends as much pending output as the socket takes. Returns -1 if the
+// connection is gone.
+static int subscriber_flush(struct Log_subscriber* sub) {
+    while (sub->pending_off < sub->pending_len) {
+        ssize_t n = send(sub->fd, sub->pending + sub->pending_off,
+                         sub->pending_len - sub->pending_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        sub->pending_off += n;
+    }
+    free(sub->pending);
+    sub->pending = NULL;
+    sub->pending_len = sub->pending_off = 0;
+    return 0;
+}
+
+// Queues the entries past the subscriber's cursor as one HTTP chunk and
+// starts sending it. Returns -1 if the connection is gone.
+static int subscriber_poll(log_stream stream, struct Log_subscriber* sub) {
+    if (sub->pending) return 0;  // Still sending the previous chunk
+    char* body = NULL;
+    unsigned long next;
+    int len = query_log(stream->log, &sub->query, &body, &next);
+    sub->query.cursor = next;
+    if (len == 0) return 0;
+
+    char size[32];
+    int size_len = sprintf(size, "%x\r\n", len);
+    sub->pending = (char*)malloc(size_len + len + 2);
+    if (!sub->pending) {
+        perror("Malloc failed");
+        free(body);
+        return -1;
+    }
+    memcpy(sub->pending, size, size_len);
+    memcpy(sub->pending + size_len, body, len);
+    memcpy(sub->pending + size_len + len, "\r\n", 2);
+    sub->pending_len = size_len + len + 2;
+    sub->pending_off = 0;
+    free(body);
+    return subscriber_flush(sub);
+}
+
+// Ends a subscriber's response at shutdown: sends what is left of the log
+// and the zero-length last chunk, so the client can tell a clean end from a
+// cut connection. If the socket will not take it all now, the response is
+// left truncated rather than blocking.
+static void subscriber_end(log_stream stream, struct Log_subscriber* sub) {
+    static const char last_chunk[] = "0\r\n\r\n";
+    if (subscriber_poll(stream, sub) < 0 || sub->pending) return;
+    // Best effort: if the peer is gone or not reading, it sees a truncation
+    send(sub->fd, last_chunk, sizeof(last_chunk) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// Watches for the peer's input until it shuts down its side and, while
+// output is pending, for room to send. EPOLLHUP and EPOLLERR are always
+// reported.
+static void subscriber_watch(log_stream stream, struct Log_subscriber* sub, int op) {
+    struct epoll_event ev;
+    ev.events = (sub->read_closed ? 0 : EPOLLIN) | (sub->pending ? EPOLLOUT : 0);
+    ev.data.ptr = sub;
+    epoll_ctl(stream->epfd, op, sub->fd, &ev);
+}
+
+static void subscriber_remove(log_stream stream, struct Log_subscriber* sub) {
+    struct Log_subscriber** link = &stream->subscribers;
+    while (*link != sub) link = &(*link)->next;
+    *link = sub->next;
+    epoll_ctl(stream->epfd, EPOLL_CTL_DEL, sub->fd, NULL);
+    subscriber_free(sub);
+}
+
+// Handles an event on a subscriber's socket. Returns -1 if it is gone.
+// EOF is only a half-close (clients such as nc and curl shut down their
+// side once the request is sent): the subscriber is dropped when a send
+// fails or the connection is closed both ways.
+static int subscriber_event(log_stream stream, struct Log_subscriber* sub, unsigned int events) {
+    if (events & (EPOLLERR | EPOLLHUP)) return -1;
+    if (events & EPOLLIN) {
+        // Subscribers have nothing more to say
+        char buf[256];
+        ssize_t n = recv(sub->fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) return -1;
+        if (n == 0) {
+            sub->read_closed = 1;
+            subscriber_watch(stream, sub, EPOLL_CTL_MOD);
+        }
+    }
+    if (events & EPOLLOUT) return subscriber_flush(sub);
+    return 0;
+}
+
+static void* stream_thread(void* arg) {
+    log_stream stream = (log_stream)arg;
+    struct epoll_event events[STREAM_MAX_EVENTS];
+    while (1) {
+        pthread_mutex_lock(&stream->mutex);
+        int stop = stream->stop;
+        struct Log_subscriber* incoming = stream->incoming;
+        stream->incoming = NULL;
+        pthread_mutex_unlock(&stream->mutex);
+        if (stop) break;
+        while (incoming) {
+            struct Log_subscriber* sub = incoming;
+            incoming = sub->next;
+            sub->next = stream->subscribers;
+            stream->subscribers = sub;
+            subscriber_watch(stream, sub, EPOLL_CTL_ADD);
+        }
+
+        // Arm before reading, so entries added after a subscriber's read wake us
+        log_arm_notify(stream->log);
+        struct Log_subscriber* sub = stream->subscribers;
+        while (sub) {
+            struct Log_subscriber* next = sub->next;
+            int had_pending = sub->pending != NULL;
+            if (subscriber_poll(stream, sub) < 0) {
+                subscriber_remove(stream, sub);
+            } else if (!had_pending && sub->pending) {
+                subscriber_watch(stream, sub, EPOLL_CTL_MOD);
+            }
+            sub = next;
+        }
+
+        int n = epoll_wait(stream->epfd, events, STREAM_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &stream->notify_fd || events[i].data.ptr == &stream->control_fd) {
+                uint64_t count;
+                if (read(*(int*)events[i].data.ptr, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("read eventfd");
+                }
+                continue;
+            }
+            struct Log_subscriber* ev_sub = (struct Log_subscriber*)events[i].data.ptr;
+            int had_pending = ev_sub->pending != NULL;
+            if (subscriber_event(stream, ev_sub, events[i].events) < 0) {
+                subscriber_remove(stream, ev_sub);
+            } else if (had_pending && !ev_sub->pending) {
+                subscriber_watch(stream, ev_sub, EPOLL_CTL_MOD);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Registers an eventfd with the stream's epoll, tagged with its own address
+static int watch_eventfd(log_stream stream, int* fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = fd;
+    return epoll_ctl(stream->epfd, EPOLL_CTL_ADD, *fd, &ev);
+}
+
+log_stream create_log_stream(server_log log) {
+    log_stream stream = (log_stream)malloc(sizeof(struct Log_stream));
+    if (!stream) return NULL;
+    stream->log = log;
+    stream->incoming = NULL;
+    stream->subscribers = NULL;
+    stream->stop = 0;
+    stream->notify_fd = log_notify_fd(log);
+    stream->control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stream->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (stream->notify_fd < 0 || stream->control_fd < 0 || stream->epfd < 0 ||
+        watch_eventfd(stream, &stream->notify_fd) < 0 || watch_eventfd(stream, &stream->control_fd) < 0) {
+        perror("create log stream");
+        if (stream->control_fd >= 0) close(stream->control_fd);
+        if (stream->epfd >= 0) close(stream->epfd);
+        free(stream);
+        return NULL;
+    }
+    pthread_mutex_init(&stream->mutex, NULL);
+    if (pthread_create(&stream->thread, NULL, stream_thread, stream) != 0) {
+        perror("Failed to create thread");
+        close(stream->control_fd);
+        close(stream->epfd);
+        pthread_mutex_destroy(&stream->mutex);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static void stream_wake(log_stream stream) {
+    uint64_t one = 1;
+    if (write(stream->control_fd, &one, sizeof(one)) < 0) perror("wake log stream");
+}
+
+void log_stream_shutdown(log_stream stream) {
+    if (!stream) return;
+    pthread_mutex_lock(&stream->mutex);
+    int stopped = stream->stop;
+    stream->stop = 1;
+    pthread_mutex_unlock(&stream->mutex);
+    if (stopped) return;
+    stream_wake(stream);
+    pthread_join(stream->thread, NULL);
+    while (stream->subscribers) {
+        struct Log_subscriber* sub = stream->subscribers;
+        stream->subscribers = sub->next;
+        subscriber_end(stream, sub);
+        subscriber_free(sub);
+    }
+    // Connections handed over from now on are ended in log_stream_add
+    pthread_mutex_lock(&stream->mutex);
+    struct Log_subscriber* incoming = stream->incoming;
+    stream->incoming = NULL;
+    pthread_mutex_unlock(&stream->mutex);
+    while (incoming) {
+        struct Log_subscriber* sub = incoming;
+        incoming = sub->next;
+        subscriber_end(stream, sub);
+        subscriber_free(sub);
+    }
+}
+
+void destroy_log_stream(log_stream stream) {
+    if (!stream) return;
+    log_stream_shutdown(stream);
+    close(stream->control_fd);
+    close(stream->epfd);
+    pthread_mutex_destroy(&stream->mutex);
+    free(stream);
+}
+
+int log_stream_add(log_stream stream, int fd, const struct Log_query* query) {
+    struct Log_subscriber* sub = (struct Log_subscriber*)malloc(sizeof(struct Log_subscriber));
+    if (!sub || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("log_stream_add");
+        free(sub);
+        close(fd);
+        return -1;
+    }
+    sub->fd = fd;
+    sub->query = *query;
+    sub->pending = NULL;
+    sub->pending_len = sub->pending_off = 0;
+    sub->read_closed = 0;
+    pthread_mutex_lock(&stream->mutex);
+    int stopped = stream->stop;
+    if (!stopped) {
+        sub->next = stream->incoming;
+        stream->incoming = sub;
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    if (stopped) {
+        // Shutting down: the subscriber gets what there is and the end
+        subscriber_end(stream, sub);
+        subscriber_free(sub);
+        return 0;
+    }
+    stream_wake(stream);
+    return 0;
+}
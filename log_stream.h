@@ -0,0 +1,31 @@
+#ifndef LOG_STREAM_H
+#define LOG_STREAM_H
+#include "log.h"
+
+// Streams new log entries to subscribed connections.
+// One thread serves every subscriber: it waits on the log's notify eventfd
+// and the subscribers' sockets with epoll, and sends each subscriber the
+// entries past its cursor as HTTP chunks. Subscribers cost no worker thread.
+
+typedef struct Log_stream* log_stream;
+
+// Creates the stream for a log and starts its thread
+log_stream create_log_stream(server_log log);
+
+// Stops the thread and ends every subscriber's response: it gets the
+// entries it has not seen yet and the terminating zero-length chunk, unless
+// its socket is too backed up to take them without blocking. Connections
+// handed over afterwards are ended the same way at once. Safe to call while
+// workers still call log_stream_add, and more than once.
+void log_stream_shutdown(log_stream stream);
+
+// Shuts the stream down if it is not yet, and frees it
+void destroy_log_stream(log_stream stream);
+
+// Hands a connection to the stream. The response headers (with
+// Transfer-Encoding: chunked) must already be sent. Entries matching query
+// are streamed from query->cursor on. Takes ownership of fd.
+// Returns -1 (and closes fd) on failure.
+int log_stream_add(log_stream stream, int fd, const struct Log_query* query);
+
+#endif // LOG_STREAM_H
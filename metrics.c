@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+#include "out_buf.h"
+
+// One worker's histograms, on cache lines of their own
+struct Worker_metrics {
+    struct Histogram hist[METRIC_PHASES][METRIC_CLASSES];
+} __attribute__((aligned(64)));
+
+struct Server_metrics {
+    int workers;
+    threads_stats stats;              // The workers' counters
+    _Atomic long shed[METRIC_SHED_KINDS];
+    limiter limiter;                  // Concurrency limit, or NULL for none
+    // Indexed by worker id - 1; NULL until the worker calls metrics_thread_init
+    struct Worker_metrics* _Atomic worker[];
+};
+
+static const char* phase_names[METRIC_PHASES] = {
+    "server_queue_seconds",
+    "server_first_byte_seconds",
+    "server_service_seconds",
+};
+
+static const char* phase_help[METRIC_PHASES] = {
+    "Time from a request's arrival to its dispatch to a worker.",
+    "Time from dispatch to the first byte of the response.",
+    "Time from dispatch to the end of the response.",
+};
+
+static const char* class_names[METRIC_CLASSES] = {"static", "dynamic", "post", "error"};
+
+// The le bounds of every series, in microseconds (see metrics.h)
+static const long ladder[] = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000,
+};
+
+server_metrics create_metrics(threads_stats stats, int workers) {
+    server_metrics metrics = (server_metrics)malloc(sizeof(struct Server_metrics) +
+                                                    workers * sizeof(struct Worker_metrics*));
+    if (!metrics) return NULL;
+    metrics->workers = workers;
+    metrics->stats = stats;
+    for (int k = 0; k < METRIC_SHED_KINDS; k++) atomic_init(&metrics->shed[k], 0);
+    metrics->limiter = NULL;
+    for (int i = 0; i < workers; i++) atomic_init(&metrics->worker[i], NULL);
+    return metrics;
+}
+
+int metrics_thread_init(server_metrics metrics, int worker) {
+    if (!metrics || worker < 1 || worker > metrics->workers) return -1;
+    struct Worker_metrics* mine = (struct Worker_metrics*)aligned_alloc(64, sizeof(struct Worker_metrics));
+    if (!mine) {
+        perror("Malloc failed");
+        return -1;
+    }
+    // Zeroing here faults the pages in on the worker's own NUMA node
+    memset(mine, 0, sizeof(struct Worker_metrics));
+    atomic_store_explicit(&metrics->worker[worker - 1], mine, memory_order_release);
+    return 0;
+}
+
+void destroy_metrics(server_metrics metrics) {
+    if (!metrics) return;
+    for (int i = 0; i < metrics->workers; i++) {
+        free(atomic_load(&metrics->worker[i]));
+    }
+    free(metrics);
+}
+
+void metrics_record(server_metrics metrics, int worker, int phase, int req_class, long usec) {
+    if (!metrics || worker < 1 || worker > metrics->workers) return;
+    struct Worker_metrics* mine = atomic_load_explicit(&metrics->worker[worker - 1], memory_order_relaxed);
+    if (mine) histogram_record(&mine->hist[phase][req_class], usec);
+}
+
+void metrics_count_shed(server_metrics metrics, int kind, long n) {
+    if (!metrics || kind < 0 || kind >= METRIC_SHED_KINDS) return;
+    atomic_fetch_add_explicit(&metrics->shed[kind], n, memory_order_relaxed);
+}
+
+void metrics_attach_limiter(server_metrics metrics, limiter limiter) {
+    metrics->limiter = limiter;
+}
+
+// Writes one phase/class series, with a bucket for every ladder bound
+static void render_series(struct Out_buf* out, const char* name, const char* class_name,
+                          const struct Histogram* hist) {
+    unsigned long cumulative = 0;
+    int b = 0;
+    for (int i = 0; i < (int)(sizeof(ladder) / sizeof(ladder[0])); i++) {
+        for (; b < HIST_BUCKETS && histogram_bucket_max(b) <= ladder[i]; b++) {
+            cumulative += atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+        }
+        out_printf(out, "%s_bucket{class=\"%s\",le=\"%g\"} %lu\n", name, class_name,
+                   ladder[i] / 1e6, cumulative);
+    }
+    for (; b < HIST_BUCKETS; b++) {
+        cumulative += atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+    }
+    out_printf(out, "%s_bucket{class=\"%s\",le=\"+Inf\"} %lu\n", name, class_name, cumulative);
+    out_printf(out, "%s_sum{class=\"%s\"} %.6f\n", name, class_name,
+               atomic_load_explicit(&hist->sum, memory_order_relaxed) / 1e6);
+    // Counted from the buckets so a scrape racing a recording stays consistent
+    out_printf(out, "%s_count{class=\"%s\"} %lu\n", name, class_name, cumulative);
+}
+
+int metrics_render(server_metrics metrics, char** dst) {
+    *dst = NULL;
+    struct Out_buf out;
+    out_init(&out);
+    struct Histogram* merged = (struct Histogram*)malloc(sizeof(struct Histogram));
+    if (!out.buf || !merged) {
+        perror("Malloc failed");
+        free(out.buf);
+        free(merged);
+        return 0;
+    }
+    for (int p = 0; p < METRIC_PHASES; p++) {
+        out_printf(&out, "# HELP %s %s\n", phase_names[p], phase_help[p]);
+        out_printf(&out, "# TYPE %s histogram\n", phase_names[p]);
+        for (int c = 0; c < METRIC_CLASSES; c++) {
+            memset(merged, 0, sizeof(*merged));
+            for (int w = 0; w < metrics->workers; w++) {
+                struct Worker_metrics* worker = atomic_load_explicit(&metrics->worker[w], memory_order_acquire);
+                if (worker) histogram_merge(merged, &worker->hist[p][c]);
+            }
+            render_series(&out, phase_names[p], class_names[c], merged);
+        }
+    }
+    free(merged);
+
+    out_printf(&out, "# HELP server_requests_total Requests handled by each worker.\n");
+    out_printf(&out, "# TYPE server_requests_total counter\n");
+    for (int w = 0; w < metrics->workers && metrics->stats; w++) {
+        struct Stats_snapshot counts;
+        stats_snapshot(&metrics->stats[w], &counts);
+        long other = counts.total_req - counts.stat_req - counts.dynm_req - counts.post_req;
+        out_printf(&out, "server_requests_total{worker=\"%d\",class=\"static\"} %ld\n", counts.id, counts.stat_req);
+        out_printf(&out, "server_requests_total{worker=\"%d\",class=\"dynamic\"} %ld\n", counts.id, counts.dynm_req);
+        out_printf(&out, "server_requests_total{worker=\"%d\",class=\"post\"} %ld\n", counts.id, counts.post_req);
+        out_printf(&out, "server_requests_total{worker=\"%d\",class=\"other\"} %ld\n", counts.id, other);
+    }
+    out_printf(&out, "# HELP server_shed_total Requests turned away because the queue was full.\n");
+    out_printf(&out, "# TYPE server_shed_total counter\n");
+    out_printf(&out, "server_shed_total{action=\"dropped\"} %ld\n",
+               atomic_load_explicit(&metrics->shed[METRIC_SHED_DROPPED], memory_order_relaxed));
+    out_printf(&out, "server_shed_total{action=\"rejected\"} %ld\n",
+               atomic_load_explicit(&metrics->shed[METRIC_SHED_REJECTED], memory_order_relaxed));
+    if (metrics->limiter) {
+        out_printf(&out, "# HELP server_concurrency_limit Requests the adaptive limiter lets be in flight.\n");
+        out_printf(&out, "# TYPE server_concurrency_limit gauge\n");
+        out_printf(&out, "server_concurrency_limit %d\n", limiter_limit(metrics->limiter));
+        out_printf(&out, "# HELP server_inflight_requests Requests queued or being served.\n");
+        out_printf(&out, "# TYPE server_inflight_requests gauge\n");
+        out_printf(&out, "server_inflight_requests %d\n", limiter_inflight(metrics->limiter));
+    }
+    if (!out.buf) return 0;
+    *dst = out.buf;
+    return out.len;
+}
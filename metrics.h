@@ -0,0 +1,62 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "histogram.h"
+#include "stats.h"
+#include "limiter.h"
+
+// Request latency metrics, served in Prometheus text format on GET /metrics.
+// Every worker records into its own histograms without locks; a scrape
+// merges all workers' histograms and is the only code that reads them.
+// Scrapes also report each worker's request counters from a consistent
+// snapshot (see stats.h).
+//
+// Every series has the same buckets on every scrape, empty or not, so that
+// rates and quantiles can be taken across scrapes and workers:
+//   le = 0.0001 0.00025 0.0005 0.001 0.0025 0.005 0.01 0.025 0.05
+//        0.1 0.25 0.5 1 2.5 5 10 +Inf (seconds)
+// Each bound counts the histogram buckets that end at or below it, so a
+// count may leave out values less than 1/8 below its bound (see
+// histogram.h); _sum and _count are exact.
+
+// Phases of a request
+#define METRIC_QUEUE      0  // Arrival to dispatch to a worker
+#define METRIC_FIRST_BYTE 1  // Dispatch to the first byte of the response
+#define METRIC_SERVICE    2  // Dispatch to the end of the response
+#define METRIC_PHASES     3
+
+// Request classes, as LOG_CLASS_* (static, dynamic, post, error)
+#define METRIC_CLASSES    4
+
+// What became of requests turned away under overload
+#define METRIC_SHED_DROPPED  0  // Closed unanswered
+#define METRIC_SHED_REJECTED 1  // Answered 503
+#define METRIC_SHED_KINDS    2
+
+typedef struct Server_metrics* server_metrics;
+
+// Creates metrics for workers numbered 1..workers; stats are their
+// counters (see create_threads_stats)
+server_metrics create_metrics(threads_stats stats, int workers);
+
+// Allocates worker `worker`'s histograms. The worker calls it itself, once,
+// so that they sit in memory local to its CPU; until then its latencies are
+// not recorded. Returns -1 if allocation failed.
+int metrics_thread_init(server_metrics metrics, int worker);
+
+void destroy_metrics(server_metrics metrics);
+
+// Records how long (in microseconds) a request of class req_class spent in
+// a phase. Only worker `worker` may record for itself.
+void metrics_record(server_metrics metrics, int worker, int phase, int req_class, long usec);
+
+// Counts n requests turned away under overload. Any thread may count.
+void metrics_count_shed(server_metrics metrics, int kind, long n);
+
+// Also reports limiter's limit and in-flight requests as gauges
+void metrics_attach_limiter(server_metrics metrics, limiter limiter);
+
+// Renders every histogram, merged over the workers, into dst (caller frees).
+// Returns the length.
+int metrics_render(server_metrics metrics, char** dst);
+
+#endif // METRICS_H
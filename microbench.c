@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "request_queue.h"
+#include "log.h"
+#include "histogram.h"
+#include "clock.h"
+
+//
+// microbench.c: Microbenchmarks of the request queue and the server log,
+// run in isolation from the network and the disk.
+//
+// To run:
+//  make bench [BENCH_ARGS="--time 1 queue"]
+//  ./microbench [--time SEC] [--entry-size N] [queue] [log-append] [log-read]
+//
+// Suites (all by default):
+//  queue        producers enqueue and consumers dequeue as fast as they can,
+//               over producer/consumer counts and queue capacities
+//  log-append   writers append to a log that readers read whole at the same
+//               time, over writer and reader counts
+//  log-read     get_log and a query for the newest entries, over log sizes
+//
+// Every case prints one JSON object per line on stdout, so runs can be
+// diffed or loaded as they are. Latencies are in nanoseconds, taken from
+// per-thread histograms (so rounded up by at most 1/8), and include any
+// time an operation spent blocked.
+//
+
+static const int queue_producers[] = {1, 4};
+static const int queue_consumers[] = {1, 2, 4, 8};
+static const int queue_capacities[] = {1, 16, 256, 4096};
+static const int log_writers[] = {1, 4};
+static const int log_readers[] = {0, 1, 4};
+static const long log_sizes[] = {1000, 10000, 100000, 1000000};
+#define COUNT(array) ((int)(sizeof(array) / sizeof(array[0])))
+
+// The newest entries the log-append cases keep, so concurrent readers
+// copy a bounded log
+#define LOG_APPEND_RETAIN 100000
+// Entries the tail query of log-read returns
+#define LOG_READ_TAIL 100
+// Fewest repetitions of a log-read measurement, however long they take
+#define LOG_READ_MIN_REPS 5
+
+static double case_time = 0.25;    // Seconds per case
+static int entry_size = 64;        // Bytes per log entry
+static atomic_int stop;
+static pthread_barrier_t start_line;    // Every thread of a log-append case, and main
+
+static void sleep_case() {
+    struct timespec pause;
+    pause.tv_sec = (time_t)case_time;
+    pause.tv_nsec = (long)((case_time - pause.tv_sec) * 1e9);
+    nanosleep(&pause, NULL);
+}
+
+// Prints a histogram's percentiles as a JSON object member
+static void print_latency(const char* name, const struct Histogram* hist, long max) {
+    long p50 = histogram_percentile(hist, 0.5), p99 = histogram_percentile(hist, 0.99),
+         p999 = histogram_percentile(hist, 0.999);
+    unsigned long count = atomic_load(&hist->count);
+    printf(", \"%s\": {\"mean\": %.1f, \"p50\": %ld, \"p99\": %ld, \"p999\": %ld, \"max\": %ld}", name,
+           count ? (double)atomic_load(&hist->sum) / count : 0.0,
+           p50 < max ? p50 : max, p99 < max ? p99 : max, p999 < max ? p999 : max, max);
+}
+
+// One benchmark thread's measurements
+struct Bench_thread {
+    pthread_t thread;
+    void* target;               // The queue or log under test
+    int writers;                // Threads appending to the log
+    long ops;
+    long bytes;
+    long max, max2;
+    struct Histogram latency;
+    struct Histogram latency2;  // A second measure (a consumer's queueing delay)
+};
+
+static struct Bench_thread* new_threads(int n) {
+    struct Bench_thread* threads = (struct Bench_thread*)calloc(n, sizeof(struct Bench_thread));
+    if (!threads) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    return threads;
+}
+
+static void record(struct Histogram* hist, long* max, long value) {
+    histogram_record(hist, value);
+    if (value > *max) *max = value;
+}
+
+// Merges every thread's measurements into the first
+static void merge_threads(struct Bench_thread* threads, int n) {
+    for (int i = 1; i < n; i++) {
+        threads[0].ops += threads[i].ops;
+        threads[0].bytes += threads[i].bytes;
+        if (threads[i].max > threads[0].max) threads[0].max = threads[i].max;
+        if (threads[i].max2 > threads[0].max2) threads[0].max2 = threads[i].max2;
+        histogram_merge(&threads[0].latency, &threads[i].latency);
+        histogram_merge(&threads[0].latency2, &threads[i].latency2);
+    }
+}
+
+static void start_thread(struct Bench_thread* thread, void* (*run)(void*), void* target) {
+    thread->target = target;
+    if (pthread_create(&thread->thread, NULL, run, thread) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+static void* queue_producer(void* arg) {
+    struct Bench_thread* self = (struct Bench_thread*)arg;
+    struct timeval arrival = {0, 0};
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        long start = monotonic_nsec();
+        // arrival_mono carries the enqueue time, in nanoseconds here
+        queue_enqueue((struct request_queue_t*)self->target, 0, arrival, start);
+        record(&self->latency, &self->max, monotonic_nsec() - start);
+        self->ops++;
+    }
+    return NULL;
+}
+
+static void* queue_consumer(void* arg) {
+    struct Bench_thread* self = (struct Bench_thread*)arg;
+    while (1) {
+        long start = monotonic_nsec();
+        struct request_t* request = queue_dequeue((struct request_queue_t*)self->target);
+        long end = monotonic_nsec();
+        if (request->connfd < 0) {
+            free(request);
+            return NULL;
+        }
+        record(&self->latency, &self->max, end - start);
+        record(&self->latency2, &self->max2, end - request->arrival_mono);
+        self->ops++;
+        free(request);
+    }
+}
+
+static void bench_queue(int producers, int consumers, int capacity) {
+    struct request_queue_t* queue = create_queue(capacity);
+    struct Bench_thread* prod = new_threads(producers);
+    struct Bench_thread* cons = new_threads(consumers);
+    if (!queue) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    atomic_store(&stop, 0);
+    long start = monotonic_nsec();
+    for (int i = 0; i < consumers; i++) start_thread(&cons[i], queue_consumer, queue);
+    for (int i = 0; i < producers; i++) start_thread(&prod[i], queue_producer, queue);
+    sleep_case();
+    atomic_store(&stop, 1);
+    for (int i = 0; i < producers; i++) pthread_join(prod[i].thread, NULL);
+    double elapsed = (monotonic_nsec() - start) / 1e9;
+    // One end marker per consumer, behind whatever is still queued
+    struct timeval arrival = {0, 0};
+    for (int i = 0; i < consumers; i++) queue_enqueue(queue, -1, arrival, 0);
+    for (int i = 0; i < consumers; i++) pthread_join(cons[i].thread, NULL);
+    merge_threads(prod, producers);
+    merge_threads(cons, consumers);
+
+    printf("{\"suite\": \"queue\", \"producers\": %d, \"consumers\": %d, \"capacity\": %d, "
+           "\"elapsed_s\": %.3f, \"ops\": %ld, \"ops_per_sec\": %.0f",
+           producers, consumers, capacity, elapsed, prod[0].ops, prod[0].ops / elapsed);
+    print_latency("enqueue_ns", &prod[0].latency, prod[0].max);
+    print_latency("dequeue_ns", &cons[0].latency, cons[0].max);
+    print_latency("sojourn_ns", &cons[0].latency2, cons[0].max2);
+    printf("}\n");
+    fflush(stdout);
+    free(prod);
+    free(cons);
+    queue_destroy(queue);
+}
+
+static void* log_writer(void* arg) {
+    struct Bench_thread* self = (struct Bench_thread*)arg;
+    char* entry = (char*)malloc(entry_size);
+    if (!entry) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    memset(entry, 'x', entry_size);
+    // Fill the log first, so every measured append also evicts one
+    for (long i = 0; i < LOG_APPEND_RETAIN / self->writers; i++) {
+        add_to_log((server_log)self->target, entry, entry_size);
+    }
+    pthread_barrier_wait(&start_line);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        long start = monotonic_nsec();
+        add_to_log((server_log)self->target, entry, entry_size);
+        record(&self->latency, &self->max, monotonic_nsec() - start);
+        self->ops++;
+    }
+    free(entry);
+    return NULL;
+}
+
+static void* log_reader(void* arg) {
+    struct Bench_thread* self = (struct Bench_thread*)arg;
+    pthread_barrier_wait(&start_line);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        char* buf;
+        long start = monotonic_nsec();
+        int len = get_log((server_log)self->target, &buf);
+        record(&self->latency, &self->max, monotonic_nsec() - start);
+        free(buf);
+        self->ops++;
+        self->bytes += len;
+    }
+    return NULL;
+}
+
+static void bench_log_append(int writers, int readers) {
+    struct Log_config config;
+    memset(&config, 0, sizeof(config));
+    config.max_entries = LOG_APPEND_RETAIN;
+    config.writers = writers;
+    server_log log = create_log_with_config(&config);
+    struct Bench_thread* wr = new_threads(writers);
+    struct Bench_thread* rd = new_threads(readers ? readers : 1);
+    atomic_store(&stop, 0);
+    pthread_barrier_init(&start_line, NULL, writers + readers + 1);
+    for (int i = 0; i < readers; i++) start_thread(&rd[i], log_reader, log);
+    for (int i = 0; i < writers; i++) {
+        wr[i].writers = writers;
+        start_thread(&wr[i], log_writer, log);
+    }
+    pthread_barrier_wait(&start_line);
+    long start = monotonic_nsec();
+    sleep_case();
+    atomic_store(&stop, 1);
+    for (int i = 0; i < writers; i++) pthread_join(wr[i].thread, NULL);
+    for (int i = 0; i < readers; i++) pthread_join(rd[i].thread, NULL);
+    double elapsed = (monotonic_nsec() - start) / 1e9;
+    merge_threads(wr, writers);
+    merge_threads(rd, readers ? readers : 1);
+    pthread_barrier_destroy(&start_line);
+
+    printf("{\"suite\": \"log-append\", \"writers\": %d, \"readers\": %d, \"entry_bytes\": %d, "
+           "\"retained\": %d, \"elapsed_s\": %.3f, \"appends\": %ld, \"appends_per_sec\": %.0f",
+           writers, readers, entry_size, LOG_APPEND_RETAIN, elapsed, wr[0].ops, wr[0].ops / elapsed);
+    print_latency("append_ns", &wr[0].latency, wr[0].max);
+    printf(", \"reads\": %ld, \"reads_per_sec\": %.1f, \"read_mb_per_sec\": %.1f",
+           rd[0].ops, rd[0].ops / elapsed, rd[0].bytes / elapsed / 1e6);
+    print_latency("read_ns", &rd[0].latency, rd[0].max);
+    printf("}\n");
+    fflush(stdout);
+    free(wr);
+    free(rd);
+    destroy_log(log);
+}
+
+static void bench_log_read(long size) {
+    server_log log = create_log();
+    char* entry = (char*)malloc(entry_size);
+    struct Bench_thread* full = new_threads(2);
+    struct Bench_thread* tail = full + 1;
+    if (!entry) {
+        perror("Malloc failed");
+        exit(1);
+    }
+    memset(entry, 'x', entry_size);
+    for (long i = 0; i < size; i++) add_to_log(log, entry, entry_size);
+
+    // The whole log, as GET /log reads it
+    long until = monotonic_nsec() + (long)(case_time * 1e9);
+    while (full->ops < LOG_READ_MIN_REPS || monotonic_nsec() < until) {
+        char* buf;
+        long start = monotonic_nsec();
+        full->bytes = get_log(log, &buf);
+        record(&full->latency, &full->max, monotonic_nsec() - start);
+        free(buf);
+        full->ops++;
+    }
+    // Only the newest entries, as a subscriber polling its cursor does
+    struct Log_query query;
+    memset(&query, 0, sizeof(query));
+    unsigned long next = log_next_cursor(log);
+    query.cursor = next > LOG_READ_TAIL ? next - LOG_READ_TAIL : 0;
+    until = monotonic_nsec() + (long)(case_time * 1e9);
+    while (tail->ops < LOG_READ_MIN_REPS || monotonic_nsec() < until) {
+        char* buf;
+        long start = monotonic_nsec();
+        tail->bytes = query_log(log, &query, &buf, NULL);
+        record(&tail->latency, &tail->max, monotonic_nsec() - start);
+        free(buf);
+        tail->ops++;
+    }
+
+    printf("{\"suite\": \"log-read\", \"entries\": %ld, \"entry_bytes\": %d, \"log_bytes\": %ld, \"reads\": %ld",
+           size, entry_size, full->bytes, full->ops);
+    print_latency("get_log_ns", &full->latency, full->max);
+    printf(", \"tail_entries\": %d, \"tail_reads\": %ld", LOG_READ_TAIL, tail->ops);
+    print_latency("tail_query_ns", &tail->latency, tail->max);
+    printf("}\n");
+    fflush(stdout);
+    free(full);
+    free(entry);
+    destroy_log(log);
+}
+
+static void usage(char* prog) {
+    fprintf(stderr, "Usage: %s [--time SEC] [--entry-size N] [queue] [log-append] [log-read]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"time",       required_argument, NULL, 't'},
+        {"entry-size", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:s:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't': case_time = atof(optarg); break;
+            case 's': entry_size = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (case_time <= 0 || entry_size <= 0 || entry_size > LOG_ENTRY_MAX) usage(argv[0]);
+    int all = optind == argc;
+    int run_queue = all, run_append = all, run_read = all;
+    for (int i = optind; i < argc; i++) {
+        if (!strcmp(argv[i], "queue")) {
+            run_queue = 1;
+        } else if (!strcmp(argv[i], "log-append")) {
+            run_append = 1;
+        } else if (!strcmp(argv[i], "log-read")) {
+            run_read = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (run_queue) {
+        for (int p = 0; p < COUNT(queue_producers); p++) {
+            for (int c = 0; c < COUNT(queue_consumers); c++) {
+                for (int q = 0; q < COUNT(queue_capacities); q++) {
+                    bench_queue(queue_producers[p], queue_consumers[c], queue_capacities[q]);
+                }
+            }
+        }
+    }
+    if (run_append) {
+        for (int w = 0; w < COUNT(log_writers); w++) {
+            for (int r = 0; r < COUNT(log_readers); r++) bench_log_append(log_writers[w], log_readers[r]);
+        }
+    }
+    if (run_read) {
+        for (int s = 0; s < COUNT(log_sizes); s++) bench_log_read(log_sizes[s]);
+    }
+    return 0;
+}
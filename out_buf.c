@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "out_buf.h"
+
+#define OUT_INITIAL 4096
+
+int out_init(struct Out_buf* out) {
+    out->buf = (char*)malloc(OUT_INITIAL);
+    out->len = 0;
+    out->cap = out->buf ? OUT_INITIAL : 0;
+    if (!out->buf) {
+        perror("Malloc failed");
+        return -1;
+    }
+    return 0;
+}
+
+int out_reserve(struct Out_buf* out, long n) {
+    if (!out->buf) return -1;  // An earlier allocation failed
+    if (out->len + n < out->cap) return 0;
+    long cap = out->cap * 2;
+    while (cap <= out->len + n) cap *= 2;
+    char* bigger = (char*)realloc(out->buf, cap);
+    if (!bigger) {
+        perror("Malloc failed");
+        free(out->buf);
+        out->buf = NULL;
+        return -1;
+    }
+    out->buf = bigger;
+    out->cap = cap;
+    return 0;
+}
+
+void out_printf(struct Out_buf* out, const char* fmt, ...) {
+    if (!out->buf) return;  // An earlier allocation failed
+    va_list args;
+    va_start(args, fmt);
+    long n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    if (n >= out->cap - out->len) {
+        // Did not fit: grow, then format it again
+        if (out_reserve(out, n) < 0) return;
+        va_start(args, fmt);
+        vsnprintf(out->buf + out->len, out->cap - out->len, fmt, args);
+        va_end(args);
+    }
+    out->len += n;
+}
@@ -0,0 +1,25 @@
+#ifndef OUT_BUF_H
+#define OUT_BUF_H
+
+// Growing text buffer for the dumps and scrapes (metrics_render,
+// trace_dump, profile_dump) and for log reads (query_log). If an allocation
+// fails, buf is freed and set to NULL and later appends do nothing, so a
+// renderer checks buf once, at the end.
+struct Out_buf {
+    char* buf;
+    long len, cap;
+};
+
+// Starts an empty buffer; returns -1 (and leaves buf NULL) if it cannot be
+// allocated
+int out_init(struct Out_buf* out);
+
+// Makes room for n more bytes and a terminating null, for a caller that
+// writes at buf + len itself and then advances len. Returns -1 if the
+// buffer cannot grow (or an earlier allocation failed).
+int out_reserve(struct Out_buf* out, long n);
+
+// Appends printf-style text, growing the buffer to fit it
+void out_printf(struct Out_buf* out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif // OUT_BUF_H
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include "profile.h"
+#include "out_buf.h"
+#include "push_list.h"
+
+// Frames kept per sample, and samples kept per thread
+#define PROFILE_DEPTH 48
+#define PROFILE_SAMPLES 4096
+// backtrace in the handler starts with the handler and the signal trampoline
+#define PROFILE_SKIP 2
+
+struct Profile_sample {
+    int depth;
+    void* frames[PROFILE_DEPTH];
+};
+
+// A thread's ring: slot i % PROFILE_SAMPLES holds sample number i. Only the
+// thread's own SIGPROF handler writes it.
+struct Profile_ring {
+    struct Push_node node;
+    _Atomic unsigned long head;
+    struct Profile_sample samples[PROFILE_SAMPLES];
+};
+
+static int profile_hz;
+static struct Push_node* _Atomic rings;   // Every thread's ring
+static __thread struct Profile_ring* local_ring;
+
+static void on_sigprof(int sig, siginfo_t* info, void* context) {
+    struct Profile_ring* ring = local_ring;
+    if (!ring) return;
+    int saved_errno = errno;
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct Profile_sample* sample = &ring->samples[head % PROFILE_SAMPLES];
+    // A dump that sees this sample change also sees head at least this
+    // sample's number (see dump_ring)
+    atomic_thread_fence(memory_order_release);
+    sample->depth = backtrace(sample->frames, PROFILE_DEPTH);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    errno = saved_errno;
+}
+
+int profile_init(int hz) {
+    if (hz <= 0 || hz > 1000000) return -1;
+    // The first backtrace loads libgcc, which is not safe inside a handler
+    void* frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) < 0) return -1;
+    profile_hz = hz;
+    return 0;
+}
+
+void profile_thread_init() {
+    if (!profile_hz || local_ring) return;
+    struct Profile_ring* ring = (struct Profile_ring*)calloc(1, sizeof(struct Profile_ring));
+    if (!ring) {
+        perror("Malloc failed");
+        return;
+    }
+    push_list_add(&rings, &ring->node);
+    local_ring = ring;
+
+    // Fires on the thread's own CPU time, so idle threads take no samples
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+    timer_t timer;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) < 0) {
+        perror("timer_create");
+        return;
+    }
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = 1000000000L / profile_hz;
+    if (profile_hz == 1) {
+        interval.it_interval.tv_sec = 1;
+        interval.it_interval.tv_nsec = 0;
+    }
+    interval.it_value = interval.it_interval;
+    if (timer_settime(timer, 0, &interval, NULL) < 0) perror("timer_settime");
+}
+
+// Appends a frame's name: its symbol, else module+offset
+static void out_frame(struct Out_buf* out, void* pc) {
+    Dl_info info;
+    if (dladdr(pc, &info) && info.dli_sname) {
+        out_printf(out, "%s", info.dli_sname);
+    } else if (info.dli_fname) {
+        const char* module = strrchr(info.dli_fname, '/');
+        out_printf(out, "%s+0x%lx", module ? module + 1 : info.dli_fname,
+                   (unsigned long)((char*)pc - (char*)info.dli_fbase));
+    } else {
+        out_printf(out, "%p", pc);
+    }
+}
+
+// Copies out the ring's samples that were not overwritten while reading
+static long dump_ring(struct Profile_ring* ring, struct Profile_sample* copy) {
+    unsigned long end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long begin = end > PROFILE_SAMPLES ? end - PROFILE_SAMPLES : 0;
+    for (unsigned long i = begin; i < end; i++) {
+        copy[i - begin] = ring->samples[i % PROFILE_SAMPLES];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    // Sample number `head` may be half written over sample head - PROFILE_SAMPLES
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long valid = head >= PROFILE_SAMPLES ? head - PROFILE_SAMPLES + 1 : 0;
+    if (valid > begin) {
+        memmove(copy, copy + (valid - begin), (end - valid) * sizeof(*copy));
+        begin = valid;
+    }
+    return begin < end ? (long)(end - begin) : 0;
+}
+
+static int compare_stacks(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int profile_dump(char** dst) {
+    *dst = NULL;
+    struct Profile_sample* copy = (struct Profile_sample*)malloc(PROFILE_SAMPLES * sizeof(struct Profile_sample));
+    struct Out_buf stacks;
+    out_init(&stacks);
+    long nstacks = 0;
+    if (!copy || !stacks.buf) {
+        perror("Malloc failed");
+        free(copy);
+        free(stacks.buf);
+        return 0;
+    }
+    // Fold every sample into one line, root first
+    for (struct Push_node* node = atomic_load(&rings); node; node = node->next) {
+        long n = dump_ring((struct Profile_ring*)node, copy);
+        for (long i = 0; i < n; i++) {
+            if (copy[i].depth <= PROFILE_SKIP) continue;
+            for (int f = copy[i].depth - 1; f >= PROFILE_SKIP; f--) {
+                out_frame(&stacks, copy[i].frames[f]);
+                out_printf(&stacks, f > PROFILE_SKIP ? ";" : "");
+            }
+            out_printf(&stacks, "%c", '\0');
+            nstacks++;
+        }
+    }
+    free(copy);
+
+    // Count identical stacks
+    char** lines = (char**)malloc((nstacks + 1) * sizeof(char*));
+    struct Out_buf out;
+    out_init(&out);
+    if (!stacks.buf || !lines || !out.buf) {
+        perror("Malloc failed");
+        free(stacks.buf);
+        free(lines);
+        free(out.buf);
+        return 0;
+    }
+    char* line = stacks.buf;
+    for (long i = 0; i < nstacks; i++) {
+        lines[i] = line;
+        line += strlen(line) + 1;
+    }
+    qsort(lines, nstacks, sizeof(char*), compare_stacks);
+    for (long i = 0; i < nstacks; ) {
+        long j = i + 1;
+        while (j < nstacks && !strcmp(lines[i], lines[j])) j++;
+        out_printf(&out, "%s %ld\n", lines[i], j - i);
+        i = j;
+    }
+    free(lines);
+    free(stacks.buf);
+    if (!out.buf) return 0;
+    *dst = out.buf;
+    return (int)out.len;
+}
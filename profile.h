@@ -0,0 +1,23 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// In-process sampling CPU profiler with folded-stack output (one line per
+// distinct stack, "root;...;leaf count", ready for flamegraph.pl).
+// Each registered thread gets a timer on its own CPU-time clock that sends
+// it SIGPROF; the handler stores a backtrace in the thread's ring of recent
+// samples, touching nothing shared and calling nothing that allocates.
+// Dumps symbolize the samples with dladdr; functions missing from the
+// dynamic symbol table show as module+offset (see addr2line).
+
+// Starts sampling at hz samples per CPU-second in every thread that calls
+// profile_thread_init from now on. Returns -1 on failure.
+int profile_init(int hz);
+
+// Starts the calling thread's timer (no-op unless profiling)
+void profile_thread_init();
+
+// Renders the samples of every thread as folded stacks into dst (caller
+// frees). Returns the length.
+int profile_dump(char** dst);
+
+#endif // PROFILE_H
@@ -0,0 +1,19 @@
+#ifndef PUSH_LIST_H
+#define PUSH_LIST_H
+#include <stdatomic.h>
+
+// List of per-thread buffers that live until exit (the trace and profile
+// rings): each thread pushes its own node once, without a lock, and a dump
+// walks every node pushed before it started. Nodes are never removed. A
+// buffer embeds a struct Push_node as its first member.
+struct Push_node {
+    struct Push_node* next;
+};
+
+static inline void push_list_add(struct Push_node* _Atomic* head, struct Push_node* node) {
+    node->next = atomic_load(head);
+    while (!atomic_compare_exchange_weak(head, &node->next, node)) {
+    }
+}
+
+#endif // PUSH_LIST_H
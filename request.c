@@ -4,32 +4,65 @@
 
 #include "segel.h"
 #include "request.h"
+#include "trace.h"
+#include "profile.h"
+#include "clock.h"
 
-int append_stats(char* buf, threads_stats t_stats, struct timeval arrival, struct timeval dispatch){
-    int offset = strlen(buf);  // Start after what's already written to buf
-
-    offset += sprintf(buf + offset, "Stat-Req-Arrival:: %ld.%06ld\r\n",
-                      arrival.tv_sec, arrival.tv_usec);
+// When the current request's response started, for the latency metrics
+// (monotonic microseconds, 0 = nothing sent yet)
+static __thread long first_byte;
 
-    offset += sprintf(buf + offset, "Stat-Req-Dispatch:: %ld.%06ld\r\n",
-                      dispatch.tv_sec, dispatch.tv_usec);
-
-    offset += sprintf(buf + offset, "Stat-Thread-Id:: %d\r\n",
-                      t_stats->id);
+// Call right before a response's first write
+static void requestFirstByte()
+{
+    if (!first_byte) first_byte = monotonic_usec();
+}
 
-    offset += sprintf(buf + offset, "Stat-Thread-Count:: %d\r\n",
-                      t_stats->total_req);
+// Captures the thread's current stats in the log's binary form
+void fill_stat(struct Log_stat* stat, threads_stats t_stats, struct timeval arrival, struct timeval dispatch, int req_class){
+    stat->arrival = arrival.tv_sec * 1000000L + arrival.tv_usec;
+    stat->dispatch = dispatch.tv_sec * 1000000L + dispatch.tv_usec;
+    struct Stats_snapshot counts;
+    stats_snapshot(t_stats, &counts);
+    stat->thread_id = counts.id;
+    stat->total_req = counts.total_req;
+    stat->stat_req = counts.stat_req;
+    stat->dynm_req = counts.dynm_req;
+    stat->post_req = counts.post_req;
+    stat->req_class = req_class;
+}
 
-    offset += sprintf(buf + offset, "Stat-Thread-Static:: %d\r\n",
-                      t_stats->stat_req);
+int append_stats(char* buf, threads_stats t_stats, struct timeval arrival, struct timeval dispatch){
+    int offset = strlen(buf);  // Start after what's already written to buf
+    struct Log_stat stat;
 
-    offset += sprintf(buf + offset, "Stat-Thread-Dynamic:: %d\r\n",
-                      t_stats->dynm_req);
-    offset += sprintf(buf + offset, "Stat-Thread-Post:: %d\r\n\r\n",
-                      t_stats->post_req);
+    // Same text the log renders for its entries (the class is not shown)
+    fill_stat(&stat, t_stats, arrival, dispatch, LOG_CLASS_ERROR);
+    offset += log_format_stat(buf + offset, &stat);
     return offset;
 }
 
+// Copies the value of query parameter `name` in uri into value (at most
+// len bytes). Returns 1 if the parameter is present.
+int requestGetParam(char *uri, char *name, char *value, int len)
+{
+	char *p = index(uri, '?');
+	int name_len = strlen(name);
+	while (p) {
+		p++;
+		if (!strncmp(p, name, name_len) && (p[name_len] == '=' || p[name_len] == '&' || p[name_len] == '\0')) {
+			char *v = p + name_len + (p[name_len] == '=');
+			int n = strcspn(v, "&");
+			if (n >= len) n = len - 1;
+			memcpy(value, v, n);
+			value[n] = '\0';
+			return 1;
+		}
+		p = index(p, '&');
+	}
+	return 0;
+}
+
 // requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
 void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
 {
@@ -44,6 +77,7 @@ void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longm
 
 	// Write out the header information for this response
 	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+	requestFirstByte();
 	Rio_writen(fd, buf, strlen(buf));
 	printf("%s", buf);
 
@@ -67,9 +101,10 @@ void requestReadhdrs(rio_t *rp)
 {
 	char buf[MAXLINE];
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	// Stops early if the client hangs up before the blank line
+	int n = Rio_readlineb(rp, buf, MAXLINE);
+	while (n > 0 && strcmp(buf, "\r\n")) {
+		n = Rio_readlineb(rp, buf, MAXLINE);
 	}
 	return;
 }
@@ -132,7 +167,9 @@ void requestServeDynamic(int fd, char *filename, char *cgiargs, struct timeval a
 	sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
     int buf_len = append_stats(buf, t_stats, arrival, dispatch);
 
+    requestFirstByte();
     Rio_writen(fd, buf, buf_len);
+    long span = trace_begin();
    	int pid = 0;
    	if ((pid = Fork()) == 0) {
      	 /* Child process */
@@ -142,6 +179,7 @@ void requestServeDynamic(int fd, char *filename, char *cgiargs, struct timeval a
      	 Execve(filename, emptylist, environ);
    	}
   	WaitPid(pid, NULL, WUNTRACED);
+    trace_end("cgi", span);
 }
 
 
@@ -152,12 +190,14 @@ void requestServeStatic(int fd, char *filename, int filesize, struct timeval arr
 
 	requestGetFiletype(filename, filetype);
 
+    long span = trace_begin();
 	srcfd = Open(filename, O_RDONLY, 0);
 
 	// Rather than call read() to read the file into memory,
 	// which would require that we allocate a buffer, we memory-map the file
 	srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
 	Close(srcfd);
+    trace_end("mmap", span);
 
 	// put together response
 	sprintf(buf, "HTTP/1.0 200 OK\r\n");
@@ -165,37 +205,207 @@ void requestServeStatic(int fd, char *filename, int filesize, struct timeval arr
 	sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
 	sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
     int buf_len = append_stats(buf, t_stats, arrival, dispatch);
+    span = trace_begin();
+    requestFirstByte();
     Rio_writen(fd, buf, buf_len);
 
 	//  Writes out to the client socket the memory-mapped file
 	Rio_writen(fd, srcp, filesize);
+    trace_end("write", span);
 	Munmap(srcp, filesize);
 }
 
-void requestServePost(int fd,  struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log)
+// Parses a Stat-Req-Arrival style time (seconds with up to 6 decimals) into microseconds
+long requestParseTime(char *value)
+{
+	char *frac;
+	long usec = strtol(value, &frac, 10) * 1000000L;
+	if (*frac == '.') {
+		long scale = 100000;
+		for (frac++; *frac >= '0' && *frac <= '9' && scale > 0; frac++, scale /= 10) {
+			usec += (*frac - '0') * scale;
+		}
+	}
+	return usec;
+}
+
+// Parses a comma-separated list of request classes into LOG_CLASS_* bits
+int requestParseClasses(char *value)
 {
-    char header[MAXBUF], *body = NULL;
-    int body_len = get_log(log, &body);
+	static char *names[] = {"static", "dynamic", "post", "error"};
+	int classes = 0;
+	char *rest;
+	// strtok_r: workers parse their queries at the same time
+	for (char *name = strtok_r(value, ",", &rest); name; name = strtok_r(NULL, ",", &rest)) {
+		for (int i = 0; i < 4; i++) {
+			if (!strcasecmp(name, names[i])) classes |= 1 << i;
+		}
+	}
+	return classes;
+}
+
+// Answers POST ?follow=1: sends the headers, then hands a copy of the
+// connection to the log stream, which keeps it after the worker closes fd
+void requestFollowLog(int fd, char *uri, struct Log_query *query, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log, log_stream stream)
+{
+    char header[MAXBUF], param[MAXLINE];
+    int paging = requestGetParam(uri, "cursor", param, sizeof(param));
+
+    if (!paging) {
+        query->cursor = log_next_cursor(log);
+    }
+    query->limit = 0;
+    sprintf(header, "HTTP/1.1 200 OK\r\n");
+    sprintf(header, "%sServer: OS-HW3 Web Server\r\n", header);
+    sprintf(header, "%sTransfer-Encoding: chunked\r\n", header);
+    sprintf(header, "%sContent-Type: %s\r\n", header, query->raw ? "application/octet-stream" : "text/plain");
+    // Like a plain POST, only a client paging with cursor= gets a cursor back
+    if (paging) {
+        sprintf(header, "%sLog-Next-Cursor: %lu\r\n", header, query->cursor);
+    }
+    int header_len = append_stats(header, t_stats, arrival, dispatch);
+    requestFirstByte();
+    Rio_writen(fd, header, header_len);
+
+    // Close-on-exec like fd, or every CGI child forked from now on would
+    // hold the subscriber's connection open
+    int stream_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (stream_fd < 0) {
+        perror("F_DUPFD_CLOEXEC");
+        return;
+    }
+    log_stream_add(stream, stream_fd, query);
+}
+
+// Returns the log as text, or with ?format=binary as raw records (see get_log_raw).
+// ?cursor=N returns only entries from N on; Log-Next-Cursor is the cursor
+// for the next poll. It and Log-Dropped-Entries (with retention on) are only
+// sent to clients that page with cursor= or limit=, so a plain POST keeps the
+// original header set. thread=ID, from=TIME, to=TIME (as in Stat-Req-Arrival),
+// class=static,dynamic,... and limit=N select entries (see query_log).
+// With ?follow=1 the connection stays open and the matching entries, from the
+// cursor (default: the current end of the log) on, are pushed to it as HTTP
+// chunks by the log stream; limit does not apply.
+void requestServePost(int fd, char *uri, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log, log_stream stream)
+{
+    char header[MAXBUF], param[MAXLINE], *body = NULL;
+    struct Log_query query;
+    unsigned long next_cursor;
+
+    memset(&query, 0, sizeof(query));
+    int paging = 0;
+    if (requestGetParam(uri, "cursor", param, sizeof(param))) {
+        query.cursor = strtoul(param, NULL, 10);
+        paging = 1;
+    }
+    if (requestGetParam(uri, "thread", param, sizeof(param))) {
+        query.thread_id = atoi(param);
+    }
+    if (requestGetParam(uri, "from", param, sizeof(param))) {
+        query.from = requestParseTime(param);
+    }
+    if (requestGetParam(uri, "to", param, sizeof(param))) {
+        query.to = requestParseTime(param);
+    }
+    if (requestGetParam(uri, "class", param, sizeof(param))) {
+        query.classes = requestParseClasses(param);
+    }
+    if (requestGetParam(uri, "limit", param, sizeof(param))) {
+        query.limit = atol(param);
+        paging = 1;
+    }
+    int binary = requestGetParam(uri, "format", param, sizeof(param)) && !strcmp(param, "binary");
+    query.raw = binary;
+    if (stream && requestGetParam(uri, "follow", param, sizeof(param)) && atoi(param)) {
+        requestFollowLog(fd, uri, &query, arrival, dispatch, t_stats, log, stream);
+        return;
+    }
+    long span = trace_begin();
+    int body_len = query_log(log, &query, &body, &next_cursor);
+    trace_end("log_query", span);
     // put together response
     sprintf(header, "HTTP/1.0 200 OK\r\n");
     sprintf(header, "%sServer: OS-HW3 Web Server\r\n", header);
     sprintf(header, "%sContent-Length: %d\r\n", header, body_len);
-    sprintf(header, "%sContent-Type: %s\r\n", header, "text/plain");
+    sprintf(header, "%sContent-Type: %s\r\n", header, binary ? "application/octet-stream" : "text/plain");
+    if (paging && log_has_retention(log)) {
+        sprintf(header, "%sLog-Dropped-Entries: %ld\r\n", header, log_dropped(log));
+    }
+    if (paging) {
+        sprintf(header, "%sLog-Next-Cursor: %lu\r\n", header, next_cursor);
+    }
     int header_len = append_stats(header, t_stats, arrival, dispatch);
+    span = trace_begin();
+    requestFirstByte();
     Rio_writen(fd, header, header_len);
-    Rio_writen(fd, "\r\n", 2);
     Rio_writen(fd, body, body_len);
+    trace_end("write", span);
     free(body);
 }
 
-void record_log_stat(threads_stats t_stats, struct timeval arrival, struct timeval dispatch, server_log log) {
-    char buf[1000];
-    int offset = append_stats(buf, t_stats, arrival, dispatch);
-    add_to_log(log, buf, offset+1);
+// Logs the request's stats in binary form; they are rendered only when read
+void record_log_stat(threads_stats t_stats, struct timeval arrival, struct timeval dispatch, int req_class, server_log log) {
+    struct Log_stat stat;
+    long span = trace_begin();
+    fill_stat(&stat, t_stats, arrival, dispatch, req_class);
+    add_stat_to_log(log, &stat);
+    trace_end("log_append", span);
 }
 
-// handle a request
-void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log)
+// Sends an admin endpoint's body (GET /metrics, /trace, /profile) and frees it
+void requestServeDump(int fd, char *content_type, char *body, int body_len, struct timeval arrival, struct timeval dispatch, threads_stats t_stats)
+{
+    char header[MAXBUF];
+
+    sprintf(header, "HTTP/1.0 200 OK\r\n");
+    sprintf(header, "%sServer: OS-HW3 Web Server\r\n", header);
+    sprintf(header, "%sContent-Length: %d\r\n", header, body_len);
+    sprintf(header, "%sContent-Type: %s\r\n", header, content_type);
+    int header_len = append_stats(header, t_stats, arrival, dispatch);
+    Rio_writen(fd, header, header_len);
+    Rio_writen(fd, body, body_len);
+    free(body);
+}
+
+// Turns a connection away with 503 Service Unavailable. The listener calls
+// it, so it never blocks: a new connection's send buffer has room for this.
+void requestReject(int fd)
+{
+    static const char response[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                                   "Server: OS-HW3 Web Server\r\n"
+                                   "Content-Length: 0\r\n"
+                                   "Retry-After: 1\r\n\r\n";
+    if (send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        // The client is gone or not reading; it is being turned away anyway
+    }
+}
+
+// Serves the admin endpoints; returns 0 if uri is not one of them.
+// - /metrics: latency histograms in Prometheus text format
+// - /trace: every worker's recent spans as Chrome trace JSON (needs --trace)
+// - /profile: CPU samples as folded stacks (needs --profile)
+int requestServeAdmin(int fd, char *uri, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_metrics metrics)
+{
+    char *body = NULL;
+    int body_len;
+
+    if (metrics && (!strcmp(uri, "/metrics") || !strncmp(uri, "/metrics?", 9))) {
+        body_len = metrics_render(metrics, &body);
+        requestServeDump(fd, "text/plain; version=0.0.4", body, body_len, arrival, dispatch, t_stats);
+    } else if (!strcmp(uri, "/trace")) {
+        body_len = trace_dump(&body);
+        requestServeDump(fd, "application/json", body, body_len, arrival, dispatch, t_stats);
+    } else if (!strcmp(uri, "/profile")) {
+        body_len = profile_dump(&body);
+        requestServeDump(fd, "text/plain", body, body_len, arrival, dispatch, t_stats);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Serves a request; returns its LOG_CLASS_*, or -1 if it is not measured
+static int requestServe(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log, log_stream stream, server_metrics metrics)
 {
     int is_static;
     struct stat sbuf;
@@ -203,22 +413,34 @@ void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, thre
     char filename[MAXLINE], cgiargs[MAXLINE];
     rio_t rio;
 
+    long span = trace_begin();
     Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
+    if (Rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+        // The client hung up without sending a request
+        return -1;
+    }
     sscanf(buf, "%s %s %s", method, uri, version);
 
     if (!strcasecmp(method, "GET")) {
         requestReadhdrs(&rio);
+        trace_end("read_headers", span);
 
+        if (requestServeAdmin(fd, uri, arrival, dispatch, t_stats, metrics)) {
+            stats_count(t_stats, -1);
+            return -1;
+        }
 
         is_static = requestParseURI(uri, filename, cgiargs);
-        if (stat(filename, &sbuf) < 0) {
+        span = trace_begin();
+        int found = stat(filename, &sbuf) == 0;
+        trace_end("stat", span);
+        if (!found) {
             requestError(fd, filename, "404", "Not found",
                          "OS-HW3 Server could not find this file",
                          arrival, dispatch, t_stats);
-            t_stats->total_req++;
-//            record_log_stat(t_stats, arrival, dispatch, log);
-            return;
+            stats_count(t_stats, LOG_CLASS_ERROR);
+//            record_log_stat(t_stats, arrival, dispatch, LOG_CLASS_ERROR, log);
+            return LOG_CLASS_ERROR;
         }
 
         if (is_static) {
@@ -226,42 +448,62 @@ void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, thre
                 requestError(fd, filename, "403", "Forbidden",
                              "OS-HW3 Server could not read this file",
                              arrival, dispatch, t_stats);
-                t_stats->total_req++;
-//                record_log_stat(t_stats, arrival, dispatch, log);
-                return;
+                stats_count(t_stats, LOG_CLASS_ERROR);
+//                record_log_stat(t_stats, arrival, dispatch, LOG_CLASS_ERROR, log);
+                return LOG_CLASS_ERROR;
             }
 
             requestServeStatic(fd, filename, sbuf.st_size, arrival, dispatch, t_stats);
-            t_stats->stat_req++;
-            t_stats->total_req++;
-            record_log_stat(t_stats, arrival, dispatch, log);
+            stats_count(t_stats, LOG_CLASS_STATIC);
+            record_log_stat(t_stats, arrival, dispatch, LOG_CLASS_STATIC, log);
+            return LOG_CLASS_STATIC;
 
         } else {
             if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
                 requestError(fd, filename, "403", "Forbidden",
                              "OS-HW3 Server could not run this CGI program",
                              arrival, dispatch, t_stats);
-                t_stats->total_req++;
-//                record_log_stat(t_stats, arrival, dispatch, log);
-                return;
+                stats_count(t_stats, LOG_CLASS_ERROR);
+//                record_log_stat(t_stats, arrival, dispatch, LOG_CLASS_ERROR, log);
+                return LOG_CLASS_ERROR;
             }
-            t_stats->total_req++;
-            t_stats->dynm_req++;
-            record_log_stat(t_stats, arrival, dispatch, log);
+            stats_count(t_stats, LOG_CLASS_DYNAMIC);
+            record_log_stat(t_stats, arrival, dispatch, LOG_CLASS_DYNAMIC, log);
             requestServeDynamic(fd, filename, cgiargs, arrival, dispatch, t_stats);
+            return LOG_CLASS_DYNAMIC;
         }
 
     } else if (!strcasecmp(method, "POST")) {
-        requestServePost(fd, arrival, dispatch, t_stats, log);
-        t_stats->post_req++;
-        t_stats->total_req++;
+        trace_end("read_request", span);
+        requestServePost(fd, uri, arrival, dispatch, t_stats, log, stream);
+        stats_count(t_stats, LOG_CLASS_POST);
+        return LOG_CLASS_POST;
     } else {
         requestError(fd, method, "501", "Not Implemented",
                      "OS-HW3 Server does not implement this method",
                      arrival, dispatch, t_stats);
-        t_stats->total_req++;
-//        record_log_stat(t_stats, arrival, dispatch, log);
-        return;
+        stats_count(t_stats, LOG_CLASS_ERROR);
+//        record_log_stat(t_stats, arrival, dispatch, LOG_CLASS_ERROR, log);
+        return LOG_CLASS_ERROR;
     }
+}
 
+// handle a request
+void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log, log_stream stream, server_metrics metrics)
+{
+    long start = monotonic_usec();
+    long span = trace_begin();
+    if (span) {
+        // Queue wait ends where the request span starts
+        trace_record("queue", span - (dispatch.tv_sec * 1000000000L + dispatch.tv_usec * 1000L), span);
+    }
+    first_byte = 0;
+    int req_class = requestServe(fd, arrival, dispatch, t_stats, log, stream, metrics);
+    trace_end("request", span);
+    if (!metrics || req_class < 0) return;
+
+    long end = monotonic_usec();
+    metrics_record(metrics, t_stats->id, METRIC_QUEUE, req_class, dispatch.tv_sec * 1000000L + dispatch.tv_usec);
+    metrics_record(metrics, t_stats->id, METRIC_FIRST_BYTE, req_class, (first_byte ? first_byte : end) - start);
+    metrics_record(metrics, t_stats->id, METRIC_SERVICE, req_class, end - start);
 }
@@ -2,14 +2,9 @@
 #define __REQUEST_H__
 
 #include "log.h"
-
-typedef struct Threads_stats {
-    int id;           // Thread ID
-    int stat_req;     // Number of static requests handled
-    int dynm_req;     // Number of dynamic requests handled
-    int post_req;     // Number of POST requests handled
-    int total_req;    // Total number of requests handled
-} * threads_stats;
+#include "log_stream.h"
+#include "metrics.h"
+#include "stats.h"
 
 // Handles a client request.
 // - fd: the connection socket
@@ -17,14 +12,20 @@ typedef struct Threads_stats {
 // - dispatch: time the thread began processing the request
 // - t_stats: pointer to the current thread's statistics (must be updated by student)
 // - log: server-wide shared log (thread-safe access required)
+// - stream: serves POST ?follow=1 subscriptions to the log (may be NULL)
+// - metrics: latency histograms, recorded per request and served on GET /metrics (may be NULL)
 // - must correctly track and update per-thread statistics inside the request handler.
-// - Update the following fields in `threads_stats`:
+// - Count each request with stats_count (see stats.h); it updates these fields of `threads_stats`:
 //   - total_req
 //   - stat_req (for static requests)
 //   - dynm_req (for dynamic requests)
 //   - post_req (for POST requests)
 // - These values should reflect accurate request processing for each thread and be used in response headers/logs.
 
-void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log);
+// Answers 503 Service Unavailable without blocking, for a connection the
+// server has no room for. The caller closes fd.
+void requestReject(int fd);
+
+void requestHandle(int fd, struct timeval arrival, struct timeval dispatch, threads_stats t_stats, server_log log, log_stream stream, server_metrics metrics);
 
 #endif
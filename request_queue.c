@@ -2,9 +2,16 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 
 struct request_queue_t* create_queue(int capacity) {
+    return create_queue_with_order(capacity, QUEUE_FIFO);
+}
+
+struct request_queue_t* create_queue_with_order(int capacity, int order) {
     struct request_queue_t* queue = malloc(sizeof(struct request_queue_t));
     if (!queue) return NULL;
 
@@ -12,6 +19,27 @@ struct request_queue_t* create_queue(int capacity) {
     queue->tail = NULL;
     queue->size = 0;
     queue->capacity = capacity;
+    queue->order = order;
+    queue->seed = (unsigned int)time(NULL);
+    // A secret key, so clients cannot pick addresses that share a victim's
+    // flow. Fixed for the queue's life: a source must keep to its flow.
+    if (getrandom(&queue->hash_key, sizeof(queue->hash_key), GRND_NONBLOCK) != sizeof(queue->hash_key)) {
+        queue->hash_key = (unsigned long)time(NULL) * 0x9e3779b97f4a7c15UL ^ (unsigned long)getpid() ^
+                          (unsigned long)queue;
+    }
+    queue->flows = NULL;
+    queue->active_head = NULL;
+    queue->active_tail = NULL;
+    if (order == QUEUE_FAIR) {
+        queue->flows = calloc(QUEUE_FAIR_FLOWS, sizeof(struct queue_flow));
+        if (!queue->flows) {
+            free(queue);
+            return NULL;
+        }
+        // Unknown costs start at the most a request may cost, so a new
+        // source gets one request per turn until it is measured
+        for (int i = 0; i < QUEUE_FAIR_FLOWS; i++) queue->flows[i].cost = QUEUE_FAIR_QUANTUM;
+    }
 
     pthread_mutex_init(&(queue->mutex), NULL);
     pthread_cond_init(&queue->not_empty, NULL);
@@ -33,9 +61,97 @@ void queue_destroy(struct request_queue_t *queue) {
         free(current);
         current = next;
     }
+    free(queue->flows);
     free(queue);
 }
 
+// Takes a request out of the queue, wherever it is (lock held)
+static void unlink_request(struct request_queue_t *queue, struct request_t *request) {
+    if (request->prev) {
+        request->prev->next = request->next;
+    } else {
+        queue->head = request->next;
+    }
+    if (request->next) {
+        request->next->prev = request->prev;
+    } else {
+        queue->tail = request->prev;
+    }
+    queue->size--;
+
+    struct queue_flow *flow = request->flow;
+    if (!flow) return;
+    if (request->flow_prev) {
+        request->flow_prev->flow_next = request->flow_next;
+    } else {
+        flow->head = request->flow_next;
+    }
+    if (request->flow_next) {
+        request->flow_next->flow_prev = request->flow_prev;
+    } else {
+        flow->tail = request->flow_prev;
+    }
+    flow->size--;
+    // An emptied flow stays on the active list until its turn comes round
+    // (see fair_take), so eviction need not search the list
+}
+
+// The flow a source's requests go to: the key is mixed into every bit of
+// the hash, so which sources share a flow cannot be guessed without it
+static struct queue_flow *flow_of(struct request_queue_t *queue, unsigned int source) {
+    unsigned long hash = (source ^ queue->hash_key) * 0x9e3779b97f4a7c15UL;
+    hash ^= hash >> 32;
+    hash *= 0xbf58476d1ce4e5b9UL;
+    hash ^= hash >> 29;
+    return &queue->flows[hash % QUEUE_FAIR_FLOWS];
+}
+
+// Takes the next request by deficit round robin (lock held, queue not empty)
+static struct request_t *fair_take(struct request_queue_t *queue) {
+    while (1) {
+        struct queue_flow *flow = queue->active_head;
+        if (flow->size > 0) {
+            long cost = flow->cost < QUEUE_FAIR_QUANTUM ? flow->cost : QUEUE_FAIR_QUANTUM;
+            if (flow->deficit >= cost) {
+                flow->deficit -= cost;
+                struct request_t *request = flow->head;
+                unlink_request(queue, request);
+                if (flow->size > 0) return request;
+                // Done for now; it starts afresh when its source is back
+                queue->active_head = flow->next_active;
+                if (!queue->active_head) queue->active_tail = NULL;
+                flow->active = 0;
+                flow->deficit = 0;
+                return request;
+            }
+            // Its turn is over: the next one's quantum, then the back of the line
+            flow->deficit += QUEUE_FAIR_QUANTUM;
+            if (flow->next_active) {
+                queue->active_head = flow->next_active;
+                flow->next_active = NULL;
+                queue->active_tail->next_active = flow;
+                queue->active_tail = flow;
+            }
+            continue;
+        }
+        // Emptied by evictions
+        queue->active_head = flow->next_active;
+        if (!queue->active_head) queue->active_tail = NULL;
+        flow->next_active = NULL;
+        flow->active = 0;
+        flow->deficit = 0;
+    }
+}
+
+// The oldest request of the flow holding the most (lock held, queue not empty)
+static struct request_t *fattest_head(struct request_queue_t *queue) {
+    struct queue_flow *fattest = NULL;
+    for (struct queue_flow *flow = queue->active_head; flow; flow = flow->next_active) {
+        if (!fattest || flow->size > fattest->size) fattest = flow;
+    }
+    return fattest->head;
+}
+
 struct request_t* queue_dequeue(struct request_queue_t *queue) {
     pthread_mutex_lock(&queue->mutex);
 
@@ -44,30 +160,68 @@ struct request_t* queue_dequeue(struct request_queue_t *queue) {
         pthread_cond_wait(&queue->not_empty, &queue->mutex);
     }
 
-    // Get request
-    struct request_t* request = queue->head;
-
-    // Update queue pointers
-    if (queue->size == 1) {
-        queue->head = NULL;
-        queue->tail = NULL;
+    // Get request: the oldest, the newest for LIFO, or the next flow's
+    struct request_t* request;
+    if (queue->order == QUEUE_FAIR) {
+        request = fair_take(queue);
     } else {
-        queue->head = request->next;
+        request = queue->order == QUEUE_LIFO ? queue->tail : queue->head;
+        unlink_request(queue, request);
     }
 
-    queue->size--;
-
-    // Signal if queue was full before dequeuing
-    if (queue->size == queue->capacity - 1) {
-        pthread_cond_signal(&queue->not_full);
-    }
+    // One free slot, one waiting producer
+    pthread_cond_signal(&queue->not_full);
 
     pthread_mutex_unlock(&queue->mutex);
     return request;
 }
 
-int queue_enqueue(struct request_queue_t *queue, int connfd, struct timeval arrival) {
+int queue_enqueue(struct request_queue_t *queue, int connfd, struct timeval arrival, long arrival_mono) {
+    return queue_offer(queue, connfd, arrival, arrival_mono, 0, QUEUE_BLOCK, NULL);
+}
+
+void queue_charge(struct request_queue_t *queue, struct request_t *request, long service_usec) {
+    struct queue_flow *flow = request->flow;
+    if (!flow) return;
     pthread_mutex_lock(&queue->mutex);
+    // Moving average over about the last 8 requests
+    flow->cost += (service_usec - flow->cost) / 8;
+    if (flow->cost < 1) flow->cost = 1;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+int queue_offer(struct request_queue_t *queue, int connfd, struct timeval arrival, long arrival_mono,
+                unsigned int source, int policy, struct request_t **evicted) {
+    if (evicted) *evicted = NULL;
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->size == queue->capacity && policy == QUEUE_DROP_TAIL) {
+        pthread_mutex_unlock(&queue->mutex);
+        return 1;
+    }
+    if (queue->size == queue->capacity && policy == QUEUE_DROP_HEAD) {
+        struct request_t *oldest = queue->flows ? fattest_head(queue) : queue->head;
+        unlink_request(queue, oldest);
+        oldest->next = NULL;
+        *evicted = oldest;
+    }
+    if (queue->size == queue->capacity && policy == QUEUE_DROP_RANDOM) {
+        // Each request goes with probability (still to drop) / (still to see),
+        // which drops exactly half, rounded up
+        int drop = (queue->size + 1) / 2, left = queue->size;
+        struct request_t *current = queue->head;
+        while (current && drop > 0) {
+            struct request_t *next = current->next;
+            if ((int)(rand_r(&queue->seed) % left) < drop) {
+                unlink_request(queue, current);
+                current->next = *evicted;
+                *evicted = current;
+                drop--;
+            }
+            left--;
+            current = next;
+        }
+    }
 
     // Wait until the queue is not full
     while (queue->size == queue->capacity) {
@@ -84,19 +238,49 @@ int queue_enqueue(struct request_queue_t *queue, int connfd, struct timeval arri
     // Copy data to new request
     new_request->connfd = connfd;
     new_request->arrival = arrival;
+    new_request->arrival_mono = arrival_mono;
     new_request->next = NULL;
-    gettimeofday(&arrival, NULL);
+    new_request->prev = queue->tail;
     // Add to queue
     if (queue->size == 0) {
         queue->head = new_request;
         queue->tail = new_request;
-        pthread_cond_signal(&queue->not_empty);
     } else {
         queue->tail->next = new_request;
         queue->tail = new_request;
     }
+    new_request->flow = NULL;
+    new_request->flow_next = NULL;
+    new_request->flow_prev = NULL;
+    if (queue->flows) {
+        struct queue_flow *flow = flow_of(queue, source);
+        new_request->flow = flow;
+        new_request->flow_prev = flow->tail;
+        if (flow->tail) {
+            flow->tail->flow_next = new_request;
+        } else {
+            flow->head = new_request;
+        }
+        flow->tail = new_request;
+        flow->size++;
+        if (!flow->active) {
+            // Joins the back of the line with a full quantum
+            flow->active = 1;
+            flow->deficit = QUEUE_FAIR_QUANTUM;
+            flow->next_active = NULL;
+            if (queue->active_tail) {
+                queue->active_tail->next_active = flow;
+            } else {
+                queue->active_head = flow;
+            }
+            queue->active_tail = flow;
+        }
+    }
 
     queue->size++;
+    // Signalled for every request, not just the first: several can arrive
+    // before a worker wakes, and each needs a worker of its own
+    pthread_cond_signal(&queue->not_empty);
     pthread_mutex_unlock(&queue->mutex);
     return 0;
 }
\ No newline at end of file
@@ -8,8 +8,25 @@
 
 typedef struct request_t {
     int connfd;
-    struct timeval arrival;  // Time the request arrived
+    struct timeval arrival;  // Time the request arrived (wall clock)
+    long arrival_mono;       // The same instant on CLOCK_MONOTONIC (microseconds)
     struct request_t *next; // Pointer to the next request in the queue
+    struct request_t *prev; // Pointer to the previous (older) request
+    struct queue_flow *flow;        // QUEUE_FAIR: its source's flow
+    struct request_t *flow_next;    // QUEUE_FAIR: the flow's next (newer) request
+    struct request_t *flow_prev;    // QUEUE_FAIR: the flow's previous (older) request
+};
+
+// QUEUE_FAIR: the requests of the sources that hash to one bucket, served
+// in turn with the other flows by deficit round robin
+struct queue_flow {
+    struct request_t *head;         // Oldest request
+    struct request_t *tail;         // Newest request
+    int size;
+    long deficit;                   // Service (microseconds) it may still take this round
+    long cost;                      // Average service of its requests (microseconds)
+    int active;                     // On the active list
+    struct queue_flow *next_active;
 };
 
 
@@ -18,17 +35,67 @@ typedef struct request_queue_t{
     struct request_t *tail;       // pointer to the newest
     int size;                    // current size of the queue
     int capacity;               // maximum capacity of the queue
+    int order;                 // QUEUE_FIFO, QUEUE_LIFO or QUEUE_FAIR (DRR)
+    unsigned int seed;         // QUEUE_DROP_RANDOM's rand_r state
+    unsigned long hash_key;    // QUEUE_FAIR: keys the source hash; never changes
+    struct queue_flow *flows;        // QUEUE_FAIR: QUEUE_FAIR_FLOWS buckets, else NULL
+    struct queue_flow *active_head;  // QUEUE_FAIR: flows with requests, in turn
+    struct queue_flow *active_tail;
     pthread_mutex_t mutex;     // Mutex for thread-safe access
     pthread_cond_t not_empty; // Condition variable for when the queue is not empty
     pthread_cond_t not_full; // Condition variable for when the queue is not full
 };
 
+// Which request queue_dequeue hands out: the oldest, or the newest. Under
+// overload LIFO serves the requests whose clients are still waiting first,
+// and lets the old ones time out.
+#define QUEUE_FIFO 0
+#define QUEUE_LIFO 1
+// Fair queuing by source: each source address hashes to one of a fixed
+// QUEUE_FAIR_FLOWS flows (sources may share one, as in SFQ), each flow is
+// FIFO, and the flows take turns by deficit round robin (Shreedhar and
+// Varghese). A turn adds QUEUE_FAIR_QUANTUM microseconds to the flow's
+// deficit, and each request it serves costs its flow's average service time
+// as reported by queue_charge, capped at the quantum, so every flow with
+// requests gets an equal share of worker time whatever its requests cost.
+// Flows with requests are on a FIFO active list, so a dequeue is O(1)
+// amortized however many sources there are.
+#define QUEUE_FAIR 2
+
+#define QUEUE_FAIR_FLOWS   1024
+#define QUEUE_FAIR_QUANTUM 10000
+
+// What queue_offer does when the queue is full
+#define QUEUE_BLOCK       0  // Wait for room, as queue_enqueue does
+#define QUEUE_DROP_TAIL   1  // Refuse the new request
+#define QUEUE_DROP_HEAD   2  // Evict the oldest queued request (QUEUE_FAIR:
+                             // the oldest of the flow holding the most)
+#define QUEUE_DROP_RANDOM 3  // Evict a random half of the queued requests
+
 void queue_destroy(struct request_queue_t *queue);
 
-int queue_enqueue(struct request_queue_t *queue, int connfd, struct timeval arrival);
+int queue_enqueue(struct request_queue_t *queue, int connfd, struct timeval arrival, long arrival_mono);
+
+// Adds a request, or handles a full queue as policy says. Requests evicted
+// to make room are unlinked and returned in *evicted, a list through next
+// (NULL if none); the caller closes their connections and frees them.
+// Returns 0 if the request was queued, 1 if it was refused, -1 if it could
+// not be allocated.
+// source identifies the client, e.g. its IPv4 address; only QUEUE_FAIR
+// uses it.
+int queue_offer(struct request_queue_t *queue, int connfd, struct timeval arrival, long arrival_mono,
+                unsigned int source, int policy, struct request_t **evicted);
 
 struct request_t* queue_dequeue(struct request_queue_t *queue); // TODO: change the return value
 
+// Reports that a dequeued request took service_usec to serve, which QUEUE_FAIR
+// charges to its flow's later requests; call before freeing it. No-op for
+// other orders.
+void queue_charge(struct request_queue_t *queue, struct request_t *request, long service_usec);
+
 struct request_queue_t* create_queue(int capacity);
 
+// Creates a queue that hands out requests in the given order (QUEUE_*)
+struct request_queue_t* create_queue_with_order(int capacity, int order);
+
 #endif //OS_HW3_REQUEST_QUEUE_H
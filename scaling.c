@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "loadgen.h"
+#include "clock.h"
+
+//
+// scaling.c: End-to-end scaling sweep of the server.
+// Starts the server once for every cell of a grid of worker counts, queue
+// sizes and workload mixes, drives it with the load generator (see loadgen.h)
+// as a closed loop, and reports each cell's throughput, latency and the CPU
+// the server used (its workers and their CGI children).
+//
+// To run:
+//  make sweep [SWEEP_ARGS="--threads 1,4 --mixes static,post"] > scaling.csv
+//  ./scaling [options]
+//
+// Options:
+//  --threads LIST      worker pool sizes to try (default 1,2,4,8)
+//  --queues LIST       queue sizes to try (default 1,16,256)
+//  --mixes LIST        workloads to try, of static, cgi and post (default all)
+//  --duration SEC      load per cell (default 5)
+//  --connections N     requests in flight (default 64)
+//  --client-threads N  load generator threads (default 1)
+//  --port N            port the server listens on (default 8190)
+//  --server PATH       server binary (default ./server)
+//  --json FILE         also write the report to FILE as JSON
+//
+// The CSV report goes to stdout, progress to stderr.
+//
+
+// Most values in a LIST option
+#define SCALING_MAX_LIST 16
+// How long a server may take to start listening (milliseconds)
+#define SCALING_START_MS 5000
+// A cell counts towards the best setting only if at most this share of its
+// requests failed
+#define SCALING_MAX_ERRORS 0.01
+
+struct Scaling_mix {
+    const char* name;
+    const char* specs[3];   // Request mix entries (see loadgen_parse_request)
+};
+
+static const struct Scaling_mix all_mixes[] = {
+    {"static", {"GET /home.html", NULL}},
+    // Each CGI request forks and execs a program that sleeps 10ms: workers
+    // block, as on a slow backend
+    {"cgi", {"GET /output.cgi?0.01 4", "GET /home.html 1", NULL}},
+    // Every POST returns the whole log, which grows by a stat per request
+    {"post", {"POST /log 4", "GET /home.html 1", NULL}},
+};
+#define SCALING_MIXES ((int)(sizeof(all_mixes) / sizeof(all_mixes[0])))
+
+// One cell of the grid, and what it measured
+struct Scaling_cell {
+    const struct Scaling_mix* mix;
+    int threads;
+    int queue_size;
+    struct Loadgen_report report;
+    double cpu;             // Server CPU seconds, children included
+};
+
+static int parse_list(char* text, int* values) {
+    int n = 0;
+    for (char* token = strtok(text, ","); token; token = strtok(NULL, ",")) {
+        if (n == SCALING_MAX_LIST) return -1;
+        values[n] = atoi(token);
+        if (values[n++] <= 0) return -1;
+    }
+    return n;
+}
+
+// CPU seconds a process and its waited-for children used so far, from
+// /proc/PID/stat; -1 if it cannot be read
+static double process_cpu(pid_t pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+    // The command name may hold spaces; the fields after it are plain
+    char* fields = strrchr(buf, ')');
+    unsigned long utime, stime;
+    long cutime, cstime;
+    if (!fields || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+                          &utime, &stime, &cutime, &cstime) != 4) {
+        return -1;
+    }
+    return (double)(utime + stime + cutime + cstime) / sysconf(_SC_CLK_TCK);
+}
+
+// Starts the server and waits until it accepts connections. Returns its
+// pid, or -1 if it did not come up.
+static pid_t start_server(const char* server, int port, int threads, int queue_size) {
+    char port_arg[16], threads_arg[16], queue_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    snprintf(queue_arg, sizeof(queue_arg), "%d", queue_size);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(server, server, port_arg, threads_arg, queue_arg, (char*)NULL);
+        _exit(127);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (long deadline = monotonic_usec() + SCALING_START_MS * 1000L; monotonic_usec() < deadline; usleep(10000)) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "%s exited at startup (is port %d free?)\n", server, port);
+            return -1;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) break;
+        int up = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (up) return pid;
+    }
+    fprintf(stderr, "%s did not start listening on port %d\n", server, port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGKILL);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+}
+
+// Runs one cell; returns -1 if the server or the load did not start
+static int run_cell(const char* server, struct Loadgen_config* config, struct Scaling_cell* cell) {
+    pid_t pid = start_server(server, config->port, cell->threads, cell->queue_size);
+    if (pid < 0) return -1;
+    // The mix is parsed in place, so each cell parses a fresh copy
+    struct Loadgen_request mix[3];
+    char* specs[3];
+    int mix_len = 0;
+    for (; cell->mix->specs[mix_len]; mix_len++) {
+        specs[mix_len] = strdup(cell->mix->specs[mix_len]);
+        if (!specs[mix_len] || loadgen_parse_request(specs[mix_len], &mix[mix_len]) < 0) {
+            perror("Malloc failed");
+            exit(1);
+        }
+    }
+    config->mix = mix;
+    config->mix_len = mix_len;
+
+    double cpu_before = process_cpu(pid);
+    int err = loadgen_measure(config, &cell->report);
+    double cpu_after = process_cpu(pid);
+    cell->cpu = cpu_before >= 0 && cpu_after >= 0 ? cpu_after - cpu_before : -1;
+    stop_server(pid);
+    for (int i = 0; i < mix_len; i++) free(specs[i]);
+    config->mix = NULL;
+    return err;
+}
+
+static void print_csv_header() {
+    printf("mix,threads,queue_size,throughput_rps,completed,errors,mean_ms,p50_ms,p90_ms,p99_ms,p999_ms,max_ms,"
+           "server_cpu_s,server_cores,cpu_us_per_request\n");
+}
+
+static void print_csv_row(const struct Scaling_cell* cell) {
+    const struct Loadgen_report* r = &cell->report;
+    printf("%s,%d,%d,%.1f,%ld,%ld,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+           cell->mix->name, cell->threads, cell->queue_size, r->throughput, r->completed, r->errors,
+           r->mean_ms, r->p50_ms, r->p90_ms, r->p99_ms, r->p999_ms, r->max_ms, cell->cpu,
+           r->elapsed > 0 ? cell->cpu / r->elapsed : 0, r->completed ? cell->cpu * 1e6 / r->completed : 0);
+    fflush(stdout);
+}
+
+// Whether a cell is a candidate for its mix's best setting
+static int cell_ok(const struct Scaling_cell* cell) {
+    const struct Loadgen_report* r = &cell->report;
+    return r->completed > 0 && r->errors <= SCALING_MAX_ERRORS * (r->completed + r->errors);
+}
+
+static void write_json(const char* path, const struct Loadgen_config* config, const struct Scaling_cell* cells,
+                       int count) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return;
+    }
+    fprintf(out, "{\n  \"config\": {\"duration\": %.3f, \"connections\": %d, \"client_threads\": %d},\n",
+            config->duration, config->connections, config->threads);
+    fprintf(out, "  \"cells\": [\n");
+    for (int i = 0; i < count; i++) {
+        const struct Scaling_cell* cell = &cells[i];
+        const struct Loadgen_report* r = &cell->report;
+        fprintf(out, "    {\"mix\": \"%s\", \"threads\": %d, \"queue_size\": %d, \"throughput_rps\": %.3f, "
+                     "\"completed\": %ld, \"errors\": %ld, \"status\": {\"2xx\": %ld, \"3xx\": %ld, \"4xx\": %ld, "
+                     "\"5xx\": %ld}, \"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                     "\"p999\": %.3f, \"max\": %.3f}, \"server_cpu_s\": %.3f, \"server_cores\": %.3f}%s\n",
+                cell->mix->name, cell->threads, cell->queue_size, r->throughput, r->completed, r->errors,
+                r->status[2], r->status[3], r->status[4], r->status[5], r->mean_ms, r->p50_ms, r->p90_ms,
+                r->p99_ms, r->p999_ms, r->max_ms, cell->cpu, r->elapsed > 0 ? cell->cpu / r->elapsed : 0,
+                i + 1 < count ? "," : "");
+    }
+    // Per mix: the most throughput, then the lowest p99
+    fprintf(out, "  ],\n  \"best\": {");
+    int first = 1;
+    for (int m = 0; m < SCALING_MIXES; m++) {
+        const struct Scaling_cell* best = NULL;
+        for (int i = 0; i < count; i++) {
+            const struct Scaling_cell* cell = &cells[i];
+            if (cell->mix != &all_mixes[m] || !cell_ok(cell)) continue;
+            if (!best || cell->report.throughput > best->report.throughput ||
+                (cell->report.throughput == best->report.throughput && cell->report.p99_ms < best->report.p99_ms)) {
+                best = cell;
+            }
+        }
+        if (!best) continue;
+        fprintf(out, "%s\n    \"%s\": {\"threads\": %d, \"queue_size\": %d, \"throughput_rps\": %.3f, \"p99_ms\": %.3f}",
+                first ? "" : ",", best->mix->name, best->threads, best->queue_size, best->report.throughput,
+                best->report.p99_ms);
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+    fclose(out);
+}
+
+static void usage(char* prog) {
+    fprintf(stderr, "Usage: %s [--threads LIST] [--queues LIST] [--mixes LIST] [--duration SEC]\n"
+                    "       [--connections N] [--client-threads N] [--port N] [--server PATH] [--json FILE]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"threads",        required_argument, NULL, 't'},
+        {"queues",         required_argument, NULL, 'q'},
+        {"mixes",          required_argument, NULL, 'm'},
+        {"duration",       required_argument, NULL, 'd'},
+        {"connections",    required_argument, NULL, 'c'},
+        {"client-threads", required_argument, NULL, 'C'},
+        {"port",           required_argument, NULL, 'p'},
+        {"server",         required_argument, NULL, 's'},
+        {"json",           required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0}
+    };
+    int threads[SCALING_MAX_LIST] = {1, 2, 4, 8}, queues[SCALING_MAX_LIST] = {1, 16, 256};
+    int thread_count = 4, queue_count = 3;
+    const struct Scaling_mix* mixes[SCALING_MIXES];
+    int mix_count = 0;
+    const char* server = "./server";
+    const char* json_path = NULL;
+    struct Loadgen_config config;
+    memset(&config, 0, sizeof(config));
+    config.host = "127.0.0.1";
+    config.port = 8190;
+    config.threads = 1;
+    config.connections = 64;
+    config.duration = 5;
+    config.timeout = 30;
+    config.pipeline = 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                if ((thread_count = parse_list(optarg, threads)) <= 0) usage(argv[0]);
+                break;
+            case 'q':
+                if ((queue_count = parse_list(optarg, queues)) <= 0) usage(argv[0]);
+                break;
+            case 'm':
+                for (char* name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+                    int m = 0;
+                    while (m < SCALING_MIXES && strcmp(all_mixes[m].name, name)) m++;
+                    if (m == SCALING_MIXES || mix_count == SCALING_MIXES) usage(argv[0]);
+                    mixes[mix_count++] = &all_mixes[m];
+                }
+                break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'C': config.threads = atoi(optarg); break;
+            case 'p': config.port = atoi(optarg); break;
+            case 's': server = optarg; break;
+            case 'j': json_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || config.duration <= 0 || config.connections <= 0 || config.threads <= 0) usage(argv[0]);
+    if (!mix_count) {
+        for (; mix_count < SCALING_MIXES; mix_count++) mixes[mix_count] = &all_mixes[mix_count];
+    }
+    int count = mix_count * thread_count * queue_count;
+    struct Scaling_cell* cells = (struct Scaling_cell*)calloc(count, sizeof(struct Scaling_cell));
+    if (!cells) {
+        perror("Malloc failed");
+        return 1;
+    }
+    print_csv_header();
+    int started = 0, done = 0;
+    for (int m = 0; m < mix_count; m++) {
+        for (int t = 0; t < thread_count; t++) {
+            for (int q = 0; q < queue_count; q++) {
+                struct Scaling_cell* cell = &cells[done];
+                cell->mix = mixes[m];
+                cell->threads = threads[t];
+                cell->queue_size = queues[q];
+                fprintf(stderr, "[%d/%d] %s, %d threads, queue %d\n", ++started, count, cell->mix->name,
+                        cell->threads, cell->queue_size);
+                if (run_cell(server, &config, cell) < 0) continue;
+                print_csv_row(cell);
+                done++;
+            }
+        }
+    }
+    if (json_path) write_json(json_path, &config, cells, done);
+    free(cells);
+    return done == count ? 0 : 1;
+}
@@ -435,8 +435,12 @@ ssize_t Rio_readn(int fd, void *ptr, size_t nbytes)
 
 void Rio_writen(int fd, void *usrbuf, size_t n) 
 {
-    if (rio_writen(fd, usrbuf, n) != n)
+    if (rio_writen(fd, usrbuf, n) != n) {
+        /* The peer closed the connection; that is its business, not ours */
+        if (errno == EPIPE || errno == ECONNRESET)
+            return;
         unix_error("Rio_writen error");
+    }
 }
 
 void Rio_readinitb(rio_t *rp, int fd)
@@ -457,8 +461,11 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
     ssize_t rc;
 
-    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0)
+    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0) {
+        if (errno == ECONNRESET)
+            return 0;   /* A reset reads as EOF */
         unix_error("Rio_readlineb error");
+    }
     return rc;
 } 
 
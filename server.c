@@ -1,55 +1,455 @@
+#define _GNU_SOURCE
 #include "segel.h"
 #include "request.h"
 #include "log.h"
 #include "request_queue.h" // to add later
+#include "trace.h"
+#include "profile.h"
+#include "signal_dump.h"
+#include "limiter.h"
+#include "clock.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <sched.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
 //
 // server.c: A very, very simple web server
 //
 // To run:
-//  ./server <portnum (above 2000)>
+//  ./server <portnum (above 2000)> [threads [queue_size]] [options]
+//
+// threads is the worker pool size (default 4) and queue_size the most
+// accepted connections waiting for a worker (default 10).
+//
+// Options:
+//  --threads N|auto      worker pool size; auto sizes it to the online CPUs,
+//                        stretched by the CGI ratio: ncpu / (1 - ratio)
+//  --queue-size N|auto   most connections waiting for a worker; auto is
+//                        twice the pool
+//  --cgi-ratio R         share of a worker's time spent waiting on CGI
+//                        children, 0 <= R < 1 (default 0; used by auto)
+//  --overload POLICY     what a connection arriving at a full queue gets:
+//                        block (default; accept no more until there is room),
+//                        drop-tail (closed), drop-head (the oldest waiting one
+//                        is closed instead), drop-random (half the waiting
+//                        ones, picked at random, are closed) or reject (503)
+//  --limit off|aimd|gradient
+//                        cap the requests in flight (queued or being served)
+//                        at a limit that adapts to their latency, and answer
+//                        the rest 503 on arrival instead of queueing them
+//                        (see limiter.h; default off)
+//  --limit-max N         highest limit (default threads + queue_size)
+//  --limit-target-ms MS  latency over which aimd backs off (default 100)
+//  --sched fifo|lifo|fair
+//                        which waiting connection a free worker takes
+//                        (default fifo; lifo serves the newest first; fair
+//                        gives each client address an equal share of the
+//                        workers' time by deficit round robin, so one
+//                        flooding client does not hold up the rest)
+//  --cpus LIST|auto      pin worker i and acceptor i to the i-th CPU of LIST
+//                        (e.g. "0-3,8"), wrapping around; auto is every CPU
+//                        the server may run on. A thread allocates its own
+//                        buffers and histograms once pinned, so they are
+//                        local to its CPU's NUMA node
+//  --acceptors N         accept on N threads (default 1), each with its own
+//                        SO_REUSEPORT listening socket and request queue,
+//                        served by workers i with i % N equal to its number.
+//                        With --cpus each socket asks the kernel, through
+//                        SO_INCOMING_CPU, for the connections whose packets
+//                        arrive on its acceptor's CPU, so with as many CPUs
+//                        as acceptors a connection stays on the core its NIC
+//                        queue interrupts
+//  --config FILE         read options from FILE, one "key value" (or
+//                        "key = value") per line, keys named as the long
+//                        options; '#' starts a comment. Later options and
+//                        positional arguments override it. A config file
+//                        cannot name another one
+//  --log-max-entries N   keep about the newest N log entries
+//  --log-max-bytes N     cap log memory at N bytes (fixed ring per worker)
+//  --log-max-age SECONDS drop log entries older than SECONDS
+//  --log-dir DIR         keep the log in mmap'd segment files under DIR and
+//                        recover it from there on startup
+//  --log-segment-size N  roll over to a new segment file every N bytes
+//  --log-sync-ms MS      fsync the segments every MS milliseconds (default 1000)
+//  --log-sync-batch N    also fsync once a worker has logged N entries
+//  --log-sync-commit     log a request only once it is on disk; concurrent
+//                        workers share one fsync (group commit)
+//  --trace N             record each worker's newest N request phase spans
+//  --trace-file PATH     where SIGUSR1 dumps the spans (default trace.json)
+//  --profile HZ          sample each worker's stack HZ times per CPU-second
+//  --profile-file PATH   where SIGUSR2 dumps the folded stacks
+//                        (default profile.folded)
+//  --kernel-timestamps   date requests from when the kernel received them
+//                        (SO_TIMESTAMPING), so listen backlog time counts
+//
+// GET /metrics returns per-phase latency histograms in Prometheus text format.
+// GET /trace returns the recorded spans as Chrome trace JSON.
+// GET /profile returns the CPU samples as folded stacks (flamegraph.pl input).
 //
 // Repeatedly handles HTTP requests sent to this port number.
 // Most of the work is done within routines written in request.c
 //
 
-// Parses command-line arguments
-void getargs(int *port, int argc, char *argv[])
+static void usage(char *prog)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-    *port = atoi(argv[1]);
+    fprintf(stderr, "Usage: %s <port> [threads [queue_size]] [--threads N|auto] [--queue-size N|auto] [--cgi-ratio R]\n"
+                    "       [--overload block|drop-tail|drop-head|drop-random|reject] [--sched fifo|lifo|fair]\n"
+                    "       [--limit off|aimd|gradient] [--limit-max N] [--limit-target-ms MS]\n"
+                    "       [--cpus LIST|auto] [--acceptors N] [--config FILE]\n"
+                    "       [--log-max-entries N] [--log-max-bytes N] [--log-max-age SECONDS]\n"
+                    "       [--log-dir DIR] [--log-segment-size N] [--log-sync-ms MS] [--log-sync-batch N]\n"
+                    "       [--log-sync-commit] [--trace N] [--trace-file PATH]\n"
+                    "       [--profile HZ] [--profile-file PATH] [--kernel-timestamps]\n", prog);
+    exit(1);
 }
-// This server currently handles all requests in the main thread.
-// You must implement a thread pool (fixed number of worker threads)
-// that process requests from a synchronized queue.
 
 // define pool size and queue size
 #define POOL_SIZE 4
 #define QUEUE_SIZE 10
+// Most workers --threads auto starts
+#define AUTO_MAX_THREADS 256
+
+// Overload policies beyond the queue's own: turn the connection away with a 503
+#define OVERLOAD_REJECT (-1)
+
+// Server settings that are not the log's
+struct Server_options {
+    int threads;             // Worker pool size (0 = auto)
+    int queue_size;          // Accepted connections waiting for a worker (0 = auto)
+    double cgi_ratio;        // Share of a worker's time spent waiting on CGI
+    int overload;            // QUEUE_BLOCK, QUEUE_DROP_* or OVERLOAD_REJECT
+    int order;               // QUEUE_FIFO, QUEUE_LIFO or QUEUE_FAIR
+    int limit;               // LIMITER_* algorithm for the requests in flight
+    int limit_max;           // Highest limit (0 = threads + queue_size)
+    long limit_target;       // AIMD latency target (microseconds)
+    int *cpus;               // Threads are pinned round-robin to these (NULL = not pinned)
+    int ncpus;
+    int acceptors;           // Listening sockets, each with its own thread and queue
+    int trace_events;        // Spans kept per worker (0 = tracing off)
+    const char *trace_file;  // Dumped here on SIGUSR1
+    int profile_hz;          // Stack samples per CPU-second (0 = profiler off)
+    const char *profile_file;  // Dumped here on SIGUSR2
+    int kernel_timestamps;   // Stamp arrivals with the kernel's receive time
+};
 
+static struct option long_options[] = {
+    {"threads",          required_argument, NULL, 'w'},
+    {"queue-size",       required_argument, NULL, 'q'},
+    {"cgi-ratio",        required_argument, NULL, 'r'},
+    {"overload",         required_argument, NULL, 'o'},
+    {"limit",            required_argument, NULL, 'l'},
+    {"limit-max",        required_argument, NULL, 'L'},
+    {"limit-target-ms",  required_argument, NULL, 'g'},
+    {"sched",            required_argument, NULL, 'S'},
+    {"cpus",             required_argument, NULL, 'C'},
+    {"acceptors",        required_argument, NULL, 'A'},
+    {"config",           required_argument, NULL, 'f'},
+    {"log-max-entries",  required_argument, NULL, 'e'},
+    {"log-max-bytes",    required_argument, NULL, 'b'},
+    {"log-max-age",      required_argument, NULL, 'a'},
+    {"log-dir",          required_argument, NULL, 'd'},
+    {"log-segment-size", required_argument, NULL, 's'},
+    {"log-sync-ms",      required_argument, NULL, 'm'},
+    {"log-sync-batch",   required_argument, NULL, 'n'},
+    {"log-sync-commit",  no_argument,       NULL, 'c'},
+    {"trace",            required_argument, NULL, 't'},
+    {"trace-file",       required_argument, NULL, 'T'},
+    {"profile",          required_argument, NULL, 'p'},
+    {"profile-file",     required_argument, NULL, 'P'},
+    {"kernel-timestamps", no_argument,      NULL, 'k'},
+    {NULL, 0, NULL, 0}
+};
+
+// Parses a pool or queue size: a positive count, or "auto" (0)
+static int parse_size(const char *value)
+{
+    if (!strcmp(value, "auto")) return 0;
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end || n <= 0 || n > 1000000) return -1;
+    return (int)n;
+}
+
+// Parses a CPU list such as "0-3,8" into options->cpus, or for "auto" takes
+// every CPU the server may run on. Returns -1 if it is malformed.
+static int parse_cpus(const char *value, struct Server_options *options)
+{
+    int *cpus = (int *)malloc(CPU_SETSIZE * sizeof(int));
+    int ncpus = 0;
+    if (!cpus) return -1;
+    if (!strcmp(value, "auto")) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+            free(cpus);
+            return -1;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus[ncpus++] = cpu;
+        }
+    } else {
+        const char *p = value;
+        while (*p) {
+            char *end;
+            long first = strtol(p, &end, 10), last = first;
+            if (end == p) break;
+            if (*end == '-') {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p) break;
+            }
+            if (first < 0 || last < first || last >= CPU_SETSIZE ||
+                ncpus + (last - first + 1) > CPU_SETSIZE) break;
+            for (long cpu = first; cpu <= last; cpu++) cpus[ncpus++] = (int)cpu;
+            p = end;
+            if (*p == ',') p++;
+            else if (*p) break;
+        }
+        if (*p) ncpus = 0;
+    }
+    if (ncpus == 0) {
+        free(cpus);
+        return -1;
+    }
+    free(options->cpus);
+    options->cpus = cpus;
+    options->ncpus = ncpus;
+    return 0;
+}
+
+static void read_config(const char *path, char *prog, int *port, struct Log_config *log_config, struct Server_options *options);
+
+// Applies one option, from the command line or a config file. Returns -1 if
+// its value is invalid.
+static int apply_option(int opt, char *value, char *prog, int *port, struct Log_config *log_config, struct Server_options *options)
+{
+    switch (opt) {
+        case 'w': return (options->threads = parse_size(value)) < 0 ? -1 : 0;
+        case 'q': return (options->queue_size = parse_size(value)) < 0 ? -1 : 0;
+        case 'r':
+            options->cgi_ratio = atof(value);
+            return options->cgi_ratio >= 0 && options->cgi_ratio < 1 ? 0 : -1;
+        case 'o':
+            if (!strcmp(value, "block")) options->overload = QUEUE_BLOCK;
+            else if (!strcmp(value, "drop-tail")) options->overload = QUEUE_DROP_TAIL;
+            else if (!strcmp(value, "drop-head")) options->overload = QUEUE_DROP_HEAD;
+            else if (!strcmp(value, "drop-random")) options->overload = QUEUE_DROP_RANDOM;
+            else if (!strcmp(value, "reject")) options->overload = OVERLOAD_REJECT;
+            else return -1;
+            return 0;
+        case 'S':
+            if (!strcmp(value, "fifo")) options->order = QUEUE_FIFO;
+            else if (!strcmp(value, "lifo")) options->order = QUEUE_LIFO;
+            else if (!strcmp(value, "fair")) options->order = QUEUE_FAIR;
+            else return -1;
+            return 0;
+        case 'l':
+            if (!strcmp(value, "off")) options->limit = LIMITER_OFF;
+            else if (!strcmp(value, "aimd")) options->limit = LIMITER_AIMD;
+            else if (!strcmp(value, "gradient")) options->limit = LIMITER_GRADIENT;
+            else return -1;
+            return 0;
+        case 'L': return (options->limit_max = atoi(value)) > 0 ? 0 : -1;
+        case 'g':
+            options->limit_target = (long)(atof(value) * 1000);
+            return options->limit_target > 0 ? 0 : -1;
+        case 'C': return parse_cpus(value, options);
+        case 'A':
+            options->acceptors = atoi(value);
+            return options->acceptors > 0 && options->acceptors <= 1024 ? 0 : -1;
+        case 'f': read_config(value, prog, port, log_config, options); return 0;
+        case 'e': log_config->max_entries = atol(value); return 0;
+        case 'b': log_config->max_bytes = atol(value); return 0;
+        case 'a': log_config->max_age = atoi(value); return 0;
+        case 'd': log_config->dir = value; return 0;
+        case 's': log_config->segment_size = atol(value); return 0;
+        case 'm': log_config->sync_interval_ms = atoi(value); return 0;
+        case 'n': log_config->sync_batch = atoi(value); return 0;
+        case 'c': log_config->sync_commit = 1; return 0;
+        case 't': options->trace_events = atoi(value); return 0;
+        case 'T': options->trace_file = value; return 0;
+        case 'p': options->profile_hz = atoi(value); return 0;
+        case 'P': options->profile_file = value; return 0;
+        case 'k': options->kernel_timestamps = 1; return 0;
+        default: return -1;
+    }
+}
+
+// Applies the options in a config file. A line is "key value" or
+// "key = value", with key a long option's name (other than config) or
+// "port"; a flag's value, if any, must be true, yes or 1. '#' starts a
+// comment.
+static void read_config(const char *path, char *prog, int *port, struct Log_config *log_config, struct Server_options *options)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    while (getline(&line, &cap, file) >= 0) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (!*key) continue;
+        char *value = key;
+        while (*value && !isspace((unsigned char)*value) && *value != '=') value++;
+        char *key_end = value;
+        while (isspace((unsigned char)*value)) value++;
+        if (*value == '=') value++;
+        while (isspace((unsigned char)*value)) value++;
+        *key_end = '\0';
+        char *value_end = value + strlen(value);
+        while (value_end > value && isspace((unsigned char)value_end[-1])) *--value_end = '\0';
+
+        int ok = 0;
+        if (!strcmp(key, "port")) {
+            *port = atoi(value);
+            ok = *port > 0;
+        } else {
+            for (struct option *o = long_options; o->name; o++) {
+                if (strcmp(key, o->name)) continue;
+                // Config files do not nest, so none can include itself
+                if (o->val == 'f') break;
+                if (o->has_arg == no_argument) {
+                    ok = !*value || !strcmp(value, "true") || !strcmp(value, "yes") || !strcmp(value, "1");
+                    if (ok) apply_option(o->val, NULL, prog, port, log_config, options);
+                } else if (*value) {
+                    // Options keep pointers to their values
+                    char *copy = strdup(value);
+                    ok = copy && apply_option(o->val, copy, prog, port, log_config, options) == 0;
+                }
+                break;
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: bad option '%s'\n", path, lineno, key);
+            exit(1);
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+// Parses command-line arguments
+void getargs(int *port, struct Log_config *log_config, struct Server_options *options, int argc, char *argv[])
+{
+    int opt;
+
+    memset(log_config, 0, sizeof(*log_config));
+    log_config->sync_interval_ms = 1000;
+    memset(options, 0, sizeof(*options));
+    options->trace_file = "trace.json";
+    options->profile_file = "profile.folded";
+    options->threads = POOL_SIZE;
+    options->queue_size = QUEUE_SIZE;
+    options->overload = QUEUE_BLOCK;
+    options->order = QUEUE_FIFO;
+    options->acceptors = 1;
+    options->limit = LIMITER_OFF;
+    options->limit_target = 100000;
+    *port = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        if (opt == '?' || apply_option(opt, optarg, argv[0], port, log_config, options) < 0) {
+            usage(argv[0]);
+        }
+    }
+    // The port may come from a config file instead
+    if (argc - optind > 3 || (optind >= argc && *port <= 0)) {
+        usage(argv[0]);
+    }
+    if (optind < argc) *port = atoi(argv[optind]);
+    // The pool and queue sizes may follow the port, as test.c and hw3tests pass them
+    if (argc - optind > 1 && (options->threads = parse_size(argv[optind + 1])) < 0) usage(argv[0]);
+    if (argc - optind > 2 && (options->queue_size = parse_size(argv[optind + 2])) < 0) usage(argv[0]);
+
+    // Size "auto" from the CPUs: a worker waiting on a CGI child leaves its
+    // CPU to another, so that share of the time needs more workers to cover
+    if (options->threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu < 1) ncpu = 1;
+        double threads = ncpu / (1 - options->cgi_ratio);
+        if (threads > AUTO_MAX_THREADS) threads = AUTO_MAX_THREADS;
+        options->threads = (int)threads;
+        if (options->threads < threads) options->threads++;   // Round up
+    }
+    if (options->queue_size == 0) {
+        options->queue_size = 2 * options->threads;
+    }
+    // Every acceptor's queue needs a worker
+    if (options->acceptors > options->threads) {
+        fprintf(stderr, "%s: --acceptors %d needs at least as many threads\n", argv[0], options->acceptors);
+        exit(1);
+    }
+}
+
+// Threads: the acceptors (the main thread and any more --acceptors) accept
+// connections and queue them; a fixed pool of workers takes them off the
+// queues and serves them, one request per connection. The log stream's
+// thread serves POST ?follow=1 subscribers once a worker hands them over,
+// the log has a flusher thread when it is kept on disk, --trace and
+// --profile each add a thread that dumps on its signal, and one thread
+// waits for SIGTERM/SIGINT to shut down (see shutdown_thread).
 
 // Thread worker unit
 typedef struct {
     threads_stats stats;
     struct request_queue_t *queue; // create the request queue
     server_log log;
+    log_stream stream;             // Serves POST ?follow=1 subscribers
+    server_metrics metrics;        // Latency histograms for GET /metrics
+    limiter limiter;               // Told when a request ends, or NULL
+    int cpu;                       // Pinned to this CPU, or -1
 
 } worker_unit;
 
-struct timeval calculate_interval(struct timeval start, struct timeval end) {
-    struct timeval temp = end;
-    temp.tv_sec -= start.tv_sec;
-    temp.tv_usec -= start.tv_usec;
-    if (temp.tv_usec < 0) {
-        temp.tv_sec -= 1;
-        temp.tv_usec += 1000000;
+// Accepting thread unit: one listening socket feeding one queue
+typedef struct {
+    int listenfd;
+    int cpu;                       // Pinned to this CPU, or -1
+    struct request_queue_t *queue;
+    server_metrics metrics;        // Counts shed connections
+    limiter limiter;               // Admits connections, or NULL to admit all
+    const struct Server_options *options;
+} acceptor_unit;
+
+// Stamps a connection's arrival, right after Accept, on both clocks. With
+// kernel_ts the arrival moves back to when the kernel received the request's
+// first bytes, if they are already there, so the time the connection spent
+// in the listen backlog is counted too.
+static void stamp_arrival(int connfd, int kernel_ts, struct timeval *arrival, long *arrival_mono)
+{
+    gettimeofday(arrival, NULL);
+    *arrival_mono = monotonic_usec();
+    if (!kernel_ts) return;
+
+    char data, control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {&data, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    // Peek, so the request stays in the socket for the worker
+    if (recvmsg(connfd, &msg, MSG_PEEK | MSG_DONTWAIT) <= 0) return;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING) continue;
+        struct scm_timestamping *ts = (struct scm_timestamping *)CMSG_DATA(cmsg);
+        long received = ts->ts[0].tv_sec * 1000000L + ts->ts[0].tv_nsec / 1000;
+        long now = arrival->tv_sec * 1000000L + arrival->tv_usec;
+        if (received > 0 && received < now) {
+            arrival->tv_sec = received / 1000000;
+            arrival->tv_usec = received % 1000000;
+            *arrival_mono -= now - received;
+        }
     }
-    return temp;
 }
 
 void *worker_thread(void *arg)
@@ -58,81 +458,309 @@ void *worker_thread(void *arg)
     threads_stats t_stats = warg->stats;
     struct request_queue_t *queue = warg->queue;
 
+    // Already on its CPU (see spawn_pinned), so these are NUMA-local
+    metrics_thread_init(warg->metrics, t_stats->id);
+    trace_thread_init();
+    profile_thread_init();
     while(1) {
         // Get a request from the queue
         struct request_t* request = queue_dequeue(queue);
 
-        struct timeval dispatch;
-        gettimeofday(&dispatch, NULL);
-        dispatch = calculate_interval(request->arrival, dispatch);
+        // Time spent queued, on the monotonic clock
+        long waited = monotonic_usec() - request->arrival_mono;
+        struct timeval dispatch = {waited / 1000000, waited % 1000000};
 
         // Process the request
-        requestHandle(request->connfd, request->arrival, dispatch, t_stats, warg->log);
+        long start = monotonic_usec();
+        requestHandle(request->connfd, request->arrival, dispatch, t_stats, warg->log, warg->stream, warg->metrics);
 
         // Close connection
         Close(request->connfd);
+        // Fair queuing bills the client's next requests for this one
+        queue_charge(queue, request, monotonic_usec() - start);
+        if (warg->limiter) limiter_release(warg->limiter, monotonic_usec() - request->arrival_mono);
         free(request);
 
     }
     return NULL;
 }
 
-int main(int argc, char *argv[])
+// Starts a thread, pinned from the outset to cpu unless it is -1, so that
+// its stack and everything it allocates are first touched there
+static void spawn_pinned(pthread_t *thread, int cpu, void *(*start)(void *), void *arg)
 {
-    // Create the global server log
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+            fprintf(stderr, "cannot pin a thread to CPU %d\n", cpu);
+            exit(1);
+        }
+    }
+    int rc = pthread_create(thread, &attr, start, arg);
+    if (rc != 0) {
+        if (cpu >= 0) fprintf(stderr, "Failed to create thread on CPU %d: %s\n", cpu, strerror(rc));
+        else fprintf(stderr, "Failed to create thread: %s\n", strerror(rc));
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+}
 
-    int listenfd, connfd, port, clientlen;
+// Waits for SIGTERM or SIGINT, which every other thread blocks, and exits.
+// Follow subscribers first get the rest of their response and its last
+// chunk, so they see a clean end instead of a cut connection.
+static void *shutdown_thread(void *arg)
+{
+    log_stream stream = (log_stream)arg;
+    sigset_t set;
+    int signo;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigwait(&set, &signo);
+    log_stream_shutdown(stream);
+    exit(0);
+}
+
+// Opens a listening socket on port for an acceptor. Several acceptors share
+// the port through SO_REUSEPORT; one pinned to a CPU asks the kernel for
+// the connections that CPU receives.
+static int open_listener(int port, int shared, int cpu, int kernel_timestamps)
+{
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+        (shared && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)) {
+        unix_error("Open_listenfd error");
+    }
+    if (cpu >= 0 && setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        perror("SO_INCOMING_CPU");
+    }
+    if (kernel_timestamps) {
+        // Accepted connections inherit the option
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (setsockopt(listenfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+            perror("SO_TIMESTAMPING");
+        }
+    }
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        unix_error("Open_listenfd error");
+    }
+    return listenfd;
+}
+
+// Accepts connections on one listening socket and queues them
+static void *acceptor_thread(void *arg)
+{
+    acceptor_unit *unit = (acceptor_unit *)arg;
+    const struct Server_options *options = unit->options;
+    struct request_queue_t *queue = unit->queue;
+    server_metrics metrics = unit->metrics;
+    int connfd, clientlen;
     struct sockaddr_in clientaddr;
     struct timeval arrival;
-    server_log log = create_log();
+    long arrival_mono;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        // Close-on-exec from the start: a CGI child gets its own connection
+        // as stdout and must not also hold the others open, or their clients
+        // wait for it to exit. Setting it after accept would race a fork.
+        if ((connfd = accept4(unit->listenfd, (SA *)&clientaddr, (socklen_t *) &clientlen, SOCK_CLOEXEC)) < 0) {
+            unix_error("Accept error");
+        }
+        stamp_arrival(connfd, options->kernel_timestamps, &arrival, &arrival_mono);
+
+        // Over the concurrency limit: shed now, before it costs a queue slot
+        if (unit->limiter && limiter_acquire(unit->limiter) < 0) {
+            requestReject(connfd);
+            metrics_count_shed(metrics, METRIC_SHED_REJECTED, 1);
+            Close(connfd);
+            continue;
+        }
+
+        // The listener only blocks on a full queue under the block policy
+        int policy = options->overload == OVERLOAD_REJECT ? QUEUE_DROP_TAIL : options->overload;
+        struct request_t *evicted = NULL;
+        int refused = queue_offer(queue, connfd, arrival, arrival_mono, clientaddr.sin_addr.s_addr, policy, &evicted);
+        if (refused) {
+            if (refused > 0 && options->overload == OVERLOAD_REJECT) {
+                requestReject(connfd);
+                metrics_count_shed(metrics, METRIC_SHED_REJECTED, 1);
+            } else {
+                metrics_count_shed(metrics, METRIC_SHED_DROPPED, 1);
+            }
+            Close(connfd);
+            if (unit->limiter) limiter_release(unit->limiter, -1);
+        }
+        // Waiting connections pushed out to make room
+        while (evicted) {
+            struct request_t *next = evicted->next;
+            Close(evicted->connfd);
+            free(evicted);
+            metrics_count_shed(metrics, METRIC_SHED_DROPPED, 1);
+            if (unit->limiter) limiter_release(unit->limiter, -1);
+            evicted = next;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    // Create the global server log
+
+    int port;
+    struct Log_config log_config;
+    struct Server_options options;
+    getargs(&port, &log_config, &options, argc, argv);
+    // A client that hangs up mid-response must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    // Before any thread starts, so that only shutdown_thread takes them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    // Before any thread starts, so that only the dumpers take SIGUSR1/2
+    if (options.trace_events > 0 &&
+        (trace_init(options.trace_events) < 0 || dump_on_signal(SIGUSR1, options.trace_file, trace_dump) < 0)) {
+        perror("failed to start tracing");
+        exit(1);
+    }
+    if (options.profile_hz > 0 &&
+        (profile_init(options.profile_hz) < 0 || dump_on_signal(SIGUSR2, options.profile_file, profile_dump) < 0)) {
+        perror("failed to start profiler");
+        exit(1);
+    }
+
+    log_config.writers = options.threads;
+    server_log log = create_log_with_config(&log_config);
     if (!log) {
         perror("failed to init log");
         exit(1);
     }
-    getargs(&port, argc, argv);
+    // One thread pushes new log entries to every subscriber
+    log_stream stream = create_log_stream(log);
+    if (!stream) {
+        perror("failed to start log stream");
+        exit(1);
+    }
+    pthread_t shutdown;
+    if (pthread_create(&shutdown, NULL, shutdown_thread, stream) != 0) {
+        perror("Failed to create thread");
+        exit(1);
+    }
+
+    // Per-worker counters, one cache line each
+    threads_stats stats = create_threads_stats(options.threads);
+    server_metrics metrics = stats ? create_metrics(stats, options.threads) : NULL;
+    if (!metrics) {
+        perror("failed to init metrics");
+        exit(1);
+    }
+
+    limiter limiter = NULL;
+    if (options.limit != LIMITER_OFF) {
+        int max = options.limit_max ? options.limit_max : options.threads + options.queue_size;
+        limiter = create_limiter(options.limit, options.threads, 1, max, options.limit_target);
+        if (!limiter) {
+            perror("failed to init concurrency limiter");
+            exit(1);
+        }
+        metrics_attach_limiter(metrics, limiter);
+    }
 
-    // Make request queue
-    struct request_queue_t* queue = create_queue(QUEUE_SIZE);
-    
-    // make worker thread argument and threads
-    pthread_t *threads = malloc(POOL_SIZE * sizeof(pthread_t));
-    worker_unit *thread_args = malloc(POOL_SIZE * sizeof(worker_unit));
+    // One request queue per acceptor, splitting the queue size between them
+    int shards = options.acceptors;
+    int shard_size = (options.queue_size + shards - 1) / shards;
+    struct request_queue_t **queues = malloc(shards * sizeof(struct request_queue_t *));
+    for (int k = 0; queues && k < shards; ++k) {
+        queues[k] = create_queue_with_order(shard_size, options.order);
+        if (!queues[k]) {
+            free(queues);
+            queues = NULL;
+        }
+    }
+    if (!queues) {
+        perror("failed to init request queue");
+        exit(1);
+    }
 
-    for (int i = 0; i < POOL_SIZE; ++i) {
-        thread_args[i].stats = malloc(sizeof(struct Threads_stats));
+    // make worker thread argument and threads. Worker i serves queue
+    // i % shards, so with as many CPUs as acceptors it shares a CPU with
+    // that queue's acceptor
+    pthread_t *threads = malloc(options.threads * sizeof(pthread_t));
+    worker_unit *thread_args = malloc(options.threads * sizeof(worker_unit));
 
+    for (int i = 0; i < options.threads; ++i) {
         // set up thread arguments
-        thread_args[i].stats->id = i + 1;          // Thread ID
-        thread_args[i].stats->stat_req = 0;    // Static request count
-        thread_args[i].stats->dynm_req = 0;    // Dynamic request count
-        thread_args[i].stats->post_req = 0;    // POST request count
-        thread_args[i].stats->total_req = 0;   // Total request count
-        thread_args[i].queue = queue;          // Request queue
+        thread_args[i].stats = &stats[i];      // Thread ID and request counts
+        thread_args[i].queue = queues[i % shards];  // Request queue
         thread_args[i].log = log;              // Server log
+        thread_args[i].stream = stream;        // Log subscriptions
+        thread_args[i].metrics = metrics;      // Latency histograms
+        thread_args[i].limiter = limiter;      // Concurrency limit
+        thread_args[i].cpu = options.cpus ? options.cpus[i % options.ncpus] : -1;
+
+        spawn_pinned(&threads[i], thread_args[i].cpu, worker_thread, &thread_args[i]);
+    }
 
-        if(pthread_create(&threads[i], NULL, worker_thread, &thread_args[i]) != 0) {
-            perror("Failed to create thread");
+    // Every socket is open before any acceptor runs, so a port in use
+    // stops the server at once
+    pthread_t *acceptors = malloc(shards * sizeof(pthread_t));
+    acceptor_unit *acceptor_args = malloc(shards * sizeof(acceptor_unit));
+    for (int k = 0; k < shards; ++k) {
+        acceptor_args[k].cpu = options.cpus ? options.cpus[k % options.ncpus] : -1;
+        acceptor_args[k].listenfd = open_listener(port, shards > 1, acceptor_args[k].cpu, options.kernel_timestamps);
+        acceptor_args[k].queue = queues[k];
+        acceptor_args[k].metrics = metrics;
+        acceptor_args[k].limiter = limiter;
+        acceptor_args[k].options = &options;
+    }
+    for (int k = 1; k < shards; ++k) {
+        spawn_pinned(&acceptors[k], acceptor_args[k].cpu, acceptor_thread, &acceptor_args[k]);
+    }
+    // The main thread is the first acceptor
+    if (acceptor_args[0].cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(acceptor_args[0].cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "cannot pin a thread to CPU %d\n", acceptor_args[0].cpu);
             exit(1);
         }
     }
+    acceptor_thread(&acceptor_args[0]);
 
-
-    listenfd = Open_listenfd(port);
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *) &clientlen);
-
-        queue_enqueue(queue, connfd, arrival); // make sure the queue is not full
-    }
     // Clean up the server log before exiting
-    for (int i = 0; i < POOL_SIZE; ++i) {
-        free(thread_args[i].stats);
+    for (int i = 0; i < options.threads; ++i) {
         pthread_cancel(threads[i]);
         pthread_join(threads[i], NULL);
     }
     free(thread_args);
     free(threads);
-    queue_destroy(queue); // Clean up the request queue TODO
+    free(acceptor_args);
+    free(acceptors);
+    for (int k = 0; k < shards; ++k) {
+        queue_destroy(queues[k]);
+    }
+    free(queues);
+    free(options.cpus);
+    destroy_log_stream(stream);
+    destroy_metrics(metrics);
+    destroy_limiter(limiter);
+    free(stats);
     destroy_log(log);
 
 }
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "signal_dump.h"
+
+struct Signal_dump {
+    sigset_t set;
+    const char* path;
+    int (*dump)(char** dst);
+};
+
+static void* signal_thread(void* arg) {
+    struct Signal_dump* sig = (struct Signal_dump*)arg;
+    int signo;
+    while (sigwait(&sig->set, &signo) == 0) {
+        char* text = NULL;
+        int len = sig->dump(&text);
+        int fd = open(sig->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open dump file");
+        } else {
+            for (int off = 0; off < len; ) {
+                ssize_t n = write(fd, text + off, len - off);
+                if (n <= 0) {
+                    perror("write dump file");
+                    break;
+                }
+                off += n;
+            }
+            close(fd);
+        }
+        free(text);
+    }
+    return NULL;
+}
+
+int dump_on_signal(int signo, const char* path, int (*dump)(char** dst)) {
+    struct Signal_dump* sig = (struct Signal_dump*)malloc(sizeof(struct Signal_dump));
+    if (!sig) return -1;
+    sig->path = path;
+    sig->dump = dump;
+    sigemptyset(&sig->set);
+    sigaddset(&sig->set, signo);
+    // Threads created from here on inherit the mask. The waiting thread starts
+    // with every signal blocked, so it never takes another dumper's signal.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_t thread;
+    if (pthread_sigmask(SIG_BLOCK, &sig->set, &old) != 0) {
+        free(sig);
+        return -1;
+    }
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    int err = pthread_create(&thread, NULL, signal_thread, sig);
+    sigaddset(&old, signo);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        free(sig);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
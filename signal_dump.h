@@ -0,0 +1,11 @@
+#ifndef SIGNAL_DUMP_H
+#define SIGNAL_DUMP_H
+
+// Writes dump()'s output (see trace_dump, profile_dump) to `path` whenever
+// the process receives signal signo. A thread waits for the signal with
+// sigwait, so nothing runs in a signal handler. Must be called before any
+// other thread is started, since signo gets blocked in every thread but the
+// waiting one. Returns -1 on failure.
+int dump_on_signal(int signo, const char* path, int (*dump)(char** dst));
+
+#endif // SIGNAL_DUMP_H
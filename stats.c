@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "log.h"
+#include "counter.h"
+
+threads_stats create_threads_stats(int workers) {
+    threads_stats stats = (threads_stats)aligned_alloc(64, workers * sizeof(struct Threads_stats));
+    if (!stats) return NULL;
+    memset(stats, 0, workers * sizeof(struct Threads_stats));
+    for (int i = 0; i < workers; i++) {
+        stats[i].id = i + 1;
+    }
+    return stats;
+}
+
+void stats_count(threads_stats t_stats, int req_class) {
+    unsigned long seq = atomic_load_explicit(&t_stats->seq, memory_order_relaxed);
+    atomic_store_explicit(&t_stats->seq, seq + 1, memory_order_relaxed);
+    // Readers that see a counter change also see the odd seq
+    atomic_thread_fence(memory_order_release);
+    counter_add(&t_stats->total_req, 1);
+    switch (req_class) {
+        case LOG_CLASS_STATIC:  counter_add(&t_stats->stat_req, 1); break;
+        case LOG_CLASS_DYNAMIC: counter_add(&t_stats->dynm_req, 1); break;
+        case LOG_CLASS_POST:    counter_add(&t_stats->post_req, 1); break;
+    }
+    atomic_store_explicit(&t_stats->seq, seq + 2, memory_order_release);
+}
+
+void stats_snapshot(threads_stats t_stats, struct Stats_snapshot* out) {
+    unsigned long before, after;
+    out->id = t_stats->id;
+    do {
+        before = atomic_load_explicit(&t_stats->seq, memory_order_acquire);
+        out->stat_req = atomic_load_explicit(&t_stats->stat_req, memory_order_relaxed);
+        out->dynm_req = atomic_load_explicit(&t_stats->dynm_req, memory_order_relaxed);
+        out->post_req = atomic_load_explicit(&t_stats->post_req, memory_order_relaxed);
+        out->total_req = atomic_load_explicit(&t_stats->total_req, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&t_stats->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
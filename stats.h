@@ -0,0 +1,41 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdatomic.h>
+
+// Per-worker request counters.
+// Every worker owns one block, aligned and padded to a cache line so that
+// workers never share one, and is its only writer. Counts are 64-bit and
+// updated with relaxed atomics inside a seqlock, so any thread can take a
+// consistent snapshot with stats_snapshot without slowing the worker down.
+
+typedef struct Threads_stats {
+    int id;                      // Thread ID
+    _Atomic unsigned long seq;   // Odd while the owner is updating
+    _Atomic long stat_req;       // Number of static requests handled
+    _Atomic long dynm_req;       // Number of dynamic requests handled
+    _Atomic long post_req;       // Number of POST requests handled
+    _Atomic long total_req;      // Total number of requests handled
+} __attribute__((aligned(64))) * threads_stats;
+
+// A consistent copy of a worker's counters
+struct Stats_snapshot {
+    int id;
+    long stat_req;
+    long dynm_req;
+    long post_req;
+    long total_req;
+};
+
+// Allocates zeroed counters for workers numbered 1..workers, one block each
+// (free with free())
+threads_stats create_threads_stats(int workers);
+
+// Counts one handled request in the total and, for LOG_CLASS_STATIC,
+// DYNAMIC and POST, in its class (errors and other requests only count in
+// the total). Owner only.
+void stats_count(threads_stats t_stats, int req_class);
+
+// Copies the counters as they were at one instant. Safe from any thread.
+void stats_snapshot(threads_stats t_stats, struct Stats_snapshot* out);
+
+#endif // STATS_H
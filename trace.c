@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "out_buf.h"
+#include "push_list.h"
+#include "clock.h"
+
+// One span. Fields are atomics only so a dump may read a slot while its
+// owner overwrites it (see trace_dump).
+struct Trace_event {
+    const char* _Atomic name;
+    _Atomic long start;   // Nanoseconds, CLOCK_MONOTONIC
+    _Atomic long dur;
+};
+
+// A thread's ring: slot i % size holds event number i; head counts events
+struct Trace_ring {
+    struct Push_node node;
+    int tid;
+    _Atomic unsigned long head;
+    struct Trace_event events[];
+};
+
+int trace_enabled = 0;
+static unsigned long ring_size;
+static struct Push_node* _Atomic rings;   // Every thread's ring
+static __thread struct Trace_ring* local_ring;
+
+int trace_init(int events) {
+    if (events <= 0) return -1;
+    ring_size = 1;
+    while (ring_size < (unsigned long)events) ring_size <<= 1;
+    trace_enabled = 1;
+    return 0;
+}
+
+void trace_thread_init() {
+    if (!trace_enabled || local_ring) return;
+    struct Trace_ring* ring = (struct Trace_ring*)calloc(1, sizeof(struct Trace_ring) +
+                                                         ring_size * sizeof(struct Trace_event));
+    if (!ring) {
+        perror("Malloc failed");
+        return;
+    }
+    ring->tid = (int)syscall(SYS_gettid);
+    push_list_add(&rings, &ring->node);
+    local_ring = ring;
+}
+
+long trace_now() {
+    return monotonic_nsec();
+}
+
+void trace_record(const char* name, long start, long end) {
+    struct Trace_ring* ring = local_ring;
+    if (!ring) return;
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct Trace_event* event = &ring->events[head & (ring_size - 1)];
+    // A dump that sees any of these stores also sees head at least this
+    // event's number, and so knows the slot's old event is gone
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&event->name, name, memory_order_relaxed);
+    atomic_store_explicit(&event->start, start, memory_order_relaxed);
+    atomic_store_explicit(&event->dur, end - start, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// An event copied out of a ring
+struct Trace_span {
+    const char* name;
+    long start, dur;
+};
+
+// Copies out the ring's events that were not overwritten while reading
+static void dump_ring(struct Trace_ring* ring, struct Out_buf* out, int pid, int* first) {
+    unsigned long end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long begin = end > ring_size ? end - ring_size : 0;
+    unsigned long count = end - begin;
+    struct Trace_span* copy = (struct Trace_span*)malloc(count * sizeof(struct Trace_span) + 1);
+    if (!copy) {
+        perror("Malloc failed");
+        return;
+    }
+    for (unsigned long i = begin; i < end; i++) {
+        struct Trace_event* event = &ring->events[i & (ring_size - 1)];
+        copy[i - begin].name = atomic_load_explicit(&event->name, memory_order_relaxed);
+        copy[i - begin].start = atomic_load_explicit(&event->start, memory_order_relaxed);
+        copy[i - begin].dur = atomic_load_explicit(&event->dur, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    // Event number `head` may be half written over event head - ring_size
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long valid = head >= ring_size ? head - ring_size + 1 : 0;
+    for (unsigned long i = begin > valid ? begin : valid; i < end; i++) {
+        struct Trace_span* span = &copy[i - begin];
+        out_printf(out, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                   *first ? "" : ",", span->name, span->start / 1e3, span->dur / 1e3, pid, ring->tid);
+        *first = 0;
+    }
+    free(copy);
+}
+
+int trace_dump(char** dst) {
+    *dst = NULL;
+    struct Out_buf out;
+    if (out_init(&out) < 0) return 0;
+    int pid = (int)getpid();
+    int first = 1;
+    out_printf(&out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (struct Push_node* node = atomic_load(&rings); node; node = node->next) {
+        dump_ring((struct Trace_ring*)node, &out, pid, &first);
+    }
+    out_printf(&out, "\n]}\n");
+    if (!out.buf) return 0;
+    *dst = out.buf;
+    return (int)out.len;
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Per-request phase tracing, exported in Chrome trace JSON (chrome://tracing,
+// Perfetto).
+// Each registered thread records spans into its own ring of the newest
+// events: a span is a name, a CLOCK_MONOTONIC start and a duration. Recording
+// takes no lock and never allocates; a dump copies the rings while they are
+// being written and skips events overwritten meanwhile.
+// While tracing is off, trace_begin is a load and a branch and trace_end a
+// branch.
+
+// Set by trace_init; read on every trace_begin
+extern int trace_enabled;
+
+// Turns tracing on with a ring of `events` spans per thread (rounded up to a
+// power of two). Returns -1 on failure.
+int trace_init(int events);
+
+// Gives the calling thread a ring (call once, when the thread starts).
+// Threads without one record nothing.
+void trace_thread_init();
+
+long trace_now();
+
+// Returns the start time of a span, or 0 while tracing is off
+static inline long trace_begin() {
+    return trace_enabled ? trace_now() : 0;
+}
+
+// Records a span that started at `start` (from trace_begin) and ends now.
+// name must be a string literal (only the pointer is stored).
+void trace_record(const char* name, long start, long end);
+
+static inline void trace_end(const char* name, long start) {
+    if (start) trace_record(name, start, trace_now());
+}
+
+// Renders every thread's ring as Chrome trace JSON into dst (caller frees).
+// Returns the length.
+int trace_dump(char** dst);
+
+#endif // TRACE_H